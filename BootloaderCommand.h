@@ -1,7 +1,77 @@
 #pragma once
+#include <string.h>
+#include <stddef.h>
 #include "bl_cmd_types.h"
 #include "bl_utils.h"
-#include <memory>
+#include "Packet_Pool.h"
+#include "Packet_View.h"
+
+/* Compile-time frames: fixed commands are serialized and CRC'd by the compiler */
+
+/**
+ * @brief Serialized command of N bytes
+ */
+template <size_t N>
+struct BL_Frame
+{
+	uint8_t bytes[N];
+};
+
+/* Same CRC as bl_calculate_command_crc, usable in constant expressions */
+template <size_t N>
+constexpr uint32_t bl_frame_crc(const BL_Frame<N>& frame)
+{
+	uint32_t crc = BL_CRC_INIT;
+	for (size_t i = 0; i < N; i++) {
+		if (i >= offsetof(BL_CommandHeader_t, CRC32) && i < offsetof(BL_CommandHeader_t, CRC32) + sizeof(uint32_t))
+			continue;
+
+		crc ^= frame.bytes[i];
+		for (int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) * CRC32_POLY);
+	}
+	return ~crc;
+}
+
+template <size_t N>
+constexpr void bl_frame_put_le32(BL_Frame<N>& frame, size_t offset, uint32_t value)
+{
+	for (size_t i = 0; i < 4; i++)
+		frame.bytes[offset + i] = (uint8_t)(value >> (8 * i));
+}
+
+template <size_t N>
+constexpr uint32_t bl_frame_get_le32(const BL_Frame<N>& frame, size_t offset)
+{
+	return (uint32_t)frame.bytes[offset] | ((uint32_t)frame.bytes[offset + 1] << 8) |
+		((uint32_t)frame.bytes[offset + 2] << 16) | ((uint32_t)frame.bytes[offset + 3] << 24);
+}
+
+/**
+ * @brief Builds a command whose fields after the header are all 32-bit values
+ * @note  With constant arguments the whole frame is a constant expression
+ *
+ * @param id	ID of the command
+ * @param args	Fields after the header, in wire order
+ */
+template <class... Args>
+constexpr BL_Frame<sizeof(BL_CommandHeader_t) + 4 * sizeof...(Args)> bl_make_frame(BL_CommandID_t id, Args... args)
+{
+	BL_Frame<sizeof(BL_CommandHeader_t) + 4 * sizeof...(Args)> frame = {};
+	const uint32_t values[] = { (uint32_t)args..., 0 };
+
+	bl_frame_put_le32(frame, offsetof(BL_CommandHeader_t, payload_size), sizeof(frame.bytes));
+	frame.bytes[offsetof(BL_CommandHeader_t, cmd_id)] = (uint8_t)id;
+	for (size_t i = 0; i < sizeof...(Args); i++)
+		bl_frame_put_le32(frame, sizeof(BL_CommandHeader_t) + 4 * i, values[i]);
+	bl_frame_put_le32(frame, offsetof(BL_CommandHeader_t, CRC32), bl_frame_crc(frame));
+
+	return frame;
+}
+
+/* 0xCC5F5175 is the CRC bl_calculate_command_crc gives the VER command */
+static_assert(bl_frame_get_le32(bl_make_frame(BL_VER_CMD_ID), offsetof(BL_CommandHeader_t, CRC32)) == 0xCC5F5175UL,
+	"compile-time CRC differs from bl_calculate_command_crc");
 
 class BootloaderCommand
 {
@@ -15,304 +85,337 @@ public:
 	virtual ~BootloaderCommand() {}
 };
 
-class BL_VER_CMD_Builder : public BootloaderCommand
+/**
+ * @brief Builds a Command through a Packet_Writer laid out as Layout
+ * @note  The writer points into the builder's own command, so builders are not copyable
+ */
+template <class Command, class Layout>
+class BL_View_Builder : public BootloaderCommand
 {
 public:
-	BL_VER_CMD_Builder()
+	BL_View_Builder(BL_CommandID_t id, uint32_t payload_size) : packet(cmd.serialized_data, sizeof(Command))
 	{
-		cmd.data.header.payload_size = sizeof(BL_VER_CMD);
-		cmd.data.header.cmd_id = BL_VER_CMD_ID;
+		packet.template Set<typename Layout::PayloadSize>(payload_size);
+		packet.template Set<typename Layout::CmdId>(id);
 	}
 
-	BL_VER_CMD build()
+	BL_View_Builder(const BL_View_Builder& obj) = delete;
+
+	Command build()
 	{
-		cmd.data.header.CRC32 = bl_calculate_command_crc(&cmd, sizeof(BL_VER_CMD));
+		packet.template Set<typename Layout::Crc>(bl_calculate_command_crc(&cmd, packet.template Get<typename Layout::PayloadSize>()));
 		return cmd;
 	}
 
-private:
-	BL_VER_CMD cmd;
+protected:
+	Command cmd;
+	Packet_Writer<Layout> packet;
 };
 
-class BL_FLASH_ERASE_CMD_Builder : public BootloaderCommand
+class BL_VER_CMD_Builder : public BL_View_Builder<BL_VER_CMD, BL_Layout::Header>
 {
 public:
-	BL_FLASH_ERASE_CMD_Builder()
-	{
-		cmd.data.header.payload_size = sizeof(BL_FLASH_ERASE_CMD);
-		cmd.data.header.cmd_id = BL_FLASH_ERASE_CMD_ID;
-	}
+	BL_VER_CMD_Builder() : BL_View_Builder(BL_VER_CMD_ID, sizeof(BL_VER_CMD)) {}
+};
+
+class BL_FLASH_ERASE_CMD_Builder : public BL_View_Builder<BL_FLASH_ERASE_CMD, BL_Layout::FlashErase>
+{
+public:
+	BL_FLASH_ERASE_CMD_Builder() : BL_View_Builder(BL_FLASH_ERASE_CMD_ID, sizeof(BL_FLASH_ERASE_CMD)) {}
 
 	BL_FLASH_ERASE_CMD_Builder& setPageNumber(uint32_t page_number)
 	{
-		cmd.data.address = page_number; // Set the page_number field
+		packet.Set<Layout::Address>(page_number);
 		return *this;
 	}
 
 	BL_FLASH_ERASE_CMD_Builder& setPageCount(uint32_t page_count)
 	{
-		cmd.data.page_count = page_count; // Set the page_count field
+		packet.Set<Layout::PageCount>(page_count);
 		return *this;
 	}
 
-	BL_FLASH_ERASE_CMD build()
-	{
-		cmd.data.header.CRC32 = bl_calculate_command_crc(&cmd, sizeof(BL_FLASH_ERASE_CMD));
-		return cmd;
-	}
-
 private:
-	BL_FLASH_ERASE_CMD cmd;
+	typedef BL_Layout::FlashErase Layout;
 };
 
-class BL_MEM_WRITE_CMD_Builder : public BootloaderCommand
+class BL_MEM_WRITE_CMD_Builder : public BL_View_Builder<BL_MEM_WRITE_CMD, BL_Layout::MemWrite>
 {
 public:
-	BL_MEM_WRITE_CMD_Builder()
-	{
-		cmd.data.header.payload_size = sizeof(BL_MEM_WRITE_CMD);
-		cmd.data.header.cmd_id = BL_MEM_WRITE_CMD_ID;
-	}
+	BL_MEM_WRITE_CMD_Builder() : BL_View_Builder(BL_MEM_WRITE_CMD_ID, sizeof(BL_MEM_WRITE_CMD)) {}
 
 	BL_MEM_WRITE_CMD_Builder& setStartAddress(std::uint32_t startAddress)
 	{
-		cmd.data.start_address = startAddress; // Set the start_address field
+		packet.Set<Layout::StartAddress>(startAddress);
 		return *this;
 	}
 
-	BL_MEM_WRITE_CMD build()
-	{
-		cmd.data.header.CRC32 = bl_calculate_command_crc(&cmd, sizeof(BL_MEM_WRITE_CMD));
-		return cmd;
-	}
-
 private:
-	BL_MEM_WRITE_CMD cmd;
+	typedef BL_Layout::MemWrite Layout;
 };
 
-class BL_DATA_PACKET_CMD_Builder : public BootloaderCommand
+class BL_DATA_PACKET_CMD_Builder : public BL_View_Builder<BL_DATA_PACKET_CMD, BL_Layout::DataPacket>
 {
 public:
-	BL_DATA_PACKET_CMD_Builder()
-	{
-
-		cmd.data.header.cmd_id = BL_DATA_PACKET_CMD_ID;
-	}
+	BL_DATA_PACKET_CMD_Builder() : BL_View_Builder(BL_DATA_PACKET_CMD_ID, Layout::data_offset) {}
 
 	BL_DATA_PACKET_CMD_Builder& setEndFlag(bool flag)
 	{
-		cmd.data.end_flag = flag;
+		packet.Set<Layout::EndFlag>(flag);
 		return *this;
 	}
 
-	BL_DATA_PACKET_CMD_Builder& setData(uint8_t data[], uint32_t data_size)
+	/* A block larger than BL_DATA_BLOCK_SIZE is not copied and makes the builder invalid */
+	BL_DATA_PACKET_CMD_Builder& setData(const uint8_t data[], uint32_t data_size)
 	{
-		memcpy(cmd.data.data_block, data, data_size);
-		cmd.data.data_len = data_size;
-		cmd.data.header.payload_size = sizeof(BL_DATA_PACKET_CMD) - BL_DATA_BLOCK_SIZE + data_size;
+		uint8_t* block = packet.Data(data_size);
+		if (block == nullptr)
+		{
+			valid = false;
+			return *this;
+		}
+
+		memcpy(block, data, data_size);
+		packet.Set<Layout::DataLen>(data_size);
+		packet.Set<Layout::PayloadSize>(Layout::data_offset + data_size);
 		return *this;
 	}
 
 	BL_DATA_PACKET_CMD_Builder& setNextBlockLen(uint32_t next_data_len)
 	{
-		/* If there's no next, set to zero*/
-		if (next_data_len == 0)
-			cmd.data.next_len = 0;
-		else
-			/* If there's a next block, calculate the whole packet size including data,
-			subtract size of pointer because we will send the array it points to not the pointer */
-			cmd.data.next_len = sizeof(BL_DATA_PACKET_CMD) - BL_DATA_BLOCK_SIZE + next_data_len;
-
+		/* If there's no next, set to zero, otherwise the whole size of the next packet */
+		packet.Set<Layout::NextLen>(next_data_len ? Layout::data_offset + next_data_len : 0);
 		return *this;
 	}
 
-	BL_DATA_PACKET_CMD build()
+	/* False once the data did not fit */
+	bool isValid() const
 	{
-		cmd.data.header.CRC32 = bl_calculate_command_crc(&cmd, cmd.data.header.payload_size);
-		return cmd;
+		return valid;
 	}
 
 private:
-	BL_DATA_PACKET_CMD cmd;
+	typedef BL_Layout::DataPacket Layout;
+
+	bool valid = true;
 };
 
-class BL_MEM_READ_CMD_Builder : public BootloaderCommand
+class BL_MEM_READ_CMD_Builder : public BL_View_Builder<BL_MEM_READ_CMD, BL_Layout::MemRead>
 {
 public:
-	BL_MEM_READ_CMD_Builder()
-	{
-		cmd.data.header.payload_size = sizeof(BL_MEM_READ_CMD);
-		cmd.data.header.cmd_id = BL_MEM_READ_CMD_ID;
-	}
+	BL_MEM_READ_CMD_Builder() : BL_View_Builder(BL_MEM_READ_CMD_ID, sizeof(BL_MEM_READ_CMD)) {}
 
 	BL_MEM_READ_CMD_Builder& setStartAddress(std::uint32_t start_address)
 	{
-		cmd.data.start_addr = start_address; // Set the page_number field
+		packet.Set<Layout::StartAddress>(start_address);
 		return *this;
 	}
 
 	BL_MEM_READ_CMD_Builder& setLength(std::uint32_t length)
 	{
-		cmd.data.length = length; // Set the length field
+		packet.Set<Layout::Length>(length);
 		return *this;
 	}
 
-	BL_MEM_READ_CMD build()
-	{
-		cmd.data.header.CRC32 = bl_calculate_command_crc(&cmd, sizeof(BL_MEM_READ_CMD));
-		return cmd;
-	}
-
 private:
-	BL_MEM_READ_CMD cmd;
+	typedef BL_Layout::MemRead Layout;
 };
 
-class BL_GOTO_ADDR_CMD_Builder : public BootloaderCommand
+class BL_MEM_READ_STREAM_CMD_Builder : public BL_View_Builder<BL_MEM_READ_STREAM_CMD, BL_Layout::MemReadStream>
 {
 public:
-	BL_GOTO_ADDR_CMD_Builder()
+	BL_MEM_READ_STREAM_CMD_Builder() : BL_View_Builder(BL_MEM_READ_CMD_ID, sizeof(BL_MEM_READ_STREAM_CMD)) {}
+
+	BL_MEM_READ_STREAM_CMD_Builder& setStartAddress(std::uint32_t start_address)
 	{
-		cmd.data.header.payload_size = sizeof(cmd.data);
-		cmd.data.header.cmd_id = BL_GOTO_ADDR_CMD_ID;
+		packet.Set<Layout::StartAddress>(start_address);
+		return *this;
 	}
 
-	BL_GOTO_ADDR_CMD_Builder& setAddress(uint32_t address)
+	BL_MEM_READ_STREAM_CMD_Builder& setLength(std::uint32_t length)
 	{
-		cmd.data.address = address; // Set the address field
+		packet.Set<Layout::Length>(length);
 		return *this;
 	}
 
-	BL_GOTO_ADDR_CMD build()
+	BL_MEM_READ_STREAM_CMD_Builder& setWindow(std::uint8_t window)
 	{
-		cmd.data.header.CRC32 = bl_calculate_command_crc(&cmd, sizeof(BL_GOTO_ADDR_CMD));
-		return cmd;
+		packet.Set<Layout::Window>(window);
+		return *this;
 	}
 
 private:
-	BL_GOTO_ADDR_CMD cmd;
+	typedef BL_Layout::MemReadStream Layout;
 };
 
-class BL_ENTER_CMD_MODE_CMD_Builder : public BootloaderCommand
+class BL_GOTO_ADDR_CMD_Builder : public BL_View_Builder<BL_GOTO_ADDR_CMD, BL_Layout::GotoAddr>
 {
 public:
-	BL_ENTER_CMD_MODE_CMD_Builder()
+	BL_GOTO_ADDR_CMD_Builder() : BL_View_Builder(BL_GOTO_ADDR_CMD_ID, sizeof(BL_GOTO_ADDR_CMD)) {}
+
+	BL_GOTO_ADDR_CMD_Builder& setAddress(uint32_t address)
 	{
-		cmd.data.header.payload_size = sizeof(BL_ENTER_CMD_MODE_CMD);
-		cmd.data.header.cmd_id = BL_ENTER_CMD_MODE_CMD_ID;
+		packet.Set<Layout::Address>(address);
+		return *this;
 	}
 
+private:
+	typedef BL_Layout::GotoAddr Layout;
+};
+
+class BL_ENTER_CMD_MODE_CMD_Builder : public BL_View_Builder<BL_ENTER_CMD_MODE_CMD, BL_Layout::KeyCommand>
+{
+public:
+	BL_ENTER_CMD_MODE_CMD_Builder() : BL_View_Builder(BL_ENTER_CMD_MODE_CMD_ID, sizeof(BL_ENTER_CMD_MODE_CMD)) {}
+
 	BL_ENTER_CMD_MODE_CMD_Builder& setKey(uint32_t key)
 	{
-		cmd.data.key = key;
+		packet.Set<BL_Layout::KeyCommand::Key>(key);
 		return *this;
 	}
+};
+
+class BL_JUMP_TO_APP_CMD_Builder : public BL_View_Builder<BL_JUMP_TO_APP_CMD, BL_Layout::KeyCommand>
+{
+public:
+	BL_JUMP_TO_APP_CMD_Builder() : BL_View_Builder(BL_JUMP_TO_APP_CMD_ID, sizeof(BL_JUMP_TO_APP_CMD)) {}
 
-	BL_ENTER_CMD_MODE_CMD build()
+	BL_JUMP_TO_APP_CMD_Builder& setKey(uint32_t key)
 	{
-		cmd.data.header.CRC32 = bl_calculate_command_crc(&cmd, sizeof(BL_ENTER_CMD_MODE_CMD));
-		return cmd;
+		packet.Set<BL_Layout::KeyCommand::Key>(key);
+		return *this;
 	}
-
-private:
-	BL_ENTER_CMD_MODE_CMD cmd;
 };
 
-class BL_JUMP_TO_APP_CMD_Builder : public BootloaderCommand
+class BL_BATCH_CMD_Builder : public BL_View_Builder<BL_BATCH_CMD, BL_Layout::Batch>
 {
 public:
-	BL_JUMP_TO_APP_CMD_Builder()
+	BL_BATCH_CMD_Builder() : BL_View_Builder(BL_BATCH_CMD_ID, Layout::data_offset)
 	{
-		cmd.data.header.payload_size = sizeof(BL_JUMP_TO_APP_CMD);
-		cmd.data.header.cmd_id = BL_JUMP_TO_APP_CMD_ID;
+		packet.Set<Layout::Count>(0);
 	}
 
-	BL_JUMP_TO_APP_CMD_Builder& setKey(uint32_t key)
+	/* Appends a built command, which keeps its own header and CRC */
+	template <class T>
+	BL_BATCH_CMD_Builder& add(const T& sub_command)
 	{
-		cmd.data.key = key;
+		Packet_View<BL_Layout::Header> header(sub_command.serialized_data, sizeof(T));
+		uint32_t size = header.Get<BL_Layout::Header::PayloadSize>();
+		uint8_t id = header.Get<BL_Layout::Header::CmdId>();
+		uint32_t used = packet.Get<Layout::PayloadSize>();
+		uint8_t count = packet.Get<Layout::Count>();
+
+		if (id == BL_MEM_WRITE_CMD_ID || id == BL_MEM_READ_CMD_ID || id == BL_DATA_PACKET_CMD_ID ||
+			count == BL_BATCH_MAX_COMMANDS || used + size > BL_BATCH_MAX_SIZE)
+		{
+			valid = false;
+			return *this;
+		}
+
+		/* Sub-commands are packed behind the ones already added */
+		uint8_t* commands = packet.Data(used + size - Layout::data_offset);
+		memcpy(commands + used - Layout::data_offset, sub_command.serialized_data, size);
+		packet.Set<Layout::PayloadSize>(used + size);
+		packet.Set<Layout::Count>(count + 1);
 		return *this;
 	}
 
-	BL_JUMP_TO_APP_CMD build()
+	/* False once a sub-command could not be added */
+	bool isValid() const
 	{
-		cmd.data.header.CRC32 = bl_calculate_command_crc(&cmd, sizeof(BL_JUMP_TO_APP_CMD));
-		return cmd;
+		return valid && packet.Get<Layout::Count>() > 0;
 	}
 
 private:
-	BL_JUMP_TO_APP_CMD cmd;
+	typedef BL_Layout::Batch Layout;
+
+	bool valid = true;
 };
 
-std::unique_ptr<BL_GOTO_ADDR_CMD> CreateGotoAddrCommand(uint32_t address)
+inline BL_PacketPtr<BL_GOTO_ADDR_CMD> CreateGotoAddrCommand(uint32_t address)
 {
 	BL_GOTO_ADDR_CMD_Builder builder;
 	BL_GOTO_ADDR_CMD cmd = builder
 		.setAddress(address)
 		.build();
-	return std::make_unique<BL_GOTO_ADDR_CMD>(cmd);
+	return bl_make_packet(cmd);
 }
 
-std::unique_ptr<BL_MEM_WRITE_CMD> CreateMemWriteCommand(uint32_t startAddress)
+inline BL_PacketPtr<BL_MEM_WRITE_CMD> CreateMemWriteCommand(uint32_t startAddress)
 {
 	BL_MEM_WRITE_CMD_Builder builder;
 	BL_MEM_WRITE_CMD cmd = builder
 		.setStartAddress(startAddress)
 		.build();
-	return std::make_unique<BL_MEM_WRITE_CMD>(cmd);
+	return bl_make_packet(cmd);
 }
 
-std::unique_ptr<BL_MEM_READ_CMD> CreateMemReadCommand(uint32_t startAddress, uint32_t length)
+inline BL_PacketPtr<BL_MEM_READ_CMD> CreateMemReadCommand(uint32_t startAddress, uint32_t length)
 {
 	BL_MEM_READ_CMD_Builder builder;
 	BL_MEM_READ_CMD cmd = builder
 		.setStartAddress(startAddress)
 		.setLength(length)
 		.build();
-	return std::make_unique<BL_MEM_READ_CMD>(cmd);
+	return bl_make_packet(cmd);
+}
+
+inline BL_PacketPtr<BL_MEM_READ_STREAM_CMD> CreateMemReadStreamCommand(uint32_t startAddress, uint32_t length, uint8_t window)
+{
+	BL_MEM_READ_STREAM_CMD_Builder builder;
+	BL_MEM_READ_STREAM_CMD cmd = builder
+		.setStartAddress(startAddress)
+		.setLength(length)
+		.setWindow(window)
+		.build();
+	return bl_make_packet(cmd);
 }
 
-std::unique_ptr<BL_VER_CMD> CreateVerCommand()
+inline BL_PacketPtr<BL_VER_CMD> CreateVerCommand()
 {
 	BL_VER_CMD_Builder builder;
 	BL_VER_CMD cmd = builder.build();
-	return std::make_unique<BL_VER_CMD>(cmd);
+	return bl_make_packet(cmd);
 }
 
-std::unique_ptr<BL_FLASH_ERASE_CMD> CreateFlashEraseCommand(uint32_t startAddress, uint32_t page_count)
+inline BL_PacketPtr<BL_FLASH_ERASE_CMD> CreateFlashEraseCommand(uint32_t startAddress, uint32_t page_count)
 {
 	BL_FLASH_ERASE_CMD_Builder builder;
 	BL_FLASH_ERASE_CMD cmd = builder
 		.setPageNumber(startAddress)
 		.setPageCount(page_count)
 		.build();
-	return std::make_unique<BL_FLASH_ERASE_CMD>(cmd);
+	return bl_make_packet(cmd);
 }
 
-std::unique_ptr<BL_DATA_PACKET_CMD> CreateDataPacketCommand(uint8_t data[], uint32_t data_size, uint32_t next_block_len, bool end_flag)
+inline BL_PacketPtr<BL_DATA_PACKET_CMD> CreateDataPacketCommand(uint8_t data[], uint32_t data_size, uint32_t next_block_len, bool end_flag)
 {
 	BL_DATA_PACKET_CMD_Builder builder;
-	BL_DATA_PACKET_CMD cmd = builder
+	builder
 		.setData(data, data_size)
 		.setEndFlag(end_flag)
-		.setNextBlockLen(next_block_len)
-		.build();
+		.setNextBlockLen(next_block_len);
+	if (!builder.isValid())
+		return BL_PacketPtr<BL_DATA_PACKET_CMD>();
 
-	return std::make_unique<BL_DATA_PACKET_CMD>(cmd);
+	BL_DATA_PACKET_CMD cmd = builder.build();
+	return bl_make_packet(cmd);
 }
 
-std::unique_ptr<BL_JUMP_TO_APP_CMD> CreateJumpToAppCommand(uint32_t key)
+inline BL_PacketPtr<BL_JUMP_TO_APP_CMD> CreateJumpToAppCommand(uint32_t key)
 {
 	BL_JUMP_TO_APP_CMD_Builder builder;
 	BL_JUMP_TO_APP_CMD cmd = builder
 		.setKey(key)
 		.build();
-	return std::make_unique<BL_JUMP_TO_APP_CMD>(cmd);
+	return bl_make_packet(cmd);
 }
 
-std::unique_ptr<BL_ENTER_CMD_MODE_CMD> CreateEnterCmdModeCommand(uint32_t key)
+inline BL_PacketPtr<BL_ENTER_CMD_MODE_CMD> CreateEnterCmdModeCommand(uint32_t key)
 {
 	BL_ENTER_CMD_MODE_CMD_Builder builder;
 	BL_ENTER_CMD_MODE_CMD cmd = builder
 		.setKey(key)
 		.build();
-	return std::make_unique<BL_ENTER_CMD_MODE_CMD>(cmd);
+	return bl_make_packet(cmd);
 }
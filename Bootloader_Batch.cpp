@@ -0,0 +1,46 @@
+#include <Arduino.h>
+#include "Bootloader_Batch.h"
+#include "Utilities.h"
+
+Bootloader_Batch& Bootloader_Batch::EnterCmdMode() {
+	return Add(BL_ENTER_CMD_MODE_CMD_Builder().setKey(Bootloader_Host::ENTER_CMD_MODE_KEY).build());
+}
+
+Bootloader_Batch& Bootloader_Batch::Version() {
+	return Add(BL_VER_CMD_Builder().build());
+}
+
+Bootloader_Batch& Bootloader_Batch::FlashErase(uint32_t page_start_address, uint32_t page_count) {
+	return Add(BL_FLASH_ERASE_CMD_Builder().setPageNumber(page_start_address).setPageCount(page_count).build());
+}
+
+Bootloader_Batch& Bootloader_Batch::GotoAddr(uint32_t address) {
+	return Add(BL_GOTO_ADDR_CMD_Builder().setAddress(address).build());
+}
+
+Bootloader_Batch& Bootloader_Batch::JumpToApp() {
+	return Add(BL_JUMP_TO_APP_CMD_Builder().setKey(Bootloader_Host::JUMP_APP_KEY).build());
+}
+
+bool Bootloader_Batch::Send() {
+	result_count = 0;
+	if (!builder.isValid())
+	{
+		DEBUG_PRINTF("Batch of %d commands does not fit in one BATCH command", command_count);
+		return false;
+	}
+
+	Phase_Timer build_timer(host.metrics, Host_Phase::Build);
+	BL_BATCH_CMD cmd = builder.build();
+	build_timer.Stop();
+
+	return host.SendBatchCommand(cmd, results, &result_count);
+}
+
+uint8_t Bootloader_Batch::GetVersion() const {
+	for (uint8_t i = 0; i < result_count; i++) {
+		if (results[i].cmd_id == BL_VER_CMD_ID && results[i].ack)
+			return results[i].value;
+	}
+	return 0;
+}
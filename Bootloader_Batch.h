@@ -0,0 +1,56 @@
+#pragma once
+#include "Bootloader_Host.h"
+#include "BootloaderCommand.h"
+#include <stdint.h>
+
+/**
+ * @brief Composes several commands into one BATCH command sent in a single round trip.
+ *
+ * Usage:
+ *	Bootloader_Batch batch(*host);
+ *	bool status = batch.EnterCmdMode().Version().FlashErase(page, count).JumpToApp().Send();
+ */
+class Bootloader_Batch
+{
+public:
+	explicit Bootloader_Batch(Bootloader_Host& host) : host(host) {}
+
+	Bootloader_Batch& EnterCmdMode(void);
+	Bootloader_Batch& Version(void);
+	Bootloader_Batch& FlashErase(uint32_t page_start_address, uint32_t page_count);
+	Bootloader_Batch& GotoAddr(uint32_t address);
+	Bootloader_Batch& JumpToApp(void);
+
+	/**
+	 * @brief Sends the batch to the client
+	 *
+	 * @return true		If every command succeeded
+	 * @return false	If the batch did not fit, was rejected, or one of its commands failed
+	 */
+	bool Send(void);
+
+	uint8_t GetCommandCount() const { return command_count; }
+	uint8_t GetResultCount() const { return result_count; }
+	const BL_BATCH_RESULT& GetResult(uint8_t index) const { return results[index]; }
+
+	/**
+	 * @brief Gets the version reported by the first VER command of the batch
+	 *
+	 * @return uint8_t Version value of the client, 0 if none ran
+	 */
+	uint8_t GetVersion(void) const;
+
+private:
+	Bootloader_Host& host;
+	BL_BATCH_CMD_Builder builder;
+	uint8_t command_count = 0;
+	BL_BATCH_RESULT results[BL_BATCH_MAX_COMMANDS];
+	uint8_t result_count = 0;
+
+	template <class T>
+	Bootloader_Batch& Add(const T& cmd) {
+		builder.add(cmd);
+		command_count++;
+		return *this;
+	}
+};
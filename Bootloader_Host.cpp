@@ -6,34 +6,79 @@
 #include "Utilities.h"
 #include "bl_utils.h"
 #include "bl_cmd_types.h"
+#include "Host_Metrics.h"
+#include "Transfer_Checkpoint.h"
+#include "Packet_View.h"
+#include "Frame_Parser.h"
 
 Bootloader_Host* Bootloader_Host::instance = nullptr;
 
+typedef BL_Layout::DataPacket DataPacket;
+
+/* Fixed commands, serialized and CRC'd at compile time */
+static constexpr BL_Frame<sizeof(BL_VER_CMD)> ver_frame PROGMEM = bl_make_frame(BL_VER_CMD_ID);
+static constexpr BL_Frame<sizeof(BL_ENTER_CMD_MODE_CMD)> enter_cmd_mode_frame PROGMEM =
+	bl_make_frame(BL_ENTER_CMD_MODE_CMD_ID, Bootloader_Host::ENTER_CMD_MODE_KEY);
+static constexpr BL_Frame<sizeof(BL_JUMP_TO_APP_CMD)> jump_to_app_frame PROGMEM =
+	bl_make_frame(BL_JUMP_TO_APP_CMD_ID, Bootloader_Host::JUMP_APP_KEY);
+static constexpr BL_Frame<sizeof(BL_FLASH_ERASE_CMD)> mass_erase_frame PROGMEM =
+	bl_make_frame(BL_FLASH_ERASE_CMD_ID, BL_FLASH_ERASE_MASS, BL_FLASH_ERASE_MASS);
+static constexpr BL_Frame<sizeof(BL_FEC_CMD)> fec_on_frame PROGMEM = bl_make_frame(BL_FEC_CMD_ID, BL_FEC_SEGMENT_SIZE);
+static constexpr BL_Frame<sizeof(BL_FEC_CMD)> fec_off_frame PROGMEM = bl_make_frame(BL_FEC_CMD_ID, 0);
+
+/* SendConstCommand copies the frames out of flash into a buffer of this size */
+static constexpr size_t CONST_FRAME_CAPACITY = sizeof(BL_CommandHeader_t) + 8;
+static_assert(sizeof(ver_frame) <= CONST_FRAME_CAPACITY && sizeof(enter_cmd_mode_frame) <= CONST_FRAME_CAPACITY &&
+	sizeof(jump_to_app_frame) <= CONST_FRAME_CAPACITY && sizeof(mass_erase_frame) <= CONST_FRAME_CAPACITY &&
+	sizeof(fec_on_frame) <= CONST_FRAME_CAPACITY && sizeof(fec_off_frame) <= CONST_FRAME_CAPACITY,
+	"a constant frame does not fit the SendConstCommand buffer");
+
 Bootloader_Host* Bootloader_Host::getInstance() {
-	if (instance == nullptr) instance = new Bootloader_Host();
+	if (instance == nullptr) {
+		instance = new Bootloader_Host(MYPORT_RX, MYPORT_TX);
+		instance->Begin();
+	}
 	return instance;
 }
 
-Bootloader_Host::Bootloader_Host() {
-	pinMode(LED, OUTPUT);
-	digitalWrite(LED, HIGH);
-	myPort.begin(9600, SWSERIAL_8N1, MYPORT_RX, MYPORT_TX, false);
+Bootloader_Host::Bootloader_Host(int8_t rx_pin, int8_t tx_pin) : port(&myPort) {
+	myPort.begin(9600, SWSERIAL_8N1, rx_pin, tx_pin, false, BL_PORT_RX_CAPACITY);
 	if (!myPort) { // If the object did not initialize, then its configuration is invalid
 		Serial.println("Error initializing software serial");
-		while (1);
+		port_ready = false;
 	}
-	myPort.setTimeout(1000);
+}
 
-	//delay(100);
-	if (!SendEnterCmdModeCommand())
+Bootloader_Host::Bootloader_Host(Stream& transport) : port(&transport) {
+}
+
+bool Bootloader_Host::Begin(uint32_t sync_timeout_ms) {
+	this->sync_timeout_ms = sync_timeout_ms;
+	if (!port_ready)
+		return false;
+
+	pinMode(LED, OUTPUT);
+	digitalWrite(LED, HIGH);
+	port->setTimeout(1000);
+
+	/* A target that never answers must not get a command it would be waited on for */
+	if (!SyncClient(sync_timeout_ms)) {
+		Serial.println("Error synchronizing with the target");
+		return false;
+	}
+
+	bool status = SendEnterCmdModeCommand();
+	if (!status)
 	{
 		Serial.println("Error entering command mode");
 	}
 	delay(100);
 
+	return status;
 }
 
 void Bootloader_Host::blinkLED(int duration) {
+	Phase_Timer timer(metrics, Host_Phase::Indicator);
 	digitalWrite(LED, LOW);
 	delay(duration);
 	digitalWrite(LED, HIGH);
@@ -46,6 +91,7 @@ void Bootloader_Host::printHeader(BL_CommandHeader_t& header) {
 }
 
 void Bootloader_Host::printCommand(void* cmd, BL_CommandID_t id) {
+	Phase_Timer timer(metrics, Host_Phase::Log);
 
 	switch (id) {
 	case BL_GOTO_ADDR_CMD_ID:
@@ -62,6 +108,9 @@ void Bootloader_Host::printCommand(void* cmd, BL_CommandID_t id) {
 		printHeader(static_cast<BL_MEM_READ_CMD*>(cmd)->data.header);
 		DEBUG_PRINTF("Start address = 0x%08X", static_cast<BL_MEM_READ_CMD*>(cmd)->data.start_addr);
 		DEBUG_PRINTF("Length = 0x%08X", static_cast<BL_MEM_READ_CMD*>(cmd)->data.length);
+		if (static_cast<BL_MEM_READ_CMD*>(cmd)->data.header.payload_size == sizeof(BL_MEM_READ_STREAM_CMD)) {
+			DEBUG_PRINTF("Window = %d", static_cast<BL_MEM_READ_STREAM_CMD*>(cmd)->data.window);
+		}
 		break;
 	case BL_VER_CMD_ID:
 		DEBUG_PRINTLN(F("**** VER CMD ****"));
@@ -101,6 +150,11 @@ void Bootloader_Host::printCommand(void* cmd, BL_CommandID_t id) {
 		printHeader(static_cast<BL_ENTER_CMD_MODE_CMD*>(cmd)->data.header);
 		DEBUG_PRINTF("Key = 0x%08X", static_cast<BL_ENTER_CMD_MODE_CMD*>(cmd)->data.key);
 		break;
+	case BL_FEC_CMD_ID:
+		DEBUG_PRINTLN("**** FEC CMD ****");
+		printHeader(static_cast<BL_FEC_CMD*>(cmd)->data.header);
+		DEBUG_PRINTF("Segment size = %lu", static_cast<BL_FEC_CMD*>(cmd)->data.segment_size);
+		break;
 	default:
 		DEBUG_PRINTLN("Unknown command ID");
 		break;
@@ -108,13 +162,7 @@ void Bootloader_Host::printCommand(void* cmd, BL_CommandID_t id) {
 }
 
 uint8_t Bootloader_Host::SendVersionCommand() {
-	std::unique_ptr<BL_VER_CMD> cmd = CreateVerCommand();
-	if (!cmd.get())
-		return 0;
-
-	printCommand(cmd.get(), BL_VER_CMD_ID);
-	SendCommand(cmd.get()->serialized_data, sizeof(BL_VER_CMD));
-	cmd.reset();
+	SendConstCommand(ver_frame.bytes, sizeof(ver_frame.bytes), BL_VER_CMD_ID);
 
 	uint8_t nack_field = 0xFF;
 	bool ack_received = ReceiveAck(&nack_field);
@@ -128,31 +176,16 @@ uint8_t Bootloader_Host::SendVersionCommand() {
 	if (!response_received)
 		return 0;
 
+	/* The frame parser already checked the CRC */
 	BL_Response* rsp = (BL_Response*)(rx_buffer);
-
-	// Validate response
-	uint32_t test_crc = bl_calculate_command_crc(rsp, sizeof(BL_Response));
-	if (!VALIDATE_CMD(rsp->serialized_data, rsp->data.header.payload_size,
-		rsp->data.header.CRC32))
-	{
-		DEBUG_PRINTF("Invalid CRC %08X", rsp->data.header.CRC32);
-		DEBUG_PRINTF("Calculated CRC %08X", test_crc);
-		return 0;
-	}
-
 	return rsp->data.data[0];
 }
 
 bool Bootloader_Host::SendFlashEraseCommand(uint32_t page_start_address, uint32_t page_count)
 {
-	std::unique_ptr<BL_FLASH_ERASE_CMD> cmd = CreateFlashEraseCommand(page_start_address, page_count);
-	if (!cmd.get())
+	if (!PostFlashErase(page_start_address, page_count))
 		return false;
 
-	printCommand(cmd.get(), BL_FLASH_ERASE_CMD_ID);
-	SendCommand(cmd.get()->serialized_data, sizeof(BL_FLASH_ERASE_CMD));
-	cmd.reset();
-
 	uint8_t nack_field = 0xFF;
 	bool ack_received = ReceiveAck(&nack_field);
 
@@ -167,16 +200,162 @@ bool Bootloader_Host::SendFlashEraseCommand(uint32_t page_start_address, uint32_
 	return true;
 }
 
-bool Bootloader_Host::SendMemReadCommand(uint32_t start_address, uint32_t length, uint8_t out_buffer[]) {
+bool Bootloader_Host::PostFlashErase(uint32_t page_start_address, uint32_t page_count)
+{
+	if (!FlushWrites())
+		return false;
+
+	/* Even a failed erase may have cleared some of the pages */
+	read_cache.Invalidate(page_start_address, page_count * read_cache.GetPageSize());
+
+	Phase_Timer build_timer(metrics, Host_Phase::Build);
+	BL_PacketPtr<BL_FLASH_ERASE_CMD> cmd = CreateFlashEraseCommand(page_start_address, page_count);
+	build_timer.Stop();
+	if (!cmd.get())
+		return false;
+
+	printCommand(cmd.get(), BL_FLASH_ERASE_CMD_ID);
+	SendCommand(cmd.get()->serialized_data, sizeof(BL_FLASH_ERASE_CMD));
+	return true;
+}
+
+bool Bootloader_Host::SendMassEraseCommand() {
+	if (!FlushWrites())
+		return false;
+
+	read_cache.Clear();
+	SendConstCommand(mass_erase_frame.bytes, sizeof(mass_erase_frame.bytes), BL_FLASH_ERASE_CMD_ID);
+
+	/* Accepted, then done */
+	uint8_t nack_field = 0xFF;
+	return ReceiveAck(&nack_field) && ReceiveAck(&nack_field);
+}
+
+bool Bootloader_Host::SendMemReadCommand(uint32_t start_address, uint32_t length, uint8_t out_buffer[], uint8_t window) {
+	return ReadMemory(start_address, length, out_buffer, nullptr, nullptr, window);
+}
+
+bool Bootloader_Host::SendCachedMemReadCommand(uint32_t start_address, uint32_t length, uint8_t out_buffer[]) {
+	/* Cached lines are dropped when the queued writes go out, not when they are queued */
+	if (!FlushWrites())
+		return false;
+
+	return read_cache.Read(*this, start_address, length, out_buffer);
+}
+
+bool Bootloader_Host::SendMemReadCommand(uint32_t start_address, uint32_t length, ReadSink sink, void* context, uint8_t window) {
+	return ReadMemory(start_address, length, nullptr, sink, context, window);
+}
+
+/* Compares read-back packets with the expected data, from memory or from a stream */
+struct Verify_Context
+{
+	const uint8_t* expected;
+	Stream* source;
+	uint32_t mismatch_offset;
+	bool mismatch;
+};
+
+static bool VerifySink(void* context, uint32_t offset, const uint8_t data[], uint32_t length) {
+	Verify_Context* verify = static_cast<Verify_Context*>(context);
+	uint8_t chunk[64];
+
+	for (uint32_t done = 0; done < length; ) {
+		uint32_t count = min<uint32_t>(sizeof(chunk), length - done);
+		const uint8_t* expected = &verify->expected[offset + done];
+		if (verify->source) {
+			if (verify->source->readBytes(chunk, count) != count)
+				return false;
+			expected = chunk;
+		}
+
+		for (uint32_t i = 0; i < count; i++) {
+			if (data[done + i] != expected[i]) {
+				verify->mismatch_offset = offset + done + i;
+				verify->mismatch = true;
+				return false;
+			}
+		}
+		done += count;
+	}
+	return true;
+}
+
+bool Bootloader_Host::SendMemVerifyCommand(uint32_t start_address, uint32_t length, const uint8_t expected[], uint32_t* mismatch_address) {
+	Verify_Context verify = { expected, nullptr, 0, false };
+	bool status = ReadMemory(start_address, length, nullptr, VerifySink, &verify, BL_MEM_READ_MAX_WINDOW);
+
+	if (verify.mismatch) {
+		DEBUG_PRINTF("Verify mismatch at 0x%08X", start_address + verify.mismatch_offset);
+		if (mismatch_address)
+			*mismatch_address = start_address + verify.mismatch_offset;
+	}
+	return status;
+}
+
+bool Bootloader_Host::SendMemVerifyCommand(uint32_t start_address, uint32_t length, Stream& expected, uint32_t* mismatch_address) {
+	Verify_Context verify = { nullptr, &expected, 0, false };
+	bool status = ReadMemory(start_address, length, nullptr, VerifySink, &verify, BL_MEM_READ_MAX_WINDOW);
+
+	if (verify.mismatch) {
+		DEBUG_PRINTF("Verify mismatch at 0x%08X", start_address + verify.mismatch_offset);
+		if (mismatch_address)
+			*mismatch_address = start_address + verify.mismatch_offset;
+	}
+	return status;
+}
+
+bool Bootloader_Host::ReadMemory(uint32_t start_address, uint32_t length, uint8_t out_buffer[], ReadSink sink, void* context, uint8_t window) {
 	DEBUG_PRINTF("Reading from address 0x%08X, %ul bytes\n", start_address, length);
-	BL_DATA_PACKET_CMD* data_block = nullptr;
 
-	uint32_t total_bytes = 0;
-	uint32_t retries = 0;
-	uint32_t len = 0;
-	bool more = true;
+	if (!FlushWrites())
+		return false;
+
+	uint8_t granted = 0;
+	if (!BeginMemRead(start_address, length, window, &granted))
+		return false;
+
+	progress.Begin(Transfer_Op::Read, start_address, length);
+	if (granted)
+		return progress.End(ReceiveMemReadStream(length, out_buffer, sink, context, granted));
+
+	return progress.End(ReceiveMemRead(length, out_buffer, sink, context));
+}
+
+bool Bootloader_Host::BeginMemRead(uint32_t start_address, uint32_t length, uint8_t window, uint8_t* granted) {
+	uint8_t nack_field = 0xFF;
+	*granted = 0;
 
-	std::unique_ptr<BL_MEM_READ_CMD> cmd = CreateMemReadCommand(start_address, length);
+	if (window > 1)
+	{
+		Phase_Timer build_timer(metrics, Host_Phase::Build);
+		BL_PacketPtr<BL_MEM_READ_STREAM_CMD> cmd = CreateMemReadStreamCommand(start_address, length, window);
+		build_timer.Stop();
+		if (!cmd.get())
+			return false;
+		printCommand(cmd.get(), BL_MEM_READ_CMD_ID);
+		SendCommand(cmd.get()->serialized_data, sizeof(BL_MEM_READ_STREAM_CMD));
+		cmd.reset();
+
+		/* The ACK field holds the granted window, BL_NACK_SUCCESS from clients reading packet by packet.
+		   0xFF grants none, and a window is not an error for the reply of the read */
+		if (ReceiveAck(&nack_field))
+		{
+			*granted = (nack_field == 0xFF) ? 0 : min<uint8_t>(nack_field, window);
+			last_nack_fields = BL_NACK_SUCCESS;
+			DEBUG_PRINTF("Streaming window = %d", *granted);
+			return true;
+		}
+
+		/* Anything but a size or command complaint is a real rejection of the read */
+		if (!(nack_field & (BL_NACK_INVALID_LENGTH | BL_NACK_INVALID_CMD)))
+			return false;
+		DEBUG_PRINTLN("Client does not stream, reading packet by packet");
+	}
+
+	Phase_Timer build_timer(metrics, Host_Phase::Build);
+	BL_PacketPtr<BL_MEM_READ_CMD> cmd = CreateMemReadCommand(start_address, length);
+	build_timer.Stop();
 	if (!cmd.get())
 		return false;
 	printCommand(cmd.get(), BL_MEM_READ_CMD_ID);
@@ -184,152 +363,358 @@ bool Bootloader_Host::SendMemReadCommand(uint32_t start_address, uint32_t length
 	cmd.reset();
 
 	/* Wait for ack on command */
-	uint8_t nack_field = 0xFF;
-	bool ack_received = ReceiveAck(&nack_field);
+	return ReceiveAck(&nack_field);
+}
 
-	if (!ack_received)
-		return false;
+bool Bootloader_Host::ReceiveMemRead(uint32_t length, uint8_t out_buffer[], ReadSink sink, void* context) {
+	uint32_t total_bytes = 0;
 
 	for (;;) {
 
-		bool received = ReceivePacket(&len);
+		uint8_t* destination = out_buffer ? &out_buffer[total_bytes] : &rx_buffer[BL_DATA_PACKET_FIELDS_SIZE];
+		bool received = ReceivePacket(destination, length - total_bytes);
 
 		if (!received)
+		{
+			SendAck(0, BL_NACK_INVALID_LENGTH);
 			return false;
+		}
 
-		data_block = (BL_DATA_PACKET_CMD*)rx_buffer;
+		Packet_View<DataPacket> packet(rx_buffer, BL_DATA_PACKET_FIELDS_SIZE);
+		uint32_t data_len = packet.Get<DataPacket::DataLen>();
+		uint32_t packet_crc = packet.Get<DataPacket::Crc>();
 
-		// Validate response
-		uint32_t test_crc = bl_calculate_command_crc(data_block, data_block->data.header.payload_size);
+		// Validate the packet fields and the data block in place
+		Phase_Timer crc_timer(metrics, Host_Phase::Crc);
+		uint32_t test_crc = bl_crc_update(BL_CRC_INIT, rx_buffer, BL_DATA_PACKET_FIELDS_SIZE, 0);
+		test_crc = ~bl_crc_update(test_crc, destination, data_len, BL_DATA_PACKET_FIELDS_SIZE);
+		crc_timer.Stop();
 
-		if (!VALIDATE_CMD(data_block->serialized_data, data_block->data.header.payload_size,
-			data_block->data.header.CRC32))
+		if (test_crc != packet_crc)
 		{
-			DEBUG_PRINTF("Invalid CRC %08X", data_block->data.header.CRC32);
+			DEBUG_PRINTF("Invalid CRC %08X", packet_crc);
 			DEBUG_PRINTF("Calculated CRC %08X", test_crc);
 			SendAck(0, BL_NACK_INVALID_CRC);
 			return false;
 		}
 
-		DEBUG_PRINTF("Received valid data packet, length = %d bytes",
-			data_block->data.data_len);
+		/* A NACK ends the read on the client, as for a corrupted packet */
+		if (sink && !sink(context, total_bytes, destination, data_len))
+		{
+			SendAck(0, BL_NACK_INVALID_DATA);
+			return false;
+		}
+
+		/* ACK right away, the client sends the next packet while this one is logged */
+		SendAck(1, BL_NACK_SUCCESS);
+
+		bool end = packet.Get<DataPacket::EndFlag>();
+
+		Phase_Timer log_timer(metrics, Host_Phase::Log);
+		DEBUG_PRINTF("Received valid data packet, length = %d bytes", data_len);
 		DEBUG_PRINTLN("First 20 bytes:");
-		for (uint i = 0; i < 20; i++) {
-			Serial.printf("0x%02X ", data_block->data.data_block[i]);
+		for (uint i = 0; i < min(20U, data_len); i++) {
+			Serial.printf("0x%02X ", destination[i]);
 		}
 		Serial.println();
+		log_timer.Stop();
+
+		blinkLED(50);
+
+		total_bytes += data_len;
+		progress.Advance(data_len);
+
+		if (end)
+			break;
+	}
+
+	DEBUG_PRINTF("Total data received = %lu", total_bytes);
+	return true;
+}
 
-		// TODO Copy data to out buffer
-		size_t j = 0;
-		for (size_t i = total_bytes; i < total_bytes + data_block->data.data_len; i++, j++)
+bool Bootloader_Host::ReceiveMemReadStream(uint32_t length, uint8_t out_buffer[], ReadSink sink, void* context, uint8_t window) {
+	uint32_t total_bytes = 0;
+	uint32_t expected = 0;	// Index of the next packet to accept
+	uint32_t unacked = 0;	// Accepted packets not acknowledged yet
+	uint32_t retries = 0;
+	uint32_t ack_every = max<uint32_t>(1, window / 2); // ACK before the client runs out of window
+
+	for (;;) {
+
+		uint8_t* destination = out_buffer ? &out_buffer[total_bytes] : &rx_buffer[BL_DATA_PACKET_FIELDS_SIZE];
+		if (!ReceivePacket(destination, length - total_bytes))
 		{
-			out_buffer[i] = data_block->data.data_block[j];
+			SendStreamAck(0, BL_NACK_INVALID_LENGTH, expected);
+			return false;
 		}
 
-		total_bytes += data_block->data.data_len;
+		Packet_View<DataPacket> packet(rx_buffer, BL_DATA_PACKET_FIELDS_SIZE);
+		uint32_t data_len = packet.Get<DataPacket::DataLen>();
+		uint32_t packet_crc = packet.Get<DataPacket::Crc>();
 
-		/* Send ACK on last operation */
-		SendAck(1, BL_NACK_SUCCESS);
+		Phase_Timer crc_timer(metrics, Host_Phase::Crc);
+		uint32_t test_crc = bl_crc_update(BL_CRC_INIT, rx_buffer, BL_DATA_PACKET_FIELDS_SIZE, 0);
+		test_crc = ~bl_crc_update(test_crc, destination, data_len, BL_DATA_PACKET_FIELDS_SIZE);
+		crc_timer.Stop();
+
+		if (test_crc != packet_crc)
+		{
+			DEBUG_PRINTF("Invalid CRC %08X, resending from packet %lu", packet_crc, expected);
+			SendStreamAck(0, BL_NACK_INVALID_CRC, expected);
+			if (++retries > BL_MAX_BLOCK_RETRIES)
+				return false;
+			metrics.CountRetry();
+			unacked = 0;
+			continue;
+		}
+
+		/* Already in flight when the client got the NACK */
+		if (packet.Get<DataPacket::PacketIndex>() != expected)
+			continue;
 
-		if (data_block->data.end_flag)
+		if (sink && !sink(context, total_bytes, destination, data_len))
+		{
+			SendStreamAck(0, BL_NACK_INVALID_DATA, expected);
+			return false;
+		}
+
+		retries = 0;
+		expected++;
+		unacked++;
+		total_bytes += data_len;
+		progress.Advance(data_len);
+		bool end = packet.Get<DataPacket::EndFlag>();
+
+		if (end || unacked >= ack_every)
+		{
+			SendStreamAck(1, BL_NACK_SUCCESS, expected);
+			unacked = 0;
+		}
+
+		Phase_Timer log_timer(metrics, Host_Phase::Log);
+		DEBUG_PRINTF("Received streamed packet %lu, length = %d bytes", expected - 1, data_len);
+		log_timer.Stop();
+
+		if (end)
 			break;
 	}
 
+	blinkLED(50);
+
 	DEBUG_PRINTF("Total data received = %lu", total_bytes);
 	return true;
 }
 
 bool Bootloader_Host::SendMemWriteCommand(uint32_t start_address, uint8_t data[], uint32_t data_size) {
-	uint32_t number_of_blocks = data_size / BL_DATA_BLOCK_SIZE;
-	uint32_t remainder_bytes = data_size % BL_DATA_BLOCK_SIZE;
+	DEBUG_PRINTF("Number of blocks to send = %d", (data_size + BL_DATA_BLOCK_SIZE - 1) / BL_DATA_BLOCK_SIZE);
 
-	DEBUG_PRINTF("Number of blocks to send = %d", number_of_blocks);
-	DEBUG_PRINTF("Remainder bytes = %d", remainder_bytes);
+	if (!BeginMemWrite(start_address))
+		return false;
+	progress.Begin(Transfer_Op::Write, start_address, data_size);
 
-	std::unique_ptr<BL_MEM_WRITE_CMD> cmd = CreateMemWriteCommand(start_address);
-	if (!cmd.get())
+	/* Proceed to send the data, announcing the size of the block after each one */
+	for (uint32_t offset = 0; offset < data_size; offset += BL_DATA_BLOCK_SIZE)
+	{
+		uint32_t block_size = min(BL_DATA_BLOCK_SIZE, data_size - offset);
+		uint32_t next_block = min(BL_DATA_BLOCK_SIZE, data_size - offset - block_size);
+
+		if (!SendDataBlock(&data[offset], block_size, next_block, next_block == 0))
+			return progress.End(false);
+	}
+
+	delay(10);
+	return progress.End(true);
+}
+
+bool Bootloader_Host::SendMemWriteCommand(uint32_t start_address, Stream& source, uint32_t data_size, Transfer_Checkpoint* checkpoint) {
+	DEBUG_PRINTF("Number of blocks to stream = %d", (data_size + BL_DATA_BLOCK_SIZE - 1) / BL_DATA_BLOCK_SIZE);
+
+	if (!BeginMemWrite(start_address))
 		return false;
+	progress.Begin(Transfer_Op::Write, start_address, data_size);
 
-	printCommand(cmd.get(), BL_MEM_WRITE_CMD_ID);
-	SendCommand(cmd.get()->serialized_data, sizeof(BL_MEM_WRITE_CMD));
-	cmd.reset();
+	/* The receive buffer is idle while writing, stage each block there */
+	uint32_t remaining = data_size;
+	while (remaining)
+	{
+		uint32_t block_size = min(BL_DATA_BLOCK_SIZE, remaining);
+		uint32_t next_block = min(BL_DATA_BLOCK_SIZE, remaining - block_size);
+
+		if (source.readBytes(rx_buffer, block_size) != block_size)
+		{
+			DEBUG_PRINTF("Short read with %lu bytes remaining", remaining);
+			return progress.End(false);
+		}
+
+		if (!SendDataBlock(rx_buffer, block_size, next_block, next_block == 0))
+			return progress.End(false);
+
+		if (checkpoint)
+			checkpoint->Acknowledge();
+
+		remaining -= block_size;
+	}
+
+	delay(10);
+	return progress.End(true);
+}
+
+bool Bootloader_Host::QueueMemWrite(uint32_t start_address, const uint8_t data[], uint32_t data_size) {
+	return write_combiner.Add(*this, start_address, data, data_size);
+}
+
+bool Bootloader_Host::FlushWrites() {
+	return write_combiner.Flush(*this);
+}
+
+bool Bootloader_Host::BeginMemWrite(uint32_t start_address) {
+	if (!PostMemWrite(start_address))
+		return false;
 
 	/* Wait for ack on command */
 	uint8_t nack_field = 0xFF;
-	bool ack_received = ReceiveAck(&nack_field);
+	return ReceiveAck(&nack_field);
+}
 
-	if (!ack_received)
+bool Bootloader_Host::PostMemWrite(uint32_t start_address) {
+	/* Writes queued earlier land first, a later one may overwrite them */
+	if (!FlushWrites())
 		return false;
 
-	/* To store the next block size to send */
-	uint32_t next_block = BL_DATA_BLOCK_SIZE;
-	bool flag = false;
-	/* Proceed to send the rest of the data */
-	for (size_t i = 0; i < number_of_blocks; i++)
-	{
-		/* If this is the last even block, assign next block size to remainder bytes size */
-		if (i == number_of_blocks - 1)
-			next_block = remainder_bytes;
-
-		std::unique_ptr<BL_DATA_PACKET_CMD> block = CreateDataPacketCommand(&data[BL_DATA_BLOCK_SIZE * i], BL_DATA_BLOCK_SIZE, next_block,
-			((i + 1) * BL_DATA_BLOCK_SIZE) == data_size);
+	Phase_Timer build_timer(metrics, Host_Phase::Build);
+	BL_PacketPtr<BL_MEM_WRITE_CMD> cmd = CreateMemWriteCommand(start_address);
+	build_timer.Stop();
+	if (!cmd.get())
+		return false;
 
-		printCommand(block.get(), BL_DATA_PACKET_CMD_ID);
+	printCommand(cmd.get(), BL_MEM_WRITE_CMD_ID);
+	SendCommand(cmd.get()->serialized_data, sizeof(BL_MEM_WRITE_CMD));
+	write_address = start_address;
+	return true;
+}
 
-		if (!block.get())
+bool Bootloader_Host::SendDataBlock(uint8_t data[], uint32_t data_size, uint32_t next_block_len, bool end_flag) {
+	for (uint32_t retries = 0; retries <= BL_MAX_BLOCK_RETRIES; retries++)
+	{
+		if (!PostDataBlock(data, data_size, next_block_len, end_flag))
 			return false;
-		yield();
-		SendCommand(block.get()->serialized_data, block.get()->data.header.payload_size);
 
-		/* Wait for ack on last packet*/
+		/* Wait for ack on last packet, re-send on failure */
 		uint8_t nack_field = 0xFF;
-		bool ack_received = ReceiveAck(&nack_field);
-
-		delay(1);
-		if (!ack_received)
+		if (ReceiveAck(&nack_field))
 		{
-			// Re-send
-			i--;
-			flag = true;
-			continue;
+			CompleteDataBlock(data, data_size);
+			return true;
 		}
 
+		if (retries < BL_MAX_BLOCK_RETRIES)
+			metrics.CountRetry();
 	}
 
-	while (remainder_bytes)
-	{
-		std::unique_ptr<BL_DATA_PACKET_CMD> block = CreateDataPacketCommand(&data[BL_DATA_BLOCK_SIZE * number_of_blocks], remainder_bytes, 0,
-			true);
+	return false;
+}
 
-		if (!block.get())
-			return false;
+bool Bootloader_Host::PostDataBlock(uint8_t data[], uint32_t data_size, uint32_t next_block_len, bool end_flag) {
+	read_cache.Invalidate(write_address, data_size);
+
+	Phase_Timer build_timer(metrics, Host_Phase::Build);
+	BL_PacketPtr<BL_DATA_PACKET_CMD> block = CreateDataPacketCommand(data, data_size, next_block_len, end_flag);
+	uint8_t trailer[BL_FEC_MAX_TRAILER_SIZE];
+	uint32_t trailer_size = fec_enabled ? BL_FEC_TRAILER_SIZE(data_size) : 0;
+	if (trailer_size)
+		bl_fec_encode(data, data_size, trailer);
+	build_timer.Stop();
+	if (!block.get())
+		return false;
 
-		printCommand(block.get(), BL_DATA_PACKET_CMD_ID);
-		SendCommand(block.get()->serialized_data, block.get()->data.header.payload_size);
-		cmd.reset();
+	printCommand(block.get(), BL_DATA_PACKET_CMD_ID);
+	yield();
+	SendCommand(block.get()->serialized_data, block.get()->data.header.payload_size);
+	block.reset();
+	if (trailer_size)
+		port->write(trailer, trailer_size);
+	return true;
+}
 
-		/* Wait for ack on last packet*/
-		uint8_t nack_field = 0xFF;
-		bool ack_received = ReceiveAck(&nack_field);
+void Bootloader_Host::CompleteDataBlock(const uint8_t data[], uint32_t data_size) {
+	/* Only acknowledged data counts as flashed, a resent block is digested once */
+	Phase_Timer digest_timer(metrics, Host_Phase::Digest);
+	write_digest.Update(data, data_size);
+	digest_timer.Stop();
+	write_address += data_size;
+	progress.Advance(data_size);
+}
 
-		if (ack_received) {
-			break;
-		}
-	}
+bool Bootloader_Host::PollAck(bool* ack) {
+	if (!AckAvailable())
+		return false;
 
-	delay(10);
+	uint8_t nack_field = 0xFF;
+	*ack = ReceiveAck(&nack_field);
 	return true;
+}
+
+bool Bootloader_Host::SendBatchCommand(BL_BATCH_CMD& cmd, BL_BATCH_RESULT results[], uint8_t* result_count) {
+	*result_count = 0;
+
+	DEBUG_PRINTF("Sending batch of %d commands, %lu bytes", cmd.data.count, cmd.data.header.payload_size);
+
+	/* A batch may erase or jump */
+	if (!FlushWrites())
+		return false;
+	read_cache.Clear();
+	SendCommand(cmd.serialized_data, cmd.data.header.payload_size);
+
+	uint8_t nack_field = 0xFF;
+	if (!ReceiveAck(&nack_field))
+		return false;
+
+	if (!ReceiveFrame(sizeof(BL_BATCH_RESPONSE)))
+		return false;
+
+	BL_BATCH_RESPONSE* rsp = (BL_BATCH_RESPONSE*)rx_buffer;
+	if (rsp->data.header.cmd_id != BL_RESPONSE_CMD_ID || rsp->data.count > cmd.data.count)
+	{
+		DEBUG_PRINTF("Invalid batch response with %d results", rsp->data.count);
+		return false;
+	}
+
+	metrics.CountBatch(cmd.data.count);
+
+	bool status = rsp->data.count == cmd.data.count;
+	for (uint8_t i = 0; i < rsp->data.count; i++)
+	{
+		results[i] = rsp->data.results[i];
+		status = status && results[i].ack;
+		if (!results[i].ack)
+			last_nack_fields = results[i].field;
+	}
+	*result_count = rsp->data.count;
+
+	return status;
+}
+
+bool Bootloader_Host::SendFecCommand(bool enable) {
+	if (enable)
+		SendConstCommand(fec_on_frame.bytes, sizeof(fec_on_frame.bytes), BL_FEC_CMD_ID);
+	else
+		SendConstCommand(fec_off_frame.bytes, sizeof(fec_off_frame.bytes), BL_FEC_CMD_ID);
 
+	uint8_t nack_field = 0xFF;
+	bool ack_received = ReceiveAck(&nack_field);
+
+	/* A client that refuses FEC keeps sending plain packets */
+	fec_enabled = enable && ack_received;
+	DEBUG_PRINTF("FEC %s", fec_enabled ? "on" : "off");
+
+	return ack_received;
 }
 
 bool Bootloader_Host::SendEnterCmdModeCommand() {
-	std::unique_ptr<BL_ENTER_CMD_MODE_CMD> cmd = CreateEnterCmdModeCommand(ENTER_CMD_MODE_KEY);
-	if (!cmd.get())
+	if (!FlushWrites())
 		return false;
 
-	printCommand(cmd.get(), BL_ENTER_CMD_MODE_CMD_ID);
-	SendCommand(cmd.get()->serialized_data, sizeof(BL_ENTER_CMD_MODE_CMD));
-	cmd.reset();
+	SendConstCommand(enter_cmd_mode_frame.bytes, sizeof(enter_cmd_mode_frame.bytes), BL_ENTER_CMD_MODE_CMD_ID);
 
 	uint8_t nack_field = 0xFF;
 	bool ack_received = ReceiveAck(&nack_field);
@@ -337,18 +722,20 @@ bool Bootloader_Host::SendEnterCmdModeCommand() {
 	if (!ack_received)
 		return false;
 
+	/* A new session starts without FEC, possibly on another target */
+	fec_enabled = false;
+	read_cache.Clear();
 	return true;
 }
 
 bool Bootloader_Host::SendJumpToAppCommand() {
-
-	std::unique_ptr<BL_JUMP_TO_APP_CMD> cmd = CreateJumpToAppCommand(JUMP_APP_KEY);
-	if (!cmd.get())
+	if (!FlushWrites())
 		return false;
 
-	printCommand(cmd.get(), BL_JUMP_TO_APP_CMD_ID);
-	SendCommand(cmd.get()->serialized_data, sizeof(BL_JUMP_TO_APP_CMD));
-	cmd.reset();
+	SendConstCommand(jump_to_app_frame.bytes, sizeof(jump_to_app_frame.bytes), BL_JUMP_TO_APP_CMD_ID);
+
+	/* The application may change memory, whether or not its ACK makes it back */
+	read_cache.Clear();
 
 	uint8_t nack_field = 0xFF;
 	bool ack_received = ReceiveAck(&nack_field);
@@ -356,92 +743,244 @@ bool Bootloader_Host::SendJumpToAppCommand() {
 	if (!ack_received)
 		return false;
 
+	fec_enabled = false;
 	return true;
 }
 
 void Bootloader_Host::SendCommand(uint8_t* data, uint32_t bytes) {
 	if (state != HostState::ReadyToSendCommand) {
-		SyncClient();
+		Phase_Timer timer(metrics, Host_Phase::Sync);
+		/* Sent nothing, the reply the caller waits for times out */
+		if (!SyncClient(sync_timeout_ms))
+			return;
 	}
-	myPort.write(data, bytes);
+	Phase_Timer timer(metrics, Host_Phase::Transmit);
+	port->write(data, bytes);
 }
 
-bool Bootloader_Host::ReceiveResponse(uint32_t* length) {
+void Bootloader_Host::SendConstCommand(const uint8_t frame[], uint32_t bytes, BL_CommandID_t id) {
+	/* Flash is read in words, copy the frame out before handing it to the port */
+	uint8_t command[CONST_FRAME_CAPACITY];
+	memcpy_P(command, frame, bytes);
 
-	/* Wait for any data to arrive */
-	while (myPort.available() == 0);
+	printCommand(command, id);
+	SendCommand(command, bytes);
+}
 
-	*length = myPort.available();
-	myPort.readBytes(rx_buffer, sizeof(BL_CommandHeader_t));
-	myPort.readBytes(&rx_buffer[sizeof(BL_CommandHeader_t)], ((BL_CommandHeader_t*)(rx_buffer))->payload_size);
+bool Bootloader_Host::ReceiveResponse(uint32_t* length) {
+	if (!ReceiveFrame(sizeof(BL_Response)))
+		return false;
 
+	*length = parser.GetFrameSize();
 	blinkLED(100);
 
 	return true;
 }
 
-bool Bootloader_Host::ReceivePacket(uint32_t* length) {
+bool Bootloader_Host::ReceivePacket(uint8_t data_out[], uint32_t capacity) {
 
 	/* Wait for any data to arrive */
-	while (myPort.available() == 0);
-	*length = myPort.available();
-	myPort.readBytes(rx_buffer, sizeof(BL_CommandHeader_t));
-	myPort.readBytes(&rx_buffer[sizeof(BL_CommandHeader_t)], ((BL_CommandHeader_t*)(rx_buffer))->payload_size - sizeof(BL_CommandHeader_t));
+	Phase_Timer wait_timer(metrics, Host_Phase::WaitResponse);
+	if (!WaitForData())
+		return false;
+	wait_timer.Stop();
 
-	blinkLED(50);
+	Phase_Timer receive_timer(metrics, Host_Phase::Receive);
+	if (port->readBytes(rx_buffer, sizeof(BL_CommandHeader_t)) != sizeof(BL_CommandHeader_t))
+		return false;
+
+	/* Hunt for a plausible data packet header before trusting its sizes */
+	uint32_t start = micros();
+	uint32_t dropped = 0;
+	while (!Frame_Parser::ValidHeader(rx_buffer, sizeof(BL_DATA_PACKET_CMD)) ||
+		(rx_buffer[BL_Layout::Header::CmdId::offset] != BL_DATA_PACKET_CMD_ID &&
+			rx_buffer[BL_Layout::Header::CmdId::offset] != BL_STREAM_PACKET_CMD_ID))
+	{
+		memmove(rx_buffer, rx_buffer + 1, sizeof(BL_CommandHeader_t) - 1);
+		if (port->readBytes(&rx_buffer[sizeof(BL_CommandHeader_t) - 1], 1) != 1)
+			return false;
+		dropped++;
+	}
+	if (dropped)
+		metrics.CountResync(dropped, micros() - start);
+
+	port->readBytes(&rx_buffer[sizeof(BL_CommandHeader_t)], BL_DATA_PACKET_FIELDS_SIZE - sizeof(BL_CommandHeader_t));
+
+	Packet_View<DataPacket> packet(rx_buffer, BL_DATA_PACKET_FIELDS_SIZE);
+	uint32_t data_len = packet.Get<DataPacket::DataLen>();
+	if (data_len > BL_DATA_BLOCK_SIZE || data_len > capacity ||
+		packet.Get<DataPacket::PayloadSize>() != BL_DATA_PACKET_FIELDS_SIZE + data_len)
+	{
+		DEBUG_PRINTF("Invalid data packet length %lu", data_len);
+		return false;
+	}
+
+	/* The data block goes straight to its place in the destination */
+	if (port->readBytes(data_out, data_len) != data_len)
+		return false;
+
+	if (fec_enabled)
+	{
+		uint8_t trailer[BL_FEC_MAX_TRAILER_SIZE];
+		uint32_t trailer_size = BL_FEC_TRAILER_SIZE(data_len);
+		if (port->readBytes(trailer, trailer_size) != trailer_size)
+			return false;
+		receive_timer.Stop();
+
+		Phase_Timer fec_timer(metrics, Host_Phase::Crc);
+		uint32_t corrected = bl_fec_correct(data_out, data_len, trailer);
+		if (corrected)
+			metrics.CountFecRepair(corrected);
+	}
+	receive_timer.Stop();
 
 	return true;
 }
 
+bool Bootloader_Host::ReceiveFrame(uint32_t capacity) {
+
+	/* Wait for any data to arrive */
+	Phase_Timer wait_timer(metrics, Host_Phase::WaitResponse);
+	if (!WaitForData())
+		return false;
+	wait_timer.Stop();
+
+	Phase_Timer receive_timer(metrics, Host_Phase::Receive);
+	uint32_t start = micros();
+	uint32_t deadline = millis() + BL_RECEIVE_TIMEOUT_MS;
+	parser.Reset(capacity);
+
+	while ((int32_t)(millis() - deadline) < 0)
+	{
+		if (!port->available()) {
+			yield();
+			continue;
+		}
+
+		if (parser.Feed(port->read()) == Frame_Parser::Result::Frame) {
+			if (parser.GetDropped())
+				metrics.CountResync(parser.GetDropped(), micros() - start);
+			return true;
+		}
+	}
+
+	DEBUG_PRINTF("No valid frame, %lu bytes dropped", parser.GetDropped());
+	return false;
+}
 
 bool Bootloader_Host::ReceiveAck(uint8_t* nack_field) {
 
 	/* Wait for any data to arrive */
-	while (myPort.available() == 0);
+	Phase_Timer wait_timer(metrics, Host_Phase::WaitResponse);
+	if (!WaitForData())
+		return false;
+	wait_timer.Stop();
 
-	BL_ACK ack = { 0 };
+	BL_ACK ack = {};
 
-	myPort.readBytes(ack.serialized_data, sizeof(BL_ACK));
+	Phase_Timer receive_timer(metrics, Host_Phase::Receive);
+	if (port->readBytes(ack.serialized_data, sizeof(BL_ACK)) != sizeof(BL_ACK))
+		return false;
 
-	if (ack.data.field != 0xFF && nack_field)
-		*nack_field = ack.data.field;
+	/* Skip garbage up to something shaped like an ACK */
+	uint32_t start = micros();
+	uint32_t dropped = 0;
+	while (ack.serialized_data[0] != BL_ACK_CMD_ID || ack.serialized_data[1] > 1)
+	{
+		memmove(ack.serialized_data, ack.serialized_data + 1, sizeof(BL_ACK) - 1);
+		if (port->readBytes(&ack.serialized_data[sizeof(BL_ACK) - 1], 1) != 1)
+			return false;
+		dropped++;
+	}
+	if (dropped)
+		metrics.CountResync(dropped, micros() - start);
+	receive_timer.Stop();
+
+	Packet_View<BL_Layout::Ack> view(ack.serialized_data, sizeof(BL_ACK));
+	uint8_t value = view.Get<BL_Layout::Ack::Value>();
+	uint8_t field = view.Get<BL_Layout::Ack::NackField>();
+
+	if (!value)
+		metrics.CountNack(field);
+
+	if (field != 0xFF && nack_field)
+		*nack_field = field;
 
 	printCommand(&ack, BL_ACK_CMD_ID);
 
-	if (ack.data.ack)
+	if (value)
 		blinkLED(50);
-	last_nack_fields = ack.data.field;
-	return (ack.data.ack == 1);
+	last_nack_fields = (BL_NACK_t)field;
+	return (value == 1);
+}
+
+bool Bootloader_Host::WaitForData() {
+	uint32_t start = millis();
+	while (port->available() == 0)
+	{
+		if (millis() - start >= BL_RECEIVE_TIMEOUT_MS)
+		{
+			DEBUG_PRINTLN("Timed out waiting for the client");
+			return false;
+		}
+		yield();
+	}
+	return true;
+}
+
+bool Bootloader_Host::AckAvailable() {
+	return port->available() >= (int)sizeof(BL_ACK);
 }
 
 bool Bootloader_Host::SendAck(uint8_t ack_value, BL_NACK_t field) {
-	BL_ACK ack = { 0 };
-	ack.data.cmd_id = BL_ACK_CMD_ID;
-	ack.data.field = field;
-	ack.data.ack = ack_value;
-	myPort.write(ack.serialized_data, sizeof(BL_ACK));
+	BL_ACK ack = {};
+	Packet_Writer<BL_Layout::Ack>(ack.serialized_data, sizeof(BL_ACK))
+		.Set<BL_Layout::Ack::CmdId>(BL_ACK_CMD_ID)
+		.Set<BL_Layout::Ack::Value>(ack_value)
+		.Set<BL_Layout::Ack::NackField>(field);
+	Phase_Timer timer(metrics, Host_Phase::Transmit);
+	port->write(ack.serialized_data, sizeof(BL_ACK));
 	return true;
 }
-void Bootloader_Host::SyncClient() {
+
+void Bootloader_Host::SendStreamAck(uint8_t ack_value, BL_NACK_t field, uint32_t packet_index) {
+	BL_STREAM_ACK ack = {};
+	Packet_Writer<BL_Layout::StreamAck>(ack.serialized_data, sizeof(BL_STREAM_ACK))
+		.Set<BL_Layout::StreamAck::CmdId>(BL_ACK_CMD_ID)
+		.Set<BL_Layout::StreamAck::Value>(ack_value)
+		.Set<BL_Layout::StreamAck::NackField>(field)
+		.Set<BL_Layout::StreamAck::PacketIndex>(packet_index);
+	Phase_Timer timer(metrics, Host_Phase::Transmit);
+	port->write(ack.serialized_data, sizeof(BL_STREAM_ACK));
+}
+
+bool Bootloader_Host::SyncClient(uint32_t timeout_ms) {
 	uint8_t temp = 0;
+	uint32_t start = millis();
 
 	// Continuosly read from serial if received sync byte
 	while (temp != SYNC_BYTE) {
 
-		myPort.read(&temp, 1);
+		if (port->available())
+			temp = port->read();
 		// Exit loop so we don't send next sync byte
 		if (temp == SYNC_BYTE)
 			break;
 
+		if (timeout_ms && millis() - start >= timeout_ms) {
+			DEBUG_PRINTLN(F("No sync byte from the target"));
+			return false;
+		}
+
 		/* Send the sync byte then wait for a response */
-		myPort.write((uint8_t*)&SYNC_BYTE, 1);
+		port->write((uint8_t*)&SYNC_BYTE, 1);
 		delay(500);
 	}
 	delay(100);
 
 	/* Synchronization successful */
 	state = HostState::ReadyToSendCommand;
-
+	return true;
 }
 
 
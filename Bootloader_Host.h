@@ -1,17 +1,35 @@
 #pragma once
 #include "bl_cmd_types.h"
+#include "Host_Metrics.h"
+#include "Frame_Parser.h"
+#include "bl_fec.h"
+#include "Image_Digest.h"
+#include "Read_Cache.h"
+#include "Write_Combiner.h"
+#include "Transfer_Progress.h"
 #include <SoftwareSerial.h>
 #include <stdint.h>
 #include <iostream>
 
+class Transfer_Checkpoint;
+
 #define LED (D0)
 
 #define MYPORT_TX 12
 #define MYPORT_RX 14
 
+#define BL_MAX_BLOCK_RETRIES (5U) // Resends of a data block before giving up
+#define BL_RECEIVE_TIMEOUT_MS (10000U) // Longest wait for a reply, a full chip erase included
+#define BL_SYNC_TIMEOUT_MS (5000U) // Longest wait for a target added at run time to answer the sync byte
+
+/* Receive capacity of the owned serial port. Holds a whole data packet, so the
+   next packet keeps arriving while the previous one is being handled */
+#define BL_PORT_RX_CAPACITY (sizeof(BL_DATA_PACKET_CMD))
+#define BL_DATA_PACKET_FIELDS_SIZE (sizeof(BL_DATA_PACKET_CMD) - BL_DATA_BLOCK_SIZE) // Header, lengths and end flag
+
 class Bootloader_Host
 {
-	static Bootloader_Host* instance; // Singleton instance pointer
+	static Bootloader_Host* instance; // Default instance pointer
 
 	enum class HostState
 	{
@@ -21,19 +39,77 @@ class Bootloader_Host
 		WaitingForAck
 	};
 
-	const int SYNC_BYTE = 0xA5;						// Magic byte to synchronize
-	const uint32_t JUMP_APP_KEY = 0x4032AFE5;		// Magic key to jump to app
-	const uint32_t ENTER_CMD_MODE_KEY = 0x09B21FFC; // Magic key to enter cmd mode
+	const int SYNC_BYTE = 0xA5; // Magic byte to synchronize
 
 	uint8_t rx_buffer[1512];						  // Receive buffer
-	SoftwareSerial myPort;						  // Software serial interface
+	Frame_Parser parser{ rx_buffer, sizeof(rx_buffer) }; // Responses are parsed in rx_buffer
+	SoftwareSerial myPort;						  // Software serial interface (when owned)
+	Stream* port;								  // Transport used for all traffic
 	HostState state = HostState::Synchronization; // Current state
-	Bootloader_Host();
+	bool port_ready = true;						  // The owned software serial accepted its pins
+	uint32_t sync_timeout_ms = 0;				  // Longest synchronization before a command, 0 waits forever
+	bool fec_enabled = false;					  // Data packets carry a FEC trailer this session
+	uint32_t write_address = 0;					  // Target address of the next data block written
 
 public:
+	static constexpr uint32_t JUMP_APP_KEY = 0x4032AFE5;	   // Magic key to jump to app
+	static constexpr uint32_t ENTER_CMD_MODE_KEY = 0x09B21FFC; // Magic key to enter cmd mode
+
+	/**
+	 * @brief Consumer of the data of a read, called once per data packet in address order
+	 *
+	 * @param context	Caller's context
+	 * @param offset	Offset of the data within the read
+	 * @param data		The data block of the packet, valid during the call only
+	 * @param length	The size of the data block in bytes
+	 * @return false to stop the read
+	 */
+	typedef bool (*ReadSink)(void* context, uint32_t offset, const uint8_t data[], uint32_t length);
+
 	BL_NACK_t last_nack_fields;
+	Host_Metrics metrics; // Per-phase latency histograms of this host
+	Image_Digest write_digest; // SHA-256 of every data block acknowledged since its last Begin()
+	Read_Cache read_cache;	   // Target memory read through SendCachedMemReadCommand
+	Write_Combiner write_combiner; // Writes queued by QueueMemWrite, flushed before any other operation on the target
+	Transfer_Progress progress{ metrics }; // Events of SendMemWriteCommand and of every read, while they run
+
+	/**
+	 * @brief Construct a host that owns a software serial port on the given pins
+	 * @note  Nothing is sent to the target until Begin()
+	 *
+	 * @param rx_pin	RX pin of the target's serial link
+	 * @param tx_pin	TX pin of the target's serial link
+	 */
+	Bootloader_Host(int8_t rx_pin, int8_t tx_pin);
+
+	/**
+	 * @brief Construct a host bound to an already initialized transport
+	 * @note  Nothing is sent to the target until Begin()
+	 *
+	 * @param transport	Stream connected to the target. Must outlive the host.
+	 */
+	explicit Bootloader_Host(Stream& transport);
+
+	/**
+	 * @brief Synchronizes with the target and puts it in command mode
+	 *
+	 * @param sync_timeout_ms	Longest wait for the sync byte, here and before later commands. 0 waits forever
+	 * @return true		If the target answered and entered command mode
+	 * @return false	If the port is unusable, or the target did not synchronize or enter command mode
+	 */
+	bool Begin(uint32_t sync_timeout_ms = 0);
+
+	/**
+	 * @brief Rebinds the host to another transport, e.g. a Wire_Trace wrapping the current one
+	 *
+	 * @param transport	Stream connected to the target. Must outlive the binding.
+	 */
+	void SetTransport(Stream& transport) { port = &transport; }
+
+	Stream& GetTransport() { return *port; }
+
 	/**
-	 * @brief Get the Instance object
+	 * @brief Get the default instance, bound to MYPORT_RX/MYPORT_TX
 	 *
 	 * @return * Bootloader_Host*
 	 */
@@ -57,16 +133,76 @@ public:
 	 */
 	bool SendFlashEraseCommand(uint32_t page_start_address, uint32_t page_count);
 
+	/**
+	 * @brief Sends a flash erase command asking for a mass erase of the whole flash
+	 *
+	 * @return true		If the flash was erased
+	 * @return false 	If the client rejected it or has no mass erase
+	 */
+	bool SendMassEraseCommand(void);
+
 	/**
 	 * @brief Sends a memmory read command to the client which reads from the start address
 	 *
 	 * @param start_address The start address at which to write data
 	 * @param length		The length of the data to read in bytes
 	 * @param out_buffer	Out buffer to read data into. Must be of appropriate length.
+	 * @param window		Packets the client may stream ahead of the host's ACKs.
+	 * 						Clients without streaming support read packet by packet.
 	 * @return true 		If operation was success
 	 * @return false 		If operation was failure (due to error in inputs or other)
 	 */
-	bool SendMemReadCommand(uint32_t start_address, uint32_t length, uint8_t out_buffer[]);
+	bool SendMemReadCommand(uint32_t start_address, uint32_t length, uint8_t out_buffer[], uint8_t window = BL_MEM_READ_MAX_WINDOW);
+
+	/**
+	 * @brief Reads memmory through the host's read cache, fetching only the lines it misses
+	 * @note  Only for data that must be current as of the last write or erase through this host
+	 *
+	 * @param start_address The start address to read from
+	 * @param length		The length of the data to read in bytes
+	 * @param out_buffer	Out buffer to read data into. Must be of appropriate length.
+	 * @return true 		If operation was success
+	 * @return false 		If a read of missing lines failed
+	 */
+	bool SendCachedMemReadCommand(uint32_t start_address, uint32_t length, uint8_t out_buffer[]);
+
+	/**
+	 * @brief Sends a memmory read command, handing every packet to a sink instead of a buffer
+	 *
+	 * @param start_address The start address to read from
+	 * @param length		The length of the data to read in bytes
+	 * @param sink			Consumer of the packets. Returning false NACKs the packet and ends the read.
+	 * @param context		Context passed to the sink
+	 * @param window		Packets the client may stream ahead of the host's ACKs
+	 * @return true 		If every packet was received and accepted by the sink
+	 * @return false 		If the read failed or the sink stopped it
+	 */
+	bool SendMemReadCommand(uint32_t start_address, uint32_t length, ReadSink sink, void* context, uint8_t window = BL_MEM_READ_MAX_WINDOW);
+
+	/**
+	 * @brief Reads memmory back and compares it with the expected data packet by packet
+	 * @note  Needs no read-back buffer, the read stops at the first differing packet
+	 *
+	 * @param start_address		The start address to verify
+	 * @param length			The length of the data to verify in bytes
+	 * @param expected			The expected data
+	 * @param mismatch_address	Out: address of the first differing byte, set on a mismatch only. May be null.
+	 * @return true 			If the memmory matches
+	 * @return false 			On a mismatch or a failed read
+	 */
+	bool SendMemVerifyCommand(uint32_t start_address, uint32_t length, const uint8_t expected[], uint32_t* mismatch_address);
+
+	/**
+	 * @brief Reads memmory back and compares it with data pulled from a stream packet by packet
+	 *
+	 * @param start_address		The start address to verify
+	 * @param length			The length of the data to verify in bytes
+	 * @param expected			Stream to read the expected data from (e.g. a cached image file)
+	 * @param mismatch_address	Out: address of the first differing byte, set on a mismatch only. May be null.
+	 * @return true 			If the memmory matches
+	 * @return false 			On a mismatch, a short read of the stream or a failed read
+	 */
+	bool SendMemVerifyCommand(uint32_t start_address, uint32_t length, Stream& expected, uint32_t* mismatch_address);
 
 	/**
 	 * @brief Sends a memmory write command to the client which writes at the start address
@@ -79,6 +215,138 @@ public:
 	 */
 	bool SendMemWriteCommand(uint32_t start_address, uint8_t data[], uint32_t data_size);
 
+	/**
+	 * @brief Sends a memmory write command whose data is pulled from a stream block by block
+	 *
+	 * @param start_address The start address at which to write data
+	 * @param source 		Stream to read the data from (e.g. a cached image file)
+	 * @param data_size 	The number of bytes to read from the stream and write
+	 * @param checkpoint 	Optional checkpoint told about every acknowledged block
+	 * @return true 		If operation was success
+	 * @return false 		If operation was failure (short read, or error on the client)
+	 */
+	bool SendMemWriteCommand(uint32_t start_address, Stream& source, uint32_t data_size, Transfer_Checkpoint* checkpoint = nullptr);
+
+	/**
+	 * @brief Queues a small memmory write, to be merged with the writes near it
+	 * @note  Queued writes are sent before the next write, read, erase, batch,
+	 * 		  command mode entry or jump, by FlushWrites or after a timeout
+	 *
+	 * @param start_address The start address at which to write data
+	 * @param data 			The data to write, copied
+	 * @param data_size 	The size of the data in bytes
+	 * @return true 		If the write was queued
+	 * @return false 		If sending earlier queued writes to make room failed
+	 */
+	bool QueueMemWrite(uint32_t start_address, const uint8_t data[], uint32_t data_size);
+
+	/**
+	 * @brief Sends every queued write
+	 *
+	 * @return true 		If all of them were written, or none was queued
+	 * @return false 		If one failed, the rest are dropped
+	 */
+	bool FlushWrites(void);
+
+	/**
+	 * @brief Starts a memmory write by sending the MEM_WRITE command only
+	 * @note  Follow with SendDataBlock for every block, the last one with end_flag set
+	 *
+	 * @param start_address The start address at which to write data
+	 * @return true 		If the client accepted the command
+	 * @return false 		If the client rejected the command
+	 */
+	bool BeginMemWrite(uint32_t start_address);
+
+	/**
+	 * @brief Sends one data packet of an ongoing memmory write, re-sending it on NACK
+	 *
+	 * @param data 				The block data, at most BL_DATA_BLOCK_SIZE bytes
+	 * @param data_size 		The size of the block in bytes
+	 * @param next_block_len 	The size of the block that follows, 0 if none
+	 * @param end_flag 			Whether this is the last block of the write
+	 * @return true 			If the block was acknowledged
+	 * @return false 			If the block was rejected BL_MAX_BLOCK_RETRIES times
+	 */
+	bool SendDataBlock(uint8_t data[], uint32_t data_size, uint32_t next_block_len, bool end_flag);
+
+	/**
+	 * @brief Sends a flash erase command without waiting for its two acks
+	 * @note  SendFlashEraseCommand split for callers driving several targets at once, see PollAck
+	 *
+	 * @param page_start_address The address of the page at which to start erasing
+	 * @param page_count 		 The number of pages to erase starting at the start address
+	 * @return true		If the command was sent
+	 * @return false 	If flushing the queued writes failed or the command could not be built
+	 */
+	bool PostFlashErase(uint32_t page_start_address, uint32_t page_count);
+
+	/**
+	 * @brief Sends the MEM_WRITE command without waiting for its ack
+	 * @note  BeginMemWrite split for callers driving several targets at once, see PollAck
+	 *
+	 * @param start_address The start address at which to write data
+	 * @return true 		If the command was sent
+	 * @return false 		If flushing the queued writes failed or the command could not be built
+	 */
+	bool PostMemWrite(uint32_t start_address);
+
+	/**
+	 * @brief Sends one data packet of an ongoing memmory write without waiting for its ack
+	 * @note  Call again to resend the block on a NACK, and CompleteDataBlock once it is acknowledged
+	 *
+	 * @param data 				The block data, at most BL_DATA_BLOCK_SIZE bytes
+	 * @param data_size 		The size of the block in bytes
+	 * @param next_block_len 	The size of the block that follows, 0 if none
+	 * @param end_flag 			Whether this is the last block of the write
+	 * @return true 			If the block was sent
+	 * @return false 			If the packet could not be built
+	 */
+	bool PostDataBlock(uint8_t data[], uint32_t data_size, uint32_t next_block_len, bool end_flag);
+
+	/**
+	 * @brief Accounts for an acknowledged data block: digest, write address and progress
+	 *
+	 * @param data 				The block data
+	 * @param data_size 		The size of the block in bytes
+	 */
+	void CompleteDataBlock(const uint8_t data[], uint32_t data_size);
+
+	/**
+	 * @brief Receives an ack if a whole one has arrived, without waiting for it
+	 *
+	 * @param ack	Out: whether it was positive, set when one was received
+	 * @return true 	If an ack was received
+	 * @return false 	If none is complete yet
+	 */
+	bool PollAck(bool* ack);
+
+	/**
+	 * @brief Sends a BATCH command and collects the result of every sub-command
+	 * @note  Use Bootloader_Batch to compose the command
+	 *
+	 * @param cmd			The built BATCH command
+	 * @param results 		Out: one result per sub-command that ran, BL_BATCH_MAX_COMMANDS at most
+	 * @param result_count	Out: number of results
+	 * @return true 		If every sub-command succeeded
+	 * @return false 		If the batch was rejected or one of its sub-commands failed
+	 */
+	bool SendBatchCommand(BL_BATCH_CMD& cmd, BL_BATCH_RESULT results[], uint8_t* result_count);
+
+	/**
+	 * @brief	Turns forward error correction of data packets on or off for the session
+	 *
+	 * @param enable	Whether data packets should carry a FEC trailer
+	 * @return true		If the client switched
+	 * @return false	If the client rejected it, FEC is then off
+	 */
+	bool SendFecCommand(bool enable);
+
+	/**
+	 * @brief	Whether data packets carry a FEC trailer this session
+	 */
+	bool FecEnabled() const { return fec_enabled; }
+
 	/**
 	 * @brief	Sends enter command mode command which allows the client to send commands
 	 *
@@ -131,7 +399,66 @@ private:
 	 */
 	bool ReceiveResponse(uint32_t* length);
 
-	bool ReceivePacket(uint32_t* length);
+	/**
+	 * @brief 	Receives a data packet, its data block directly into the destination
+	 * @note 	The packet fields are left in rx_buffer, the CRC is not checked.
+	 * 			With FEC enabled the data block is corrected before returning.
+	 *
+	 * @param data_out	Where to receive the data block
+	 * @param capacity	Bytes left in data_out
+	 * @return true 	If a packet was received
+	 * @return false 	If the packet lengths are invalid or do not fit in data_out
+	 */
+	bool ReceivePacket(uint8_t data_out[], uint32_t capacity);
+
+	/**
+	 * @brief 	Asks the client for a streaming read, falling back to a plain MEM_READ
+	 *
+	 * @param start_address	The start address to read from
+	 * @param length		The length of the data to read in bytes
+	 * @param window		Packets the host can take ahead of its ACKs
+	 * @param granted		Out: window granted by the client, 0 for a packet by packet read
+	 * @return true 		If the client accepted one of the commands
+	 * @return false 		If the client rejected the read
+	 */
+	bool BeginMemRead(uint32_t start_address, uint32_t length, uint8_t window, uint8_t* granted);
+
+	/**
+	 * @brief 	Runs a read into a buffer, or into a sink when out_buffer is null
+	 */
+	bool ReadMemory(uint32_t start_address, uint32_t length, uint8_t out_buffer[], ReadSink sink, void* context, uint8_t window);
+
+	/**
+	 * @brief 	Receives the packets of a read, acknowledging each one
+	 * @note 	Without out_buffer, packets are staged in rx_buffer behind their fields
+	 */
+	bool ReceiveMemRead(uint32_t length, uint8_t out_buffer[], ReadSink sink, void* context);
+
+	/**
+	 * @brief 	Receives the packets of a streaming read, acknowledging them cumulatively
+	 * @note 	A corrupted packet is NACKed with the index to resend from, packets
+	 * 			the client sent before it saw the NACK are dropped
+	 */
+	bool ReceiveMemReadStream(uint32_t length, uint8_t out_buffer[], ReadSink sink, void* context, uint8_t window);
+
+	/**
+	 * @brief 	Sends a cumulative ack of a streaming read
+	 *
+	 * @param ack_value		1 to confirm every packet before packet_index, 0 to ask for a resend
+	 * @param field			NACK reason
+	 * @param packet_index	Index of the next packet expected
+	 */
+	void SendStreamAck(uint8_t ack_value, BL_NACK_t field, uint32_t packet_index);
+
+	/**
+	 * @brief 	Receives a command-framed response into rx_buffer, skipping any garbage before it
+	 *
+	 * @param capacity	Largest payload size accepted, header included
+	 * @return true 	If a frame with a valid header and CRC was received
+	 * @return false 	If none arrived within BL_RECEIVE_TIMEOUT_MS
+	 */
+	bool ReceiveFrame(uint32_t capacity);
+
 	/**
 	 * @brief 	Receives an ack
 	 *
@@ -141,6 +468,22 @@ private:
 	 */
 	bool ReceiveAck(uint8_t* nack_field);
 
+	/**
+	 * @brief 	Waits for the first byte of a reply
+	 *
+	 * @return true 	If data is available
+	 * @return false 	After BL_RECEIVE_TIMEOUT_MS without any
+	 */
+	bool WaitForData(void);
+
+	/**
+	 * @brief 	Checks whether a complete ack is waiting in the receive buffer
+	 *
+	 * @return true 	If ReceiveAck would not block
+	 * @return false 	If the ack has not fully arrived yet
+	 */
+	bool AckAvailable(void);
+
 	/**
 	 * @brief 	Sends an ack
 	 *
@@ -151,9 +494,21 @@ private:
 
 	/**
 	 * @brief 	Synchronizes the host with the client
-	 * @note 	This function blocks until the host is synchronized
+	 *
+	 * @param timeout_ms	Longest wait for the sync byte, 0 waits forever
+	 * @return true 	If the client answered
+	 * @return false 	If the deadline passed first
+	 */
+	bool SyncClient(uint32_t timeout_ms);
+
+	/**
+	 * @brief 	Sends a frame built at compile time and kept in flash
+	 *
+	 * @param frame	The frame, in PROGMEM
+	 * @param bytes	The size of the frame
+	 * @param id 	ID of the command, for printing
 	 */
-	void SyncClient(void);
+	void SendConstCommand(const uint8_t frame[], uint32_t bytes, BL_CommandID_t id);
 
 	/**
 	 * @brief 	Sends a command to the client
@@ -0,0 +1,191 @@
+#include <Arduino.h>
+#include "Bootloader_Scheduler.h"
+#include "Utilities.h"
+
+bool Bootloader_Scheduler::AddTarget(Bootloader_Host* host, bool ready) {
+	if (host == nullptr || target_count >= BL_SCHEDULER_MAX_TARGETS)
+		return false;
+
+	targets[target_count] = {};
+	targets[target_count].host = host;
+	targets[target_count].ready = ready;
+	targets[target_count].state = ready ? TargetState::Idle : TargetState::Failed;
+	target_count++;
+	return true;
+}
+
+bool Bootloader_Scheduler::FlashAll(uint32_t start_address, uint8_t data[], uint32_t data_size,
+	uint32_t erase_page, uint32_t erase_count)
+{
+	if (target_count == 0 || data_size == 0)
+		return false;
+
+	image_address = start_address;
+	image = data;
+	image_size = data_size;
+	block_count = (data_size + BL_DATA_BLOCK_SIZE - 1) / BL_DATA_BLOCK_SIZE;
+
+	uint32_t start = millis();
+
+	/* Post the first command to every target before waiting on any of them.
+	   The host flushes its queued writes first, so they land before the image */
+	for (uint8_t i = 0; i < target_count; i++) {
+		TargetStatus& target = targets[i];
+		Bootloader_Host* host = target.host;
+		bool ready = target.ready;
+		target = {};
+		target.host = host;
+		target.ready = ready;
+		target.last_nack = BL_NACK_SUCCESS;
+		if (!ready) {
+			target.state = TargetState::Failed;
+			continue;
+		}
+
+		if (erase_count) {
+			target.state = host->PostFlashErase(erase_page, erase_count) ? TargetState::Erasing : TargetState::Failed;
+			target.acks_pending = 2;
+		}
+		else {
+			PostWrite(target);
+		}
+		target.last_activity = millis();
+	}
+
+	/* Service whichever target has an ack ready until all of them finish */
+	uint8_t active = target_count;
+	while (active) {
+		active = 0;
+		for (uint8_t i = 0; i < target_count; i++) {
+			TargetStatus& target = targets[i];
+			if (target.state == TargetState::Done || target.state == TargetState::Failed)
+				continue;
+
+			bool ack = false;
+			if (target.host->PollAck(&ack)) {
+				target.last_nack = target.host->last_nack_fields;
+				HandleAck(target, ack);
+			}
+			else if (millis() - target.last_activity > BL_SCHEDULER_ACK_TIMEOUT_MS) {
+				DEBUG_PRINTF("Target %d timed out", i);
+				HandleAck(target, false);
+			}
+
+			if (target.state == TargetState::Done || target.state == TargetState::Failed) {
+				target.elapsed_ms = millis() - start;
+				target.host->progress.End(target.state == TargetState::Done);
+			}
+			else {
+				active++;
+			}
+		}
+		yield();
+	}
+
+	total_elapsed_ms = millis() - start;
+
+	bool status = true;
+	for (uint8_t i = 0; i < target_count; i++)
+		status &= (targets[i].state == TargetState::Done);
+
+	return status;
+}
+
+void Bootloader_Scheduler::PostWrite(TargetStatus& target) {
+	target.state = target.host->PostMemWrite(image_address) ? TargetState::WaitingForWriteAck : TargetState::Failed;
+	target.acks_pending = 1;
+	target.last_activity = millis();
+}
+
+void Bootloader_Scheduler::PostBlock(TargetStatus& target) {
+	uint32_t offset = target.block * BL_DATA_BLOCK_SIZE;
+	uint32_t size = min(BL_DATA_BLOCK_SIZE, image_size - offset);
+	uint32_t next_block = 0;
+	bool end_flag = (target.block + 1 == block_count);
+
+	if (!end_flag)
+		next_block = min(BL_DATA_BLOCK_SIZE, image_size - offset - size);
+
+	/* The same packet, FEC trailer and cache invalidation as SendDataBlock */
+	if (!target.host->PostDataBlock(&image[offset], size, next_block, end_flag))
+		target.state = TargetState::Failed;
+	target.last_activity = millis();
+}
+
+void Bootloader_Scheduler::HandleAck(TargetStatus& target, bool ack) {
+	switch (target.state) {
+	case TargetState::Erasing:
+		if (!ack) {
+			target.state = TargetState::Failed;
+			break;
+		}
+		target.last_activity = millis();
+		if (--target.acks_pending == 0)
+			PostWrite(target);
+		break;
+	case TargetState::WaitingForWriteAck:
+		if (!ack) {
+			target.state = TargetState::Failed;
+			break;
+		}
+		target.block = 0;
+		target.state = TargetState::WaitingForBlockAck;
+		target.host->progress.Begin(Transfer_Op::Write, image_address, image_size);
+		PostBlock(target);
+		break;
+	case TargetState::WaitingForBlockAck:
+	{
+		if (!ack) {
+			if (target.block_retries >= BL_SCHEDULER_MAX_RETRIES) {
+				target.state = TargetState::Failed;
+				break;
+			}
+			// Re-send
+			target.block_retries++;
+			target.retries++;
+			target.host->metrics.CountRetry();
+			PostBlock(target);
+			break;
+		}
+		uint32_t offset = target.block * BL_DATA_BLOCK_SIZE;
+		uint32_t size = min(BL_DATA_BLOCK_SIZE, image_size - offset);
+		target.host->CompleteDataBlock(&image[offset], size);
+		target.bytes_written += size;
+		target.block_retries = 0;
+		if (++target.block == block_count) {
+			target.state = TargetState::Done;
+			break;
+		}
+		PostBlock(target);
+	}
+	break;
+	default:
+		break;
+	}
+}
+
+uint32_t Bootloader_Scheduler::GetAggregateThroughput() const {
+	if (total_elapsed_ms == 0)
+		return 0;
+
+	uint64_t bytes = 0;
+	for (uint8_t i = 0; i < target_count; i++)
+		bytes += targets[i].bytes_written;
+
+	return (uint32_t)(bytes * 1000 / total_elapsed_ms);
+}
+
+const char* Bootloader_Scheduler::StateName(TargetState state) {
+	static const char* names[] = { "idle", "erasing", "waitingForWriteAck", "waitingForBlockAck", "done", "failed" };
+	return names[(uint8_t)state];
+}
+
+void Bootloader_Scheduler::PrintReport() const {
+	for (uint8_t i = 0; i < target_count; i++) {
+		const TargetStatus& target = targets[i];
+		DEBUG_PRINTF("Target %d: %s, %lu bytes, %lu retries, %lu ms, last error 0x%02X", i,
+			StateName(target.state), target.bytes_written, target.retries,
+			target.elapsed_ms, (uint8_t)target.last_nack);
+	}
+	DEBUG_PRINTF("Aggregate throughput = %lu B/s over %lu ms", GetAggregateThroughput(), total_elapsed_ms);
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include "Bootloader_Host.h"
+#include <stdint.h>
+
+#define BL_SCHEDULER_MAX_TARGETS (16U)		// Maximum number of targets driven at once
+#define BL_SCHEDULER_MAX_RETRIES (5U)		// Retries per block before a target is failed
+#define BL_SCHEDULER_ACK_TIMEOUT_MS (3000U) // Time to wait for a single ack
+
+/**
+ * @brief Flashes the same image onto several targets at once.
+ *
+ * Each target is a Bootloader_Host bound to its own transport. Commands are
+ * posted to every target and acks are collected as they arrive, so one slow
+ * target never holds back the others' next block. Everything is sent through
+ * the hosts' Post and Complete halves of their own commands, so each target
+ * gets the same framing, FEC, cache invalidation, digest and progress as a
+ * single-target write.
+ */
+class Bootloader_Scheduler
+{
+public:
+	enum class TargetState
+	{
+		Idle,
+		Erasing,
+		WaitingForWriteAck,
+		WaitingForBlockAck,
+		Done,
+		Failed
+	};
+
+	struct TargetStatus
+	{
+		Bootloader_Host* host;
+		bool ready;				// The host synchronized with its target, others fail without being used
+		TargetState state;
+		uint32_t block;			// Index of the block in flight
+		uint32_t bytes_written; // Bytes acknowledged by the target
+		uint32_t retries;		// Total number of resent blocks
+		uint32_t last_activity; // millis() of the last post or ack
+		uint32_t elapsed_ms;	// Time taken to finish or fail
+		uint8_t acks_pending;	// Acks still expected for the current command
+		uint8_t block_retries;	// Retries spent on the current block
+		BL_NACK_t last_nack;
+	};
+
+	/**
+	 * @brief Adds a target to the scheduler
+	 *
+	 * @param host	Host bound to the target's transport
+	 * @param ready	Whether the host's Begin() succeeded, a target that is not ready is reported as failed
+	 * @return true		If the target was added
+	 * @return false	If the scheduler is full
+	 */
+	bool AddTarget(Bootloader_Host* host, bool ready = true);
+
+	/**
+	 * @brief Erases and writes the same image on every target concurrently
+	 *
+	 * @param start_address	The start address at which to write data
+	 * @param data			The whole data array to write
+	 * @param data_size		The size of the data in bytes
+	 * @param erase_page	The address of the first page to erase
+	 * @param erase_count	The number of pages to erase, 0 to skip erasing
+	 * @return true		If every target was written successfully
+	 * @return false	If at least one target failed
+	 */
+	bool FlashAll(uint32_t start_address, uint8_t data[], uint32_t data_size,
+		uint32_t erase_page = 0, uint32_t erase_count = 0);
+
+	/**
+	 * @brief Gets the status of a target after (or during) FlashAll
+	 *
+	 * @param index	Index in the order targets were added
+	 * @return const TargetStatus&
+	 */
+	const TargetStatus& GetStatus(uint8_t index) const { return targets[index]; }
+
+	uint8_t GetTargetCount() const { return target_count; }
+
+	/**
+	 * @brief Gets the aggregate throughput of the last FlashAll
+	 *
+	 * @return uint32_t Bytes per second written across all targets
+	 */
+	uint32_t GetAggregateThroughput() const;
+
+	/**
+	 * @brief Prints per-target status and aggregate throughput
+	 */
+	void PrintReport() const;
+
+	static const char* StateName(TargetState state);
+
+private:
+	TargetStatus targets[BL_SCHEDULER_MAX_TARGETS];
+	uint8_t target_count = 0;
+
+	uint32_t image_address = 0;
+	uint8_t* image = nullptr;
+	uint32_t image_size = 0;
+	uint32_t block_count = 0;
+	uint32_t total_elapsed_ms = 0;
+
+	void PostWrite(TargetStatus& target);
+	void PostBlock(TargetStatus& target);
+	void HandleAck(TargetStatus& target, bool ack);
+};
@@ -1,6 +1,20 @@
 #include <base64.hpp>
 #include "Bootloader_Host.h"
+#include "Bootloader_Batch.h"
+#include "Bootloader_Scheduler.h"
+#include "Image_Cache.h"
+#include "Image_Parser.h"
+#include "Image_Writer.h"
+#include "Update_Planner.h"
+#include "Update_Job.h"
+#include "Transfer_Checkpoint.h"
+#include "Packet_Pool.h"
+#include "Memory_Accounting.h"
+#include "Protocol_Bench.h"
+#include "Wire_Trace.h"
+#include "Wire_Replay.h"
 #include "Utilities.h"
+#include "host_cmd_types.h"
 #include <ArduinoJson.h>
 #include <ArduinoJson.hpp>
 #include <ESP8266WiFi.h>
@@ -11,6 +25,10 @@
 #include <base64.hpp>
 
 Bootloader_Host* host;
+Image_Cache imageCache;
+Transfer_Checkpoint checkpoint;
+Protocol_Bench protocolBench;
+Wire_Trace wireTrace;
 
 // WiFi credentials
 const char* ssid = "Hazem";
@@ -26,6 +44,91 @@ const int serverPort = 8080;
 // WebSocket client object
 WebSocketsClient webSocket;
 
+// Time spent decoding requests and encoding replies, per control protocol
+struct ControlOverhead
+{
+	uint32_t count;
+	uint32_t decode_us;
+	uint32_t encode_us;
+};
+ControlOverhead jsonOverhead = {};
+ControlOverhead binaryOverhead = {};
+
+// Binary replies are built in place here, so they need no heap allocation
+uint8_t binaryReply[HOST_BIN_REPLY_HEADER_SIZE + HOST_BIN_MAX_READ_LENGTH];
+
+// Progress events are sent during a transfer that may be reading into binaryReply
+uint8_t progressFrame[HOST_BIN_REPLY_HEADER_SIZE + HOST_BIN_PROGRESS_SIZE];
+
+void sendJsonReply(JsonDocument& reply)
+{
+	uint32_t start = micros();
+	String jsonData;
+	serializeJson(reply, jsonData);
+	Tracked_Allocation tracked(Memory_Category::Json, jsonData.length());
+	webSocket.sendTXT(jsonData);
+	jsonOverhead.encode_us += micros() - start;
+}
+
+void sendRejectedReply(uint8_t command_id)
+{
+	StaticJsonDocument<128> rejectedJsonBuffer;
+	rejectedJsonBuffer["commandId"] = command_id;
+	rejectedJsonBuffer["status"] = false;
+	rejectedJsonBuffer["error"] = 0;
+	rejectedJsonBuffer["rejected"] = true;
+	sendJsonReply(rejectedJsonBuffer);
+}
+
+void sendInvalidReply(uint8_t command_id, const char* field)
+{
+	StaticJsonDocument<128> invalidJsonBuffer;
+	invalidJsonBuffer["commandId"] = command_id;
+	invalidJsonBuffer["status"] = false;
+	invalidJsonBuffer["error"] = 0;
+	invalidJsonBuffer["invalid"] = field;
+	sendJsonReply(invalidJsonBuffer);
+}
+
+/**
+ * @brief Checks an uploaded image before a buffer of the announced size is allocated for it
+ *
+ * @param binary_file	The base64 data of the request, nullptr if missing
+ * @param size			The size the request announces
+ * @return true		If the data is present and decodes to exactly size bytes
+ * @return false	If it would overflow the buffer, or leave part of it uninitialized
+ */
+bool validUpload(const char* binary_file, uint32_t size)
+{
+	return binary_file && decode_base64_length((const unsigned char*)binary_file) == size;
+}
+
+/**
+ * @brief Projects the heap an uploaded image needs at its peak
+ * @note  The request document is allocated before admission, so it is already
+ * 		  out of the free heap Admit compares with
+ *
+ * @param size			Size of the decoded image
+ * @param cached		Whether it is stored in the image cache, which opens a file
+ * @param reply_bytes	Heap of the reply: its serialized text, and its document if dynamic
+ * @return The sum of the buffers that coexist
+ */
+uint32_t uploadPeakBytes(uint32_t size, bool cached, uint32_t reply_bytes)
+{
+	return size + (cached ? IMAGE_CACHE_FILE_HEAP : 0) + reply_bytes;
+}
+
+void sendBinaryReply(uint8_t opcode, uint16_t request_id, bool status, uint8_t error, uint32_t payload_length)
+{
+	uint32_t start = micros();
+	binaryReply[0] = opcode;
+	host_write_le16(&binaryReply[1], request_id);
+	binaryReply[3] = status;
+	binaryReply[4] = error;
+	webSocket.sendBIN(binaryReply, HOST_BIN_REPLY_HEADER_SIZE + payload_length);
+	binaryOverhead.encode_us += micros() - start;
+}
+
 void handleVersionEvent()
 {
 	uint8_t version = host->SendVersionCommand();
@@ -35,9 +138,7 @@ void handleVersionEvent()
 	versionJsonBuffer["version"] = version;
 	versionJsonBuffer["commandId"] = BL_VER_CMD_ID;
 	versionJsonBuffer["status"] = (version != 0);
-	String jsonData;
-	serializeJson(versionJsonBuffer, jsonData);
-	webSocket.sendTXT(jsonData);
+	sendJsonReply(versionJsonBuffer);
 }
 
 void handleFlashEraseEvent(uint32_t address, uint32_t count)
@@ -49,71 +150,732 @@ void handleFlashEraseEvent(uint32_t address, uint32_t count)
 	eraseJsonBuffer["status"] = status;
 	eraseJsonBuffer["error"] = host->last_nack_fields;
 
-	String jsonData;
-	serializeJson(eraseJsonBuffer, jsonData);
-	webSocket.sendTXT(jsonData);
+	sendJsonReply(eraseJsonBuffer);
 }
 
-void handleMemoryWriteEvent(uint32_t start_address, uint8_t binary_data[], uint32_t size)
+void handleMemoryWriteEvent(uint32_t start_address, uint8_t binary_data[], uint32_t size, const char* hash = nullptr)
 {
+	host->write_digest.Begin();
 	bool status = host->SendMemWriteCommand(start_address, binary_data, size);
 
-	StaticJsonDocument<128> memoryWriteJsonBuffer;
+	char digest[IMAGE_DIGEST_HEX_LEN + 1];
+	host->write_digest.Finish(digest);
+
+	StaticJsonDocument<256> memoryWriteJsonBuffer;
 	memoryWriteJsonBuffer["commandId"] = BL_MEM_WRITE_CMD_ID;
 	memoryWriteJsonBuffer["status"] = status;
 	memoryWriteJsonBuffer["error"] = host->last_nack_fields;
+	memoryWriteJsonBuffer["digest"] = digest;
+	if (hash)
+		memoryWriteJsonBuffer["hash"] = hash;
 
-	String jsonData;
-	serializeJson(memoryWriteJsonBuffer, jsonData);
-	webSocket.sendTXT(jsonData);
+	sendJsonReply(memoryWriteJsonBuffer);
 }
 
-void handleMemoryReadEvent(uint32_t start_address, uint32_t length) {
+void handleQueuedWriteEvent(uint32_t start_address, uint8_t binary_data[], uint32_t size)
+{
+	bool status = host->QueueMemWrite(start_address, binary_data, size);
+
+	StaticJsonDocument<128> queuedWriteJsonBuffer;
+	queuedWriteJsonBuffer["commandId"] = BL_MEM_WRITE_CMD_ID;
+	queuedWriteJsonBuffer["status"] = status;
+	queuedWriteJsonBuffer["error"] = host->last_nack_fields;
+	queuedWriteJsonBuffer["queued"] = true;
+	queuedWriteJsonBuffer["pendingBytes"] = host->write_combiner.GetPendingBytes();
 
-	if (length >= ESP.getFreeHeap()) {
-		DynamicJsonDocument memoryReadJsonBuffer = DynamicJsonDocument(128);
-		String jsonData;
-		memoryReadJsonBuffer["commandId"] = BL_MEM_READ_CMD_ID;
-		memoryReadJsonBuffer["status"] = false;
-		memoryReadJsonBuffer["error"] = 0;
-		serializeJson(memoryReadJsonBuffer, jsonData);
-		webSocket.sendTXT(jsonData);
+	sendJsonReply(queuedWriteJsonBuffer);
+}
+
+void sendWriteBarrierReply(bool status, bool timeout)
+{
+	StaticJsonDocument<192> barrierJsonBuffer;
+	barrierJsonBuffer["commandId"] = HOST_WRITE_BARRIER_CMD_ID;
+	barrierJsonBuffer["status"] = status;
+	barrierJsonBuffer["error"] = status ? 0 : (uint8_t)host->last_nack_fields;
+	barrierJsonBuffer["timeout"] = timeout;
+	barrierJsonBuffer["queued"] = host->write_combiner.GetQueued();
+	barrierJsonBuffer["writes"] = host->write_combiner.GetFlushedWrites();
+
+	sendJsonReply(barrierJsonBuffer);
+}
+
+void sendTransferProgress(void* /* context */, const Transfer_Event& event)
+{
+	progressFrame[0] = HOST_PROGRESS_CMD_ID;
+	host_write_le16(&progressFrame[1], 0);
+	progressFrame[3] = event.status;
+	progressFrame[4] = 0;
+
+	uint8_t* payload = &progressFrame[HOST_BIN_REPLY_HEADER_SIZE];
+	payload[0] = (uint8_t)event.op;
+	payload[1] = event.final;
+	host_write_le32(&payload[2], event.address);
+	host_write_le32(&payload[6], event.done);
+	host_write_le32(&payload[10], event.total);
+	host_write_le32(&payload[14], event.rate);
+	host_write_le32(&payload[18], event.average_rate);
+	host_write_le32(&payload[22], event.retries);
+	host_write_le32(&payload[26], event.eta_ms);
+	webSocket.sendBIN(progressFrame, sizeof(progressFrame));
+}
+
+void handleProgressEvent(bool subscribe, uint32_t interval_ms)
+{
+	host->progress.SetSink(subscribe ? sendTransferProgress : nullptr, nullptr);
+	host->progress.SetInterval(interval_ms);
+
+	StaticJsonDocument<128> progressJsonBuffer;
+	progressJsonBuffer["commandId"] = HOST_PROGRESS_CMD_ID;
+	progressJsonBuffer["status"] = true;
+	progressJsonBuffer["error"] = 0;
+	progressJsonBuffer["subscribed"] = subscribe;
+	progressJsonBuffer["intervalMs"] = interval_ms;
+
+	sendJsonReply(progressJsonBuffer);
+}
+
+void handleMultiFlashEvent(uint32_t start_address, uint8_t data[], uint32_t size, uint32_t erase_address, uint32_t erase_count, JsonArray pins)
+{
+	Bootloader_Scheduler scheduler;
+	Bootloader_Host* targets[BL_SCHEDULER_MAX_TARGETS - 1];
+	uint8_t target_count = 0;
+	bool status = pins.size() < BL_SCHEDULER_MAX_TARGETS;
+
+	host->write_digest.Begin();
+	scheduler.AddTarget(host);
+
+	/* Every other target owns a software serial. One that is not wired, or not in its
+	   bootloader, gives up synchronizing after BL_SYNC_TIMEOUT_MS and is reported failed */
+	for (size_t i = 0; status && i < pins.size(); i++) {
+		if (ESP.getMaxFreeBlockSize() < sizeof(Bootloader_Host)) {
+			DEBUG_PRINTF("No room for target %d", i + 1);
+			status = false;
+			break;
+		}
+		Bootloader_Host* target = new Bootloader_Host(pins[i][0], pins[i][1]);
+		bool ready = target->Begin(BL_SYNC_TIMEOUT_MS);
+		if (!ready) {
+			DEBUG_PRINTF("Target %d did not synchronize", i + 1);
+		}
+		target->write_digest.Begin();
+		targets[target_count++] = target;
+		scheduler.AddTarget(target, ready);
+	}
+
+	status = status && scheduler.FlashAll(start_address, data, size, erase_address, erase_count);
+	scheduler.PrintReport();
+
+	DynamicJsonDocument multiFlashJsonBuffer(256 + 128 * scheduler.GetTargetCount());
+	Tracked_Allocation tracked_json(Memory_Category::Json, multiFlashJsonBuffer.capacity());
+	multiFlashJsonBuffer["commandId"] = HOST_MULTI_FLASH_CMD_ID;
+	multiFlashJsonBuffer["status"] = status;
+	multiFlashJsonBuffer["error"] = host->last_nack_fields;
+	multiFlashJsonBuffer["aggregateBps"] = scheduler.GetAggregateThroughput();
+	char digest[IMAGE_DIGEST_HEX_LEN + 1];
+	host->write_digest.Finish(digest);
+	multiFlashJsonBuffer["digest"] = digest;
+
+	JsonArray results = multiFlashJsonBuffer.createNestedArray("targets");
+	for (uint8_t i = 0; i < scheduler.GetTargetCount(); i++) {
+		const Bootloader_Scheduler::TargetStatus& target = scheduler.GetStatus(i);
+		JsonObject result = results.createNestedObject();
+		result["state"] = Bootloader_Scheduler::StateName(target.state);
+		result["bytes"] = target.bytes_written;
+		result["retries"] = target.retries;
+		result["elapsedMs"] = target.elapsed_ms;
+		result["error"] = (uint8_t)target.last_nack;
+	}
+	sendJsonReply(multiFlashJsonBuffer);
+
+	for (uint8_t i = 0; i < target_count; i++)
+		delete targets[i];
+}
+
+void handleMemoryReadEvent(uint32_t start_address, uint32_t length, bool cached) {
+
+	/* The read buffer, its JSON document and the serialized reply (up to "255," per byte) coexist */
+	uint32_t json_capacity = length + 128;
+	uint32_t serialized_size = 4 * length + 128;
+
+	if (!memory_accounting.Admit(BL_MEM_READ_CMD_ID, length + json_capacity + serialized_size, serialized_size)) {
+		sendRejectedReply(BL_MEM_READ_CMD_ID);
 	}
 	else {
 		uint8_t* buffer = new uint8_t[length];
-		bool status = host->SendMemReadCommand(start_address, length, buffer);
+		Tracked_Allocation tracked_buffer(Memory_Category::ReadBuffer, length);
+		uint32_t bytes_cached = host->read_cache.GetBytesCached();
+		bool status = cached ? host->SendCachedMemReadCommand(start_address, length, buffer) :
+			host->SendMemReadCommand(start_address, length, buffer);
 
-		DynamicJsonDocument memoryReadJsonBuffer = DynamicJsonDocument(length + 128);
+		DynamicJsonDocument memoryReadJsonBuffer = DynamicJsonDocument(json_capacity);
+		Tracked_Allocation tracked_json(Memory_Category::Json, json_capacity);
 		memoryReadJsonBuffer["commandId"] = BL_MEM_READ_CMD_ID;
 		memoryReadJsonBuffer["status"] = status;
 		memoryReadJsonBuffer["error"] = host->last_nack_fields;
+		memoryReadJsonBuffer["fromCache"] = host->read_cache.GetBytesCached() - bytes_cached;
 		JsonArray binary = memoryReadJsonBuffer.createNestedArray("binaryData");
 
 		for (int i = 0; i < length; i++) {
 			binary.add(buffer[i]);
 		}
-		String jsonData;
-
-		serializeJson(memoryReadJsonBuffer, jsonData);
-		webSocket.sendTXT(jsonData);
+		sendJsonReply(memoryReadJsonBuffer);
 
 		memoryReadJsonBuffer.clear();
-		delete buffer;
+		delete[] buffer;
+	}
+}
+
+void handleCachedWriteEvent(uint32_t start_address, const char* hash, Image_Parser::Format format)
+{
+	uint32_t size = 0;
+	bool status = false;
+	File image = imageCache.Open(hash, &size);
+	host->write_digest.Begin();
+
+	if (!image) {
+		DEBUG_PRINTF("Image %s is not cached", hash);
+	}
+	else if (format == Image_Parser::Format::Binary) {
+		/* Checkpointed, so an interrupted write can be resumed instead of restarted */
+		checkpoint.Begin(hash, start_address, size);
+		status = host->SendMemWriteCommand(start_address, image, size, &checkpoint);
+		if (status)
+			checkpoint.Clear();
+	}
+	else {
+		/* Segments go straight from the file into MEM_WRITE transfers at their own addresses */
+		Image_Writer* writer = new Image_Writer(host);
+		Image_Parser parser(Image_Writer::Sink, writer);
+		status = parser.Parse(image, format) && writer->Finish();
+		DEBUG_PRINTF("Wrote %lu bytes in %lu segments", writer->GetBytesWritten(), writer->GetSegmentCount());
+		delete writer;
+	}
+
+	if (image)
+		image.close();
+
+	char digest[IMAGE_DIGEST_HEX_LEN + 1];
+	host->write_digest.Finish(digest);
+
+	StaticJsonDocument<192> cachedWriteJsonBuffer;
+	cachedWriteJsonBuffer["commandId"] = HOST_CACHED_WRITE_CMD_ID;
+	cachedWriteJsonBuffer["status"] = status;
+	cachedWriteJsonBuffer["error"] = image ? (uint8_t)host->last_nack_fields : 0;
+	cachedWriteJsonBuffer["digest"] = digest;
+
+	sendJsonReply(cachedWriteJsonBuffer);
+}
+
+void handleCacheStoreEvent(uint8_t binary_data[], uint32_t size)
+{
+	char hash[IMAGE_CACHE_HASH_LEN + 1] = { 0 };
+	bool status = imageCache.Store(binary_data, size, hash);
+
+	StaticJsonDocument<192> cacheStoreJsonBuffer;
+	cacheStoreJsonBuffer["commandId"] = HOST_CACHE_STORE_CMD_ID;
+	cacheStoreJsonBuffer["status"] = status;
+	cacheStoreJsonBuffer["hash"] = hash;
+
+	sendJsonReply(cacheStoreJsonBuffer);
+}
+
+void handlePlannedWriteEvent(uint32_t start_address, const char* hash, Image_Parser::Format format,
+	const Memory_Map& map, bool dry_run)
+{
+	uint32_t size = 0;
+	bool status = false;
+	Update_Planner planner(map);
+	File image = imageCache.Open(hash, &size);
+
+	if (image) {
+		/* First pass only collects the extents of the image, a malformed image gets no plan */
+		if (format == Image_Parser::Format::Binary) {
+			status = planner.AddSegment(start_address, size);
+		}
+		else {
+			Image_Parser parser(Update_Planner::Sink, &planner);
+			status = parser.Parse(image, format);
+		}
+
+		status = status && planner.Build();
+		if (status) {
+			planner.Print();
+			if (!dry_run) {
+				host->write_digest.Begin();
+				status = planner.Execute(host, image, format);
+			}
+		}
+		image.close();
 	}
+
+	StaticJsonDocument<192> plannedWriteJsonBuffer;
+	plannedWriteJsonBuffer["commandId"] = HOST_PLANNED_WRITE_CMD_ID;
+	plannedWriteJsonBuffer["status"] = status;
+	plannedWriteJsonBuffer["error"] = host->last_nack_fields;
+	plannedWriteJsonBuffer["dryRun"] = dry_run;
+	plannedWriteJsonBuffer["erases"] = planner.GetEraseCount();
+	plannedWriteJsonBuffer["writes"] = planner.GetWriteCount();
+	plannedWriteJsonBuffer["estimatedMs"] = planner.EstimateMillis();
+
+	sendJsonReply(plannedWriteJsonBuffer);
+}
+
+void sendUpdateJobProgress(void* /* context */, const Update_Job::Progress& progress)
+{
+	StaticJsonDocument<128> progressJsonBuffer;
+	progressJsonBuffer["commandId"] = HOST_UPDATE_JOB_CMD_ID;
+	progressJsonBuffer["stage"] = Update_Job::StageName(progress.stage);
+	progressJsonBuffer["done"] = progress.done;
+	progressJsonBuffer["total"] = progress.total;
+	sendJsonReply(progressJsonBuffer);
 }
 
-void handleJumpToAppCommand()
+void handleUpdateJobEvent(const Update_Job_Spec& spec)
 {
-	bool status = host->SendJumpToAppCommand();
+	Update_Job* job = new Update_Job(spec, sendUpdateJobProgress, nullptr);
+	bool status = job->Run(host, imageCache);
+
+	StaticJsonDocument<384> updateJobJsonBuffer;
+	updateJobJsonBuffer["commandId"] = HOST_UPDATE_JOB_CMD_ID;
+	updateJobJsonBuffer["status"] = status;
+	updateJobJsonBuffer["error"] = host->last_nack_fields;
+	if (!status)
+		updateJobJsonBuffer["failedStage"] = Update_Job::StageName(job->GetFailedStage());
+	if (job->HasMismatch())
+		updateJobJsonBuffer["mismatchAddress"] = job->GetMismatchAddress();
+	updateJobJsonBuffer["erases"] = job->GetPlanner().GetEraseCount();
+	updateJobJsonBuffer["writes"] = job->GetPlanner().GetWriteCount();
+	updateJobJsonBuffer["massErase"] = job->UsedMassErase();
+	updateJobJsonBuffer["eraseEstimatedMs"] = job->GetEraseEstimatedMillis();
+	updateJobJsonBuffer["eraseActualMs"] = job->GetEraseActualMillis();
+	char digest[IMAGE_DIGEST_HEX_LEN + 1];
+	host->write_digest.Finish(digest);
+	updateJobJsonBuffer["digest"] = digest;
+	delete job;
+
+	sendJsonReply(updateJobJsonBuffer);
+}
+
+void handleResumeWriteEvent(const Memory_Map& map)
+{
+	bool pending = checkpoint.Load();
+	Transfer_Checkpoint::Record record = checkpoint.GetRecord(); // Cleared once the write completes
+	bool status = pending && checkpoint.Resume(host, imageCache, map);
+
+	StaticJsonDocument<256> resumeWriteJsonBuffer;
+	resumeWriteJsonBuffer["commandId"] = HOST_RESUME_WRITE_CMD_ID;
+	resumeWriteJsonBuffer["status"] = status;
+	resumeWriteJsonBuffer["error"] = pending ? (uint8_t)host->last_nack_fields : 0;
+	resumeWriteJsonBuffer["pending"] = pending;
+	if (pending) {
+		resumeWriteJsonBuffer["hash"] = record.hash;
+		resumeWriteJsonBuffer["ackedBlocks"] = record.acked_blocks;
+	}
+
+	sendJsonReply(resumeWriteJsonBuffer);
+}
+
+void handlePoolStatsEvent()
+{
+	StaticJsonDocument<384> poolStatsJsonBuffer;
+	poolStatsJsonBuffer["commandId"] = HOST_POOL_STATS_CMD_ID;
+	poolStatsJsonBuffer["status"] = true;
+
+	const char* names[] = { "small", "large" };
+	const Packet_Pool_Stats* stats[] = { &small_packet_pool.GetStats(), &large_packet_pool.GetStats() };
+	for (uint8_t i = 0; i < 2; i++) {
+		JsonObject pool = poolStatsJsonBuffer.createNestedObject(names[i]);
+		pool["allocations"] = stats[i]->allocations;
+		pool["inUse"] = stats[i]->in_use;
+		pool["peak"] = stats[i]->peak_in_use;
+		pool["exhausted"] = stats[i]->exhausted;
+	}
+
+	/* Fragmentation should stay flat over long sessions now that packets avoid the heap */
+	poolStatsJsonBuffer["freeHeap"] = ESP.getFreeHeap();
+	poolStatsJsonBuffer["maxFreeBlock"] = ESP.getMaxFreeBlockSize();
+	poolStatsJsonBuffer["fragmentation"] = ESP.getHeapFragmentation();
+
+	sendJsonReply(poolStatsJsonBuffer);
+}
+
+void handleBenchmarkEvent(uint32_t iterations, uint8_t tolerance, bool save)
+{
+	uint8_t regressions = protocolBench.Run(iterations, tolerance);
+	bool saved = save && protocolBench.SaveBaseline();
+
+	DynamicJsonDocument benchmarkJsonBuffer(3072);
+	Tracked_Allocation tracked(Memory_Category::Json, benchmarkJsonBuffer.capacity());
+	benchmarkJsonBuffer["commandId"] = HOST_BENCHMARK_CMD_ID;
+	benchmarkJsonBuffer["status"] = regressions == 0 && saved == save;
+	benchmarkJsonBuffer["iterations"] = iterations;
+	benchmarkJsonBuffer["regressions"] = regressions;
+	benchmarkJsonBuffer["saved"] = saved;
+
+	JsonArray results = benchmarkJsonBuffer.createNestedArray("results");
+	for (uint8_t i = 0; i < protocolBench.GetCount(); i++) {
+		const Protocol_Bench::Result& result = protocolBench.GetResult(i);
+		JsonObject entry = results.createNestedObject();
+		entry["name"] = result.name;
+		entry["nsPerOp"] = result.ns_per_op;
+		entry["bytesPerSec"] = Protocol_Bench::BytesPerSecond(result);
+		entry["allocsPerOp"] = (float)result.allocations / iterations;
+		entry["baselineNs"] = result.baseline_ns;
+		entry["regression"] = result.regression;
+	}
+
+	sendJsonReply(benchmarkJsonBuffer);
+}
+
+void handleMemoryStatsEvent()
+{
+	DynamicJsonDocument memoryStatsJsonBuffer(1536);
+	Tracked_Allocation tracked(Memory_Category::Json, memoryStatsJsonBuffer.capacity());
+	memoryStatsJsonBuffer["commandId"] = HOST_MEMORY_STATS_CMD_ID;
+	memoryStatsJsonBuffer["status"] = true;
+	memoryStatsJsonBuffer["freeHeap"] = ESP.getFreeHeap();
+	memoryStatsJsonBuffer["maxFreeBlock"] = ESP.getMaxFreeBlockSize();
+
+	JsonObject categories = memoryStatsJsonBuffer.createNestedObject("categories");
+	for (uint8_t i = 0; i < (uint8_t)Memory_Category::Count; i++) {
+		JsonObject category = categories.createNestedObject(Memory_Accounting::CategoryName((Memory_Category)i));
+		category["current"] = memory_accounting.GetCurrent((Memory_Category)i);
+		category["peak"] = memory_accounting.GetPeak((Memory_Category)i);
+	}
+
+	JsonArray commands = memoryStatsJsonBuffer.createNestedArray("commands");
+	for (uint8_t i = 0; i < memory_accounting.GetRecordCount(); i++) {
+		const Memory_Command_Record& record = memory_accounting.GetRecord(i);
+		JsonObject command = commands.createNestedObject();
+		command["commandId"] = record.command_id;
+		command["count"] = record.count;
+		command["rejected"] = record.rejected;
+		command["peakTracked"] = record.peak_tracked;
+		command["peakHeapUsed"] = record.peak_heap_used;
+		command["minLargestBlock"] = record.min_largest_block;
+	}
+
+	sendJsonReply(memoryStatsJsonBuffer);
+}
+
+/**
+ * @brief Reads the memory map of a request, before anything plans with it
+ *
+ * @return true		If the map is usable
+ * @return false	If the page size is 0, the flash is not whole pages, or a protected
+ * 					region is malformed, empty, wraps around or does not fit in the map
+ */
+bool readMemoryMap(JsonDocument& request, Memory_Map& map)
+{
+	map.flash_base = request["flashBase"] | map.flash_base;
+	map.flash_size = request["flashSize"] | map.flash_size;
+	map.page_size = request["pageSize"] | map.page_size;
+	map.page_erase_ms = request["pageEraseMs"] | map.page_erase_ms;
+	map.mass_erase_ms = request["massEraseMs"] | map.mass_erase_ms;
+	map.mass_erase_percent = request["massErasePercent"] | map.mass_erase_percent;
+
+	if (map.page_size == 0 || map.flash_size == 0 || map.flash_size % map.page_size) {
+		DEBUG_PRINTF("Invalid memory map: flash size %lu, page size %lu", map.flash_size, map.page_size);
+		return false;
+	}
+
+	/* A region dropped, or read as 0/0, would let a plan erase what the client protected */
+	JsonArray regions = request["protected"];
+	for (size_t i = 0; i < regions.size(); i++) {
+		JsonArray region = regions[i];
+		bool valid = region.size() == 2 && region[0].is<uint32_t>() && region[1].is<uint32_t>();
+		uint32_t address = region[0];
+		uint32_t length = region[1];
+		if (!valid || length == 0 || length > UINT32_MAX - address || !map.AddProtected(address, length)) {
+			DEBUG_PRINTF("Invalid protected region %d", i);
+			return false;
+		}
+	}
+
+	/* The read cache needs the page size to know what later erases cover,
+	   the write combiner to keep bridged gaps within a page */
+	host->read_cache.SetPageSize(map.page_size);
+	host->write_combiner.SetPageSize(map.page_size);
+	return true;
+}
+
+void handleJumpToAppCommand(const char* expected_digest = nullptr)
+{
+	/* Refuse to start an application that is not what the client meant to flash */
+	bool digest_ok = !expected_digest || host->write_digest.Matches(expected_digest);
+	bool status = digest_ok && host->SendJumpToAppCommand();
 
 	StaticJsonDocument<128> jumpAppJsonBuffer;
 	jumpAppJsonBuffer["commandId"] = BL_JUMP_TO_APP_CMD_ID;
 	jumpAppJsonBuffer["status"] = status;
-	jumpAppJsonBuffer["error"] = host->last_nack_fields;
+	jumpAppJsonBuffer["error"] = digest_ok ? (uint8_t)host->last_nack_fields : 0;
+	if (!digest_ok)
+		jumpAppJsonBuffer["digestMismatch"] = true;
 
-	String jsonData;
-	serializeJson(jumpAppJsonBuffer, jsonData);
-	webSocket.sendTXT(jsonData);
+	sendJsonReply(jumpAppJsonBuffer);
+}
+
+void handleFecCommand(bool enable)
+{
+	bool status = host->SendFecCommand(enable);
+
+	StaticJsonDocument<128> fecJsonBuffer;
+	fecJsonBuffer["commandId"] = BL_FEC_CMD_ID;
+	fecJsonBuffer["status"] = status;
+	fecJsonBuffer["enabled"] = host->FecEnabled();
+	fecJsonBuffer["error"] = host->last_nack_fields;
+
+	sendJsonReply(fecJsonBuffer);
+}
+
+void handleTraceEvent(const char* action, bool timed)
+{
+	StaticJsonDocument<512> traceJsonBuffer;
+	traceJsonBuffer["commandId"] = HOST_TRACE_CMD_ID;
+	bool status = true;
+
+	if (!strcmp(action, "start")) {
+		if (wireTrace.Recording())
+			host->SetTransport(*wireTrace.Stop());
+		wireTrace.Start(host->GetTransport());
+		host->SetTransport(wireTrace);
+
+		/* A replay starts from a known session, so does the trace */
+		status = host->SendEnterCmdModeCommand();
+	}
+	else if (!strcmp(action, "stop")) {
+		if (wireTrace.Recording())
+			host->SetTransport(*wireTrace.Stop());
+	}
+	else if (!strcmp(action, "save")) {
+		status = wireTrace.Save();
+	}
+	else if (!strcmp(action, "replay")) {
+		Wire_Replay* replay = new Wire_Replay();
+		bool loaded = replay->Load();
+		status = loaded && replay->Run(timed);
+
+		const Wire_Replay::Report& report = replay->GetReport();
+		traceJsonBuffer["loaded"] = loaded;
+		traceJsonBuffer["commands"] = report.commands;
+		traceJsonBuffer["skipped"] = report.skipped;
+		traceJsonBuffer["failed"] = report.failed;
+		traceJsonBuffer["mismatchedBytes"] = report.mismatched_bytes;
+		if (report.mismatched_bytes)
+			traceJsonBuffer["firstMismatch"] = report.first_mismatch;
+		traceJsonBuffer["unscriptedBytes"] = report.unscripted_bytes;
+		traceJsonBuffer["recordedUs"] = report.recorded_us;
+		traceJsonBuffer["replayUs"] = report.replay_us;
+		traceJsonBuffer["recordedStallUs"] = report.recorded_stall_us;
+		traceJsonBuffer["recordedStallOffset"] = report.recorded_stall_offset;
+		traceJsonBuffer["replayStallUs"] = report.replay_stall_us;
+		traceJsonBuffer["replayStallOffset"] = report.replay_stall_offset;
+		delete replay;
+	}
+	else {
+		status = false;
+	}
+
+	traceJsonBuffer["status"] = status;
+	traceJsonBuffer["error"] = host->last_nack_fields;
+	traceJsonBuffer["recording"] = wireTrace.Recording();
+	traceJsonBuffer["bytes"] = wireTrace.GetSize();
+	traceJsonBuffer["records"] = wireTrace.GetRecords();
+	traceJsonBuffer["dropped"] = wireTrace.GetDropped();
+	sendJsonReply(traceJsonBuffer);
+}
+
+/* Arguments are read in place and replies built in binaryReply. The packets sent
+   to the target come from the packet pools, and only fall back to the heap when
+   those run out */
+void handleBinaryMessage(uint8_t* payload, size_t length)
+{
+	uint32_t start = micros();
+	if (length < HOST_BIN_HEADER_SIZE)
+		return;
+
+	uint8_t opcode = payload[0];
+	uint16_t request_id = host_read_le16(&payload[1]);
+	uint8_t* args = &payload[HOST_BIN_HEADER_SIZE];
+	size_t args_length = length - HOST_BIN_HEADER_SIZE;
+	uint8_t* reply_payload = &binaryReply[HOST_BIN_REPLY_HEADER_SIZE];
+
+	binaryOverhead.count++;
+	binaryOverhead.decode_us += micros() - start;
+	memory_accounting.SetCommand(opcode);
+
+	switch (opcode)
+	{
+	case BL_VER_CMD_ID:
+	{
+		uint8_t version = host->SendVersionCommand();
+		reply_payload[0] = version;
+		sendBinaryReply(opcode, request_id, version != 0, host->last_nack_fields, 1);
+	}
+	break;
+	case BL_FLASH_ERASE_CMD_ID:
+	{
+		/* address (u32), count (u32) */
+		if (args_length < 8) {
+			sendBinaryReply(opcode, request_id, false, BL_NACK_INVALID_LENGTH, 0);
+			break;
+		}
+		bool status = host->SendFlashEraseCommand(host_read_le32(&args[0]), host_read_le32(&args[4]));
+		sendBinaryReply(opcode, request_id, status, host->last_nack_fields, 0);
+	}
+	break;
+	case BL_MEM_WRITE_CMD_ID:
+	{
+		/* address (u32), size (u32), raw data; written straight from the frame */
+		uint32_t size = (args_length >= 8) ? host_read_le32(&args[4]) : 0;
+		if (args_length < 8 || args_length - 8 < size) {
+			sendBinaryReply(opcode, request_id, false, BL_NACK_INVALID_LENGTH, 0);
+			break;
+		}
+		bool status = host->SendMemWriteCommand(host_read_le32(&args[0]), &args[8], size);
+		sendBinaryReply(opcode, request_id, status, host->last_nack_fields, 0);
+	}
+	break;
+	case BL_MEM_READ_CMD_ID:
+	{
+		/* address (u32), length (u32), optional flags (u8, bit 0 bypasses the read cache);
+		   data is read into the reply buffer */
+		uint32_t read_length = (args_length >= 8) ? host_read_le32(&args[4]) : 0;
+		if (args_length < 8 || read_length > HOST_BIN_MAX_READ_LENGTH) {
+			sendBinaryReply(opcode, request_id, false, BL_NACK_INVALID_LENGTH, 0);
+			break;
+		}
+		bool bypass = args_length >= 9 && (args[8] & 0x01);
+		bool status = bypass ? host->SendMemReadCommand(host_read_le32(&args[0]), read_length, reply_payload) :
+			host->SendCachedMemReadCommand(host_read_le32(&args[0]), read_length, reply_payload);
+		sendBinaryReply(opcode, request_id, status, host->last_nack_fields, status ? read_length : 0);
+	}
+	break;
+	case BL_JUMP_TO_APP_CMD_ID:
+	{
+		bool status = host->SendJumpToAppCommand();
+		sendBinaryReply(opcode, request_id, status, host->last_nack_fields, 0);
+	}
+	break;
+	case BL_FEC_CMD_ID:
+	{
+		/* enable (u8) */
+		if (args_length < 1) {
+			sendBinaryReply(opcode, request_id, false, BL_NACK_INVALID_LENGTH, 0);
+			break;
+		}
+		bool status = host->SendFecCommand(args[0]);
+		sendBinaryReply(opcode, request_id, status, host->last_nack_fields, 0);
+	}
+	break;
+	case BL_BATCH_CMD_ID:
+	{
+		/* Sub-commands back to back, each an opcode (u8) and its arguments:
+		   ENTER_CMD_MODE, VER, JUMP_TO_APP (none), FLASH_ERASE (address u32, count u32),
+		   GOTO_ADDR (address u32). Reply: result count (u8), then per result
+		   opcode, ack, NACK field and value (u8 each) */
+		Bootloader_Batch batch(*host);
+		size_t i = 0;
+		bool valid = true;
+		while (valid && i < args_length) {
+			uint8_t sub_opcode = args[i++];
+			size_t left = args_length - i;
+			switch (sub_opcode) {
+			case BL_ENTER_CMD_MODE_CMD_ID: batch.EnterCmdMode(); break;
+			case BL_VER_CMD_ID: batch.Version(); break;
+			case BL_JUMP_TO_APP_CMD_ID: batch.JumpToApp(); break;
+			case BL_FLASH_ERASE_CMD_ID:
+				valid = left >= 8;
+				if (valid)
+					batch.FlashErase(host_read_le32(&args[i]), host_read_le32(&args[i + 4]));
+				i += 8;
+				break;
+			case BL_GOTO_ADDR_CMD_ID:
+				valid = left >= 4;
+				if (valid)
+					batch.GotoAddr(host_read_le32(&args[i]));
+				i += 4;
+				break;
+			default:
+				valid = false;
+				break;
+			}
+		}
+		if (!valid || batch.GetCommandCount() == 0) {
+			sendBinaryReply(opcode, request_id, false, BL_NACK_INVALID_CMD, 0);
+			break;
+		}
+
+		bool status = batch.Send();
+		reply_payload[0] = batch.GetResultCount();
+		for (uint8_t r = 0; r < batch.GetResultCount(); r++) {
+			const BL_BATCH_RESULT& result = batch.GetResult(r);
+			reply_payload[1 + 4 * r] = result.cmd_id;
+			reply_payload[2 + 4 * r] = result.ack;
+			reply_payload[3 + 4 * r] = result.field;
+			reply_payload[4 + 4 * r] = result.value;
+		}
+		sendBinaryReply(opcode, request_id, status, host->last_nack_fields, 1 + 4 * batch.GetResultCount());
+	}
+	break;
+	case HOST_OVERHEAD_CMD_ID:
+	{
+		/* count, decode us, encode us (u32 each), JSON first then binary */
+		const ControlOverhead* overheads[] = { &jsonOverhead, &binaryOverhead };
+		for (uint8_t i = 0; i < 2; i++) {
+			host_write_le32(&reply_payload[12 * i], overheads[i]->count);
+			host_write_le32(&reply_payload[12 * i + 4], overheads[i]->decode_us);
+			host_write_le32(&reply_payload[12 * i + 8], overheads[i]->encode_us);
+		}
+		sendBinaryReply(opcode, request_id, true, 0, 24);
+	}
+	break;
+	case HOST_METRICS_CMD_ID:
+	{
+		/* overhead ns, retries, NACK counts per flag, then per phase:
+		   count, total us, max us and the histogram buckets, then the
+		   BATCH commands sent and the sub-commands they carried, then the
+		   resynchronizations, bytes dropped and recovery us, then the data
+		   packets FEC corrected and the bits it corrected, then the read cache
+		   line hits and misses (u32 each).
+		   An optional u8 argument resets the metrics after reading them. */
+		uint8_t* out = reply_payload;
+		host_write_le32(out, Host_Metrics::MeasureOverhead());
+		host_write_le32(out + 4, host->metrics.GetRetries());
+		out += 8;
+		for (uint8_t bit = 0; bit < METRICS_NACK_BITS; bit++, out += 4)
+			host_write_le32(out, host->metrics.GetNackCount(bit));
+
+		for (uint8_t i = 0; i < (uint8_t)Host_Phase::Count; i++) {
+			const Host_Metrics::Phase_Stats& phase = host->metrics.GetPhase((Host_Phase)i);
+			host_write_le32(out, phase.count);
+			host_write_le32(out + 4, phase.total_us);
+			host_write_le32(out + 8, phase.max_us);
+			out += 12;
+			for (uint8_t bucket = 0; bucket < METRICS_BUCKET_COUNT; bucket++, out += 4)
+				host_write_le32(out, phase.buckets[bucket]);
+		}
+		host_write_le32(out, host->metrics.GetBatches());
+		host_write_le32(out + 4, host->metrics.GetBatchedCommands());
+		host_write_le32(out + 8, host->metrics.GetResyncs());
+		host_write_le32(out + 12, host->metrics.GetResyncBytes());
+		host_write_le32(out + 16, host->metrics.GetResyncMicros());
+		host_write_le32(out + 20, host->metrics.GetFecRepairs());
+		host_write_le32(out + 24, host->metrics.GetFecCorrectedBits());
+		host_write_le32(out + 28, host->read_cache.GetHits());
+		host_write_le32(out + 32, host->read_cache.GetMisses());
+		out += 36;
+
+		if (args_length >= 1 && args[0])
+			host->metrics.Reset();
+
+		sendBinaryReply(opcode, request_id, true, 0, out - reply_payload);
+	}
+	break;
+	default:
+		sendBinaryReply(opcode, request_id, false, BL_NACK_INVALID_CMD, 0);
+		break;
+	}
 }
 
 // Callback function when WebSocket connection is established
@@ -124,6 +886,8 @@ void webSocketEvent(WStype_t type, uint8_t* payload, size_t length)
 	{
 	case WStype_DISCONNECTED:
 		DEBUG_PRINTLN("WebSocket disconnected");
+		/* A subscription lasts as long as the connection that made it */
+		host->progress.SetSink(nullptr, nullptr);
 		break;
 	case WStype_CONNECTED:
 		DEBUG_PRINTLN("WebSocket connected");
@@ -132,17 +896,24 @@ void webSocketEvent(WStype_t type, uint8_t* payload, size_t length)
 	{
 		DEBUG_PRINTF("Received message of length: %d", length);
 
-		DynamicJsonDocument jsonBuffer(128);
+		uint32_t start = micros();
+		memory_accounting.BeginCommand();
+		DynamicJsonDocument jsonBuffer(1024); // Room for an update job with its memory map, or the pins of every scheduled target
+		Tracked_Allocation tracked_request(Memory_Category::Json, jsonBuffer.capacity());
 		DEBUG_PRINTF("Size of json buffer: %d", jsonBuffer.capacity());
 		DeserializationError error = deserializeJson(jsonBuffer, (char*)payload);
+		jsonOverhead.count++;
+		jsonOverhead.decode_us += micros() - start;
 		if (error)
 		{
 			DEBUG_PRINTF("Error parsing JSON: %s", error.c_str());
+			memory_accounting.EndCommand();
 			return;
 		}
 
-		BL_CommandID_t command = jsonBuffer["commandId"];
+		uint8_t command = jsonBuffer["commandId"];
 		DEBUG_PRINTF("Command: %d", command);
+		memory_accounting.SetCommand(command);
 
 		switch (command)
 		{
@@ -165,17 +936,229 @@ void webSocketEvent(WStype_t type, uint8_t* payload, size_t length)
 			uint32_t address = jsonBuffer["address"];
 			uint32_t size = jsonBuffer["size"];
 			const char* binaryFile = jsonBuffer["binaryData"];
+			bool combine = jsonBuffer["combine"] | false;
+			bool cache = jsonBuffer["cache"] | true;
+			if (!validUpload(binaryFile, size)) {
+				sendInvalidReply(command, "binaryData");
+				break;
+			}
+			if (!memory_accounting.Admit(command, uploadPeakBytes(size, cache && !combine, 256), size)) {
+				sendRejectedReply(command);
+				break;
+			}
 			uint8_t* decoded = new uint8_t[size];
+			Tracked_Allocation tracked_decoded(Memory_Category::Base64, size);
 			unsigned int out_size = decode_base64((unsigned char*)binaryFile, (unsigned char*)decoded);
-			handleMemoryWriteEvent(address, (uint8_t*)decoded, size);
-			delete decoded;
+
+			/* Small records are merged with the writes near them instead */
+			if (combine) {
+				handleQueuedWriteEvent(address, decoded, size);
+				delete[] decoded;
+				break;
+			}
+
+			/* Keep the image so the next target can be flashed without re-uploading it */
+			char hash[IMAGE_CACHE_HASH_LEN + 1] = { 0 };
+			if (cache && !imageCache.Store(decoded, size, hash))
+				DEBUG_PRINTLN(F("Failed to cache image"));
+
+			handleMemoryWriteEvent(address, (uint8_t*)decoded, size, cache ? hash : nullptr);
+			delete[] decoded;
+		}
+		break;
+		case HOST_CACHED_WRITE_CMD_ID:
+		{
+			DEBUG_PRINTLN(F("Cached write command"));
+			uint32_t address = jsonBuffer["address"];
+			const char* hash = jsonBuffer["hash"] | "";
+			Image_Parser::Format format = Image_Parser::FormatFromName(jsonBuffer["format"]);
+			if (format == Image_Parser::Format::Unknown) {
+				sendInvalidReply(command, "format");
+				break;
+			}
+			handleCachedWriteEvent(address, hash, format);
+		}
+		break;
+		case HOST_PLANNED_WRITE_CMD_ID:
+		{
+			DEBUG_PRINTLN(F("Planned write command"));
+			Memory_Map map;
+			if (!readMemoryMap(jsonBuffer, map)) {
+				sendInvalidReply(command, "memoryMap");
+				break;
+			}
+
+			uint32_t address = jsonBuffer["address"];
+			const char* hash = jsonBuffer["hash"] | "";
+			Image_Parser::Format format = Image_Parser::FormatFromName(jsonBuffer["format"]);
+			if (format == Image_Parser::Format::Unknown) {
+				sendInvalidReply(command, "format");
+				break;
+			}
+			bool dry_run = jsonBuffer["dryRun"] | false;
+			handlePlannedWriteEvent(address, hash, format, map, dry_run);
+		}
+		break;
+		case HOST_UPDATE_JOB_CMD_ID:
+		{
+			DEBUG_PRINTLN(F("Update job command"));
+			Update_Job_Spec spec;
+			if (!readMemoryMap(jsonBuffer, spec.map)) {
+				sendInvalidReply(command, "memoryMap");
+				break;
+			}
+			spec.address = jsonBuffer["address"];
+			spec.format = Image_Parser::FormatFromName(jsonBuffer["format"]);
+			if (spec.format == Image_Parser::Format::Unknown) {
+				sendInvalidReply(command, "format");
+				break;
+			}
+
+			/* A misspelt option must not quietly turn into its default, e.g. verification off */
+			const char* erase = jsonBuffer["erase"] | "planned";
+			if (!strcmp(erase, "planned"))
+				spec.erase = Update_Job_Spec::Erase::Planned;
+			else if (!strcmp(erase, "full"))
+				spec.erase = Update_Job_Spec::Erase::Full;
+			else if (!strcmp(erase, "none"))
+				spec.erase = Update_Job_Spec::Erase::None;
+			else {
+				sendInvalidReply(command, "erase");
+				break;
+			}
+			const char* verify = jsonBuffer["verify"] | "none";
+			if (!strcmp(verify, "none"))
+				spec.verify = Update_Job_Spec::Verify::None;
+			else if (!strcmp(verify, "readback"))
+				spec.verify = Update_Job_Spec::Verify::Readback;
+			else if (!strcmp(verify, "interleaved"))
+				spec.verify = Update_Job_Spec::Verify::Interleaved;
+			else {
+				sendInvalidReply(command, "verify");
+				break;
+			}
+			const char* finish = jsonBuffer["finish"] | "stay";
+			if (!strcmp(finish, "stay"))
+				spec.finish = Update_Job_Spec::Finish::Stay;
+			else if (!strcmp(finish, "jump"))
+				spec.finish = Update_Job_Spec::Finish::Jump;
+			else {
+				sendInvalidReply(command, "finish");
+				break;
+			}
+			strncpy(spec.expected_digest, jsonBuffer["expectedDigest"] | "", IMAGE_DIGEST_HEX_LEN);
+
+			/* The image is either already cached or uploaded inline and cached first. The
+			   job, its open image and its reply come on top of the upload in the projection */
+			const char* binaryFile = jsonBuffer["binaryData"];
+			uint32_t size = binaryFile ? (uint32_t)jsonBuffer["size"] : 0;
+			if (binaryFile && !validUpload(binaryFile, size)) {
+				sendInvalidReply(command, "binaryData");
+				break;
+			}
+			if (!memory_accounting.Admit(command, uploadPeakBytes(size, true, 384) + sizeof(Update_Job),
+				max<uint32_t>(size, sizeof(Update_Job)))) {
+				sendRejectedReply(command);
+				break;
+			}
+			if (binaryFile) {
+				uint8_t* decoded = new uint8_t[size];
+				Tracked_Allocation tracked_decoded(Memory_Category::Base64, size);
+				decode_base64((unsigned char*)binaryFile, (unsigned char*)decoded);
+				bool stored = imageCache.Store(decoded, size, spec.hash);
+				delete[] decoded;
+
+				/* Otherwise the job would only fail at its plan, as if the image had never been sent */
+				if (!stored) {
+					DEBUG_PRINTLN(F("Failed to cache image"));
+					StaticJsonDocument<128> updateJobJsonBuffer;
+					updateJobJsonBuffer["commandId"] = HOST_UPDATE_JOB_CMD_ID;
+					updateJobJsonBuffer["status"] = false;
+					updateJobJsonBuffer["error"] = 0;
+					updateJobJsonBuffer["failedStage"] = "store";
+					sendJsonReply(updateJobJsonBuffer);
+					break;
+				}
+			}
+			else {
+				strncpy(spec.hash, jsonBuffer["hash"] | "", IMAGE_CACHE_HASH_LEN);
+			}
+			handleUpdateJobEvent(spec);
+		}
+		break;
+		case HOST_RESUME_WRITE_CMD_ID:
+		{
+			DEBUG_PRINTLN(F("Resume write command"));
+			Memory_Map map;
+			if (!readMemoryMap(jsonBuffer, map)) {
+				sendInvalidReply(command, "memoryMap");
+				break;
+			}
+			handleResumeWriteEvent(map);
+		}
+		break;
+		case HOST_POOL_STATS_CMD_ID:
+			DEBUG_PRINTLN(F("Pool stats command"));
+			handlePoolStatsEvent();
+			break;
+		case HOST_MULTI_FLASH_CMD_ID:
+		{
+			DEBUG_PRINTLN(F("Multi-target flash command"));
+			uint32_t address = jsonBuffer["address"];
+			uint32_t size = jsonBuffer["size"];
+			const char* binaryFile = jsonBuffer["binaryData"];
+			/* Every extra target is a host of its own, and the dynamic reply grows with them */
+			uint32_t extra_targets = min<uint32_t>(jsonBuffer["targets"].size(), BL_SCHEDULER_MAX_TARGETS - 1);
+			uint32_t reply_bytes = 2 * (256 + 128 * (extra_targets + 1));
+			if (!validUpload(binaryFile, size)) {
+				sendInvalidReply(command, "binaryData");
+				break;
+			}
+			if (!memory_accounting.Admit(command,
+				uploadPeakBytes(size, false, reply_bytes) + extra_targets * sizeof(Bootloader_Host),
+				max<uint32_t>(size, sizeof(Bootloader_Host)))) {
+				sendRejectedReply(command);
+				break;
+			}
+			uint8_t* decoded = new uint8_t[size];
+			Tracked_Allocation tracked_decoded(Memory_Category::Base64, size);
+			decode_base64((unsigned char*)binaryFile, (unsigned char*)decoded);
+			handleMultiFlashEvent(address, decoded, size, jsonBuffer["eraseAddress"] | 0U, jsonBuffer["eraseCount"] | 0U,
+				jsonBuffer["targets"]);
+			delete[] decoded;
+		}
+		break;
+		case HOST_CACHE_STORE_CMD_ID:
+		{
+			DEBUG_PRINTLN(F("Cache store command"));
+			uint32_t size = jsonBuffer["size"];
+			const char* binaryFile = jsonBuffer["binaryData"];
+			if (!validUpload(binaryFile, size)) {
+				sendInvalidReply(command, "binaryData");
+				break;
+			}
+			if (!memory_accounting.Admit(command, uploadPeakBytes(size, true, 192), size)) {
+				sendRejectedReply(command);
+				break;
+			}
+			uint8_t* decoded = new uint8_t[size];
+			Tracked_Allocation tracked_decoded(Memory_Category::Base64, size);
+			decode_base64((unsigned char*)binaryFile, (unsigned char*)decoded);
+			handleCacheStoreEvent(decoded, size);
+			delete[] decoded;
 		}
 		break;
 
 		case BL_JUMP_TO_APP_CMD_ID:
 		{
 			DEBUG_PRINTLN(F("Jump to app command"));
-			handleJumpToAppCommand();
+			handleJumpToAppCommand(jsonBuffer["expectedDigest"]);
+		}
+		break;
+		case BL_FEC_CMD_ID:
+		{
+			DEBUG_PRINTLN(F("FEC command"));
+			handleFecCommand(jsonBuffer["enable"] | true);
 		}
 		break;
 		case BL_MEM_READ_CMD_ID:
@@ -183,17 +1166,57 @@ void webSocketEvent(WStype_t type, uint8_t* payload, size_t length)
 			DEBUG_PRINTLN(F("Memory read command"));
 			uint32_t address = jsonBuffer["address"];
 			uint32_t length = jsonBuffer["length"];
-			handleMemoryReadEvent(address, length);
+			bool cached = jsonBuffer["cache"] | true;
+			handleMemoryReadEvent(address, length, cached);
+		}
+		break;
+		case HOST_MEMORY_STATS_CMD_ID:
+			DEBUG_PRINTLN(F("Memory stats command"));
+			handleMemoryStatsEvent();
+			break;
+		case HOST_WRITE_BARRIER_CMD_ID:
+		{
+			DEBUG_PRINTLN(F("Write barrier command"));
+			host->write_combiner.SetMaxGap(jsonBuffer["maxGap"] | host->write_combiner.GetMaxGap());
+			host->write_combiner.SetTimeout(jsonBuffer["timeoutMs"] | host->write_combiner.GetTimeout());
+			sendWriteBarrierReply(host->FlushWrites(), false);
+		}
+		break;
+		case HOST_PROGRESS_CMD_ID:
+		{
+			DEBUG_PRINTLN(F("Progress command"));
+			uint32_t interval = jsonBuffer["intervalMs"] | host->progress.GetInterval();
+			handleProgressEvent(jsonBuffer["subscribe"] | true, interval);
+		}
+		break;
+		case HOST_TRACE_CMD_ID:
+		{
+			DEBUG_PRINTLN(F("Trace command"));
+			handleTraceEvent(jsonBuffer["action"] | "status", jsonBuffer["timed"] | true);
+		}
+		break;
+		case HOST_BENCHMARK_CMD_ID:
+		{
+			DEBUG_PRINTLN(F("Benchmark command"));
+			uint32_t iterations = jsonBuffer["iterations"] | BENCH_DEFAULT_ITERATIONS;
+			uint8_t tolerance = jsonBuffer["tolerance"] | BENCH_DEFAULT_TOLERANCE;
+			bool save = jsonBuffer["save"] | false;
+			handleBenchmarkEvent(iterations ? iterations : 1, tolerance, save);
 		}
 		break;
 		default:
 			DEBUG_PRINTLN(F("Unknown text event"));
 			break;
 		}
+		memory_accounting.EndCommand();
 	}
 	break;
 	case WStype_BIN:
 		DEBUG_PRINTF("[WSc] get binary length: %u\n", length);
+		memory_accounting.BeginCommand();
+		handleBinaryMessage(payload, length);
+		memory_accounting.EndCommand();
+		break;
 	}
 }
 
@@ -227,6 +1250,7 @@ void setup()
 	//wifiManager.autoConnect();
 	DEBUG_PRINTLN(F("Initializing bootloader"));
 	initializeBootloader();
+	imageCache.Begin();
 
 	WiFi.begin(ssid, password);
 	while (WiFi.status() != WL_CONNECTED)
@@ -243,4 +1267,10 @@ void setup()
 void loop()
 {
 	webSocket.loop();
+
+	/* Queued writes are not held back longer than the combiner's timeout */
+	bool flushed = false;
+	bool status = host->write_combiner.Poll(*host, &flushed);
+	if (flushed)
+		sendWriteBarrierReply(status, true);
 }
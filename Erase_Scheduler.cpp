@@ -0,0 +1,149 @@
+#include <Arduino.h>
+#include "Erase_Scheduler.h"
+#include "Utilities.h"
+
+bool Erase_Scheduler::Add(uint32_t address, uint32_t page_count) {
+	if (page_count == 0)
+		return true;
+
+	if (map.page_size == 0 || address < map.flash_base) {
+		invalid = true;
+		return false;
+	}
+
+	uint32_t start = (address - map.flash_base) / map.page_size;
+	uint32_t end = start + page_count;
+	Range merged[ERASE_MAX_RANGES + 1];
+	uint8_t count = 0;
+	bool inserted = false;
+
+	for (uint8_t i = 0; i < range_count; i++) {
+		uint32_t range_end = ranges[i].first_page + ranges[i].count;
+
+		/* Absorb anything overlapping or touching the new range */
+		if (range_end >= start && ranges[i].first_page <= end) {
+			start = min(start, ranges[i].first_page);
+			end = max(end, range_end);
+			continue;
+		}
+
+		if (!inserted && ranges[i].first_page > end) {
+			merged[count++] = { start, end - start };
+			inserted = true;
+		}
+		merged[count++] = ranges[i];
+	}
+
+	if (!inserted)
+		merged[count++] = { start, end - start };
+
+	if (count > ERASE_MAX_RANGES) {
+		invalid = true;
+		return false;
+	}
+
+	memcpy(ranges, merged, count * sizeof(Range));
+	range_count = count;
+	return true;
+}
+
+bool Erase_Scheduler::AddPlan(const Update_Planner& planner) {
+	for (uint8_t i = 0; i < planner.GetEraseCount(); i++) {
+		if (!Add(planner.GetStep(i).address, planner.GetStep(i).count))
+			return false;
+	}
+	return true;
+}
+
+bool Erase_Scheduler::Build() {
+	page_total = 0;
+	mass_erase = false;
+
+	if (invalid || range_count == 0)
+		return false;
+
+	uint32_t flash_pages = map.flash_size / map.page_size;
+	for (uint8_t i = 0; i < range_count; i++) {
+		const Range& range = ranges[i];
+		uint32_t address = map.flash_base + range.first_page * map.page_size;
+
+		if (range.first_page + range.count > flash_pages) {
+			DEBUG_PRINTF("Erase at 0x%08X is outside flash", address);
+			return false;
+		}
+
+		for (uint8_t j = 0; j < map.protected_count; j++) {
+			const Memory_Map::Region& region = map.protected_regions[j];
+			if (address < region.address + region.length && region.address < address + range.count * map.page_size) {
+				DEBUG_PRINTF("Erase at 0x%08X overlaps a protected region", address);
+				return false;
+			}
+		}
+		page_total += range.count;
+	}
+
+	/* A mass erase would wipe the protected regions too */
+	mass_erase = map.mass_erase_percent && map.protected_count == 0 &&
+		page_total * 100 >= map.mass_erase_percent * flash_pages;
+	return true;
+}
+
+bool Erase_Scheduler::Execute(Bootloader_Host* host, ProgressSink sink, void* context) {
+	uint32_t start = millis();
+	bool status;
+
+	if (mass_erase && host->SendMassEraseCommand()) {
+		status = true;
+		if (sink)
+			sink(context, page_total, page_total);
+	}
+	else {
+		if (mass_erase)
+			DEBUG_PRINTLN(F("Mass erase rejected, erasing page ranges"));
+		status = ExecuteRanges(host, sink, context);
+	}
+
+	actual_ms = millis() - start;
+	DEBUG_PRINTF("Erase took %lu ms, estimated %lu ms", actual_ms, EstimateMillis());
+	return status;
+}
+
+bool Erase_Scheduler::ExecuteRanges(Bootloader_Host* host, ProgressSink sink, void* context) {
+	uint32_t erased = 0;
+
+	for (uint8_t i = 0; i < range_count; i++) {
+		if (!host->SendFlashEraseCommand(map.flash_base + ranges[i].first_page * map.page_size, ranges[i].count))
+			return false;
+
+		erased += ranges[i].count;
+		if (sink)
+			sink(context, erased, page_total);
+	}
+	return true;
+}
+
+uint32_t Erase_Scheduler::EstimateMillis() const {
+	return EstimateMillis(mass_erase);
+}
+
+uint32_t Erase_Scheduler::EstimateMillis(bool mass) const {
+	uint32_t commands = mass ? 1 : range_count;
+	uint32_t wire_bytes = commands * (sizeof(BL_FLASH_ERASE_CMD) + 2 * sizeof(BL_ACK));
+	uint32_t erase_ms = mass ? map.mass_erase_ms : page_total * map.page_erase_ms;
+
+	/* 8N1 framing: 10 bits per byte */
+	return wire_bytes * 10 * 1000 / map.baud_rate + erase_ms;
+}
+
+void Erase_Scheduler::Print() const {
+	if (mass_erase) {
+		DEBUG_PRINTF("MASS ERASE instead of %lu pages in %d ranges", page_total, range_count);
+	}
+	else {
+		for (uint8_t i = 0; i < range_count; i++) {
+			DEBUG_PRINTF("ERASE 0x%08X, %lu pages", map.flash_base + ranges[i].first_page * map.page_size, ranges[i].count);
+		}
+	}
+	DEBUG_PRINTF("Estimated erase time = %lu ms (pages %lu ms, mass %lu ms)",
+		EstimateMillis(), EstimateMillis(false), EstimateMillis(true));
+}
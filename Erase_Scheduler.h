@@ -0,0 +1,96 @@
+#pragma once
+#include <stdint.h>
+#include "Bootloader_Host.h"
+#include "Update_Planner.h"
+
+#define ERASE_MAX_RANGES (PLANNER_MAX_EXTENTS) // Maximum number of disjoint page ranges
+
+/**
+ * @brief Turns a set of page ranges into the fewest, fastest erases.
+ *
+ * Ranges are merged as they are added when they overlap or touch. Build then
+ * picks a single mass erase instead when the pages to erase reach the
+ * map's mass_erase_percent of the flash and no region is protected. That
+ * is only done when the client asks for it with a non-zero percentage, as
+ * the pages outside the ranges are erased too.
+ * Execute times the erases so the estimate can be checked against them.
+ */
+class Erase_Scheduler
+{
+public:
+	struct Range
+	{
+		uint32_t first_page; // Index from the flash base
+		uint32_t count;
+	};
+
+	typedef void (*ProgressSink)(void* context, uint32_t pages_done, uint32_t pages_total);
+
+	explicit Erase_Scheduler(const Memory_Map& map) : map(map) {}
+
+	/**
+	 * @brief Adds pages to erase, merging them with adjacent or overlapping ranges
+	 *
+	 * @param address		Address of the first page, rounded down to its page
+	 * @param page_count	Number of pages
+	 * @return true		If the range was recorded
+	 * @return false	If too many disjoint ranges were added
+	 */
+	bool Add(uint32_t address, uint32_t page_count);
+
+	/**
+	 * @brief Adds the erase steps of a plan
+	 */
+	bool AddPlan(const Update_Planner& planner);
+
+	/**
+	 * @brief Chooses between page erases and a mass erase
+	 *
+	 * @return true		If there is something valid to erase
+	 * @return false	If a range is outside flash or overlaps a protected region
+	 */
+	bool Build(void);
+
+	/**
+	 * @brief Runs the erases, falling back to page erases if the client has no mass erase
+	 *
+	 * @param host		Host bound to the target
+	 * @param sink		Optional progress callback, called after every erase
+	 * @param context	Context passed to the sink
+	 * @return true		If every erase succeeded
+	 * @return false	On the first failed erase
+	 */
+	bool Execute(Bootloader_Host* host, ProgressSink sink = nullptr, void* context = nullptr);
+
+	/**
+	 * @brief Estimates the time spent on the serial link and erasing
+	 *
+	 * @return uint32_t Estimated time in milliseconds
+	 */
+	uint32_t EstimateMillis(void) const;
+
+	/**
+	 * @brief Prints the erases and their estimated time
+	 */
+	void Print(void) const;
+
+	bool IsMassErase() const { return mass_erase; }
+	uint8_t GetRangeCount() const { return range_count; }
+	const Range& GetRange(uint8_t index) const { return ranges[index]; }
+	uint32_t GetPageCount() const { return page_total; }
+	uint32_t GetActualMillis() const { return actual_ms; }
+
+private:
+	Memory_Map map;
+
+	Range ranges[ERASE_MAX_RANGES]; // Sorted, disjoint, non-adjacent
+	uint8_t range_count = 0;
+	bool invalid = false; // A range was below flash or did not fit
+
+	uint32_t page_total = 0;
+	bool mass_erase = false;
+	uint32_t actual_ms = 0;
+
+	uint32_t EstimateMillis(bool mass) const;
+	bool ExecuteRanges(Bootloader_Host* host, ProgressSink sink, void* context);
+};
@@ -0,0 +1,56 @@
+#include <Arduino.h>
+#include "Frame_Parser.h"
+#include "Packet_View.h"
+#include "bl_utils.h"
+
+typedef BL_Layout::Header Header;
+
+void Frame_Parser::Reset(uint32_t max_size) {
+	this->max_size = min(max_size, capacity);
+	fill = 0;
+	frame_size = 0;
+	dropped = 0;
+}
+
+Frame_Parser::Result Frame_Parser::Feed(uint8_t byte) {
+	buffer[fill++] = byte;
+	return Evaluate();
+}
+
+bool Frame_Parser::ValidHeader(const uint8_t header[], uint32_t max_size) {
+	Packet_View<Header> view(header, Header::size);
+	uint8_t cmd_id = view.Get<Header::CmdId>();
+	uint32_t size = view.Get<Header::PayloadSize>();
+
+	return (BL_VALID_COMMAND(cmd_id) || cmd_id == BL_RESPONSE_CMD_ID) && size >= Header::size && size <= max_size;
+}
+
+Frame_Parser::Result Frame_Parser::Evaluate() {
+	for (;;) {
+		if (fill < Header::size)
+			return Result::NeedMore;
+
+		if (!ValidHeader(buffer, max_size)) {
+			Drop(1);
+			continue;
+		}
+
+		uint32_t size = Packet_View<Header>(buffer, fill).Get<Header::PayloadSize>();
+		if (fill < size)
+			return Result::NeedMore;
+
+		if (bl_calculate_command_crc(buffer, size) == Packet_View<Header>(buffer, fill).Get<Header::Crc>()) {
+			frame_size = size;
+			return Result::Frame;
+		}
+
+		/* A header that looked valid but was not, the real frame may start inside it */
+		Drop(1);
+	}
+}
+
+void Frame_Parser::Drop(uint32_t bytes) {
+	memmove(buffer, buffer + bytes, fill - bytes);
+	fill -= bytes;
+	dropped += bytes;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <stdint.h>
+#include "bl_cmd_types.h"
+
+/**
+ * @brief Incremental parser that pulls command frames out of a byte stream.
+ *
+ * A header is only trusted once its command ID is valid and its size is
+ * within the negotiated maximum, and a frame only once its CRC matches.
+ * Anything else is treated as garbage: the parser drops one byte and hunts
+ * for the next valid header among the bytes it already holds, instead of
+ * waiting for a payload that never comes.
+ */
+class Frame_Parser
+{
+public:
+	enum class Result
+	{
+		NeedMore, // Keep feeding
+		Frame	  // A complete, valid frame is at the start of the buffer
+	};
+
+	Frame_Parser(uint8_t* buffer, uint32_t capacity) : buffer(buffer), capacity(capacity) {}
+
+	/**
+	 * @brief Starts parsing a new frame
+	 *
+	 * @param max_size	Largest frame accepted, header included. Clamped to the buffer.
+	 */
+	void Reset(uint32_t max_size);
+
+	Result Feed(uint8_t byte);
+
+	uint32_t GetFrameSize() const { return frame_size; }
+	uint32_t GetDropped() const { return dropped; }
+
+	/**
+	 * @brief Checks a header before any of its payload is read
+	 *
+	 * @param header	BL_CommandHeader_t bytes
+	 * @param max_size	Largest frame accepted, header included
+	 * @return true		If the command ID is known and the size is plausible
+	 */
+	static bool ValidHeader(const uint8_t header[], uint32_t max_size);
+
+private:
+	uint8_t* buffer;
+	uint32_t capacity;
+	uint32_t max_size = 0;
+	uint32_t fill = 0;
+	uint32_t frame_size = 0;
+	uint32_t dropped = 0; // Garbage bytes skipped since Reset
+
+	Result Evaluate(void);
+	void Drop(uint32_t bytes);
+};
@@ -0,0 +1,59 @@
+#include <Arduino.h>
+#include "Host_Metrics.h"
+
+#define METRICS_OVERHEAD_ITERATIONS (1000U)
+
+void Host_Metrics::Record(Host_Phase phase, uint32_t duration_us) {
+	Phase_Stats& stats = phases[(uint8_t)phase];
+
+	/* Bucket by bit length: 0 us, 1 us, 2-3 us, 4-7 us, ... */
+	uint8_t bucket = duration_us ? 32 - __builtin_clz(duration_us) : 0;
+	if (bucket >= METRICS_BUCKET_COUNT)
+		bucket = METRICS_BUCKET_COUNT - 1;
+
+	stats.buckets[bucket]++;
+	stats.count++;
+	stats.total_us += duration_us;
+	if (duration_us > stats.max_us)
+		stats.max_us = duration_us;
+}
+
+void Host_Metrics::CountNack(uint8_t field) {
+	for (uint8_t bit = 0; bit < METRICS_NACK_BITS; bit++) {
+		if (field & (1 << bit))
+			nacks[bit]++;
+	}
+}
+
+void Host_Metrics::Reset() {
+	*this = Host_Metrics();
+}
+
+uint32_t Host_Metrics::MeasureOverhead() {
+	static Host_Metrics scratch;
+
+	uint32_t start = micros();
+	for (uint32_t i = 0; i < METRICS_OVERHEAD_ITERATIONS; i++) {
+		Phase_Timer timer(scratch, Host_Phase::Log);
+	}
+	uint32_t elapsed = micros() - start;
+
+	scratch.Reset();
+	return elapsed * 1000 / METRICS_OVERHEAD_ITERATIONS;
+}
+
+const char* Host_Metrics::PhaseName(Host_Phase phase) {
+	static const char* names[] = { "sync", "build", "crc", "transmit", "waitResponse", "receive", "log", "indicator", "digest" };
+	return names[(uint8_t)phase];
+}
+
+Phase_Timer::Phase_Timer(Host_Metrics& metrics, Host_Phase phase) : metrics(metrics), phase(phase), start(micros()) {
+}
+
+void Phase_Timer::Stop() {
+	if (!running)
+		return;
+
+	metrics.Record(phase, micros() - start);
+	running = false;
+}
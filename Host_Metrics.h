@@ -0,0 +1,118 @@
+#pragma once
+#include <stdint.h>
+
+#define METRICS_BUCKET_COUNT (20U) // Bucket i holds durations below 2^i us, the last one everything above
+#define METRICS_NACK_BITS (7U)	   // Number of flags in BL_NACK_t
+
+enum class Host_Phase : uint8_t
+{
+	Sync,		  // SyncClient handshake
+	Build,		  // Building a command or data packet, including its CRC
+	Crc,		  // Validating the CRC of a received packet or response
+	Transmit,	  // Writing a command to the transport
+	WaitResponse, // Waiting for the first byte of an ack, packet or response
+	Receive,	  // Reading the bytes of an ack, packet or response
+	Log,		  // Debug printing
+	Indicator,	  // LED blinks
+	Digest,		  // Updating the SHA-256 of written data
+	Count
+};
+
+/**
+ * @brief Latency histograms per protocol phase, plus retry and NACK counters
+ */
+class Host_Metrics
+{
+public:
+	struct Phase_Stats
+	{
+		uint32_t count;
+		uint32_t total_us;
+		uint32_t max_us;
+		uint32_t buckets[METRICS_BUCKET_COUNT];
+	};
+
+	void Record(Host_Phase phase, uint32_t duration_us);
+	void CountRetry() { retries++; }
+
+	/**
+	 * @brief Counts a BATCH command and the round trips it replaced
+	 *
+	 * @param commands	Number of sub-commands it carried
+	 */
+	void CountBatch(uint8_t commands) { batches++; batched_commands += commands; }
+
+	/**
+	 * @brief Counts garbage skipped while hunting for the next valid frame
+	 *
+	 * @param bytes			Bytes dropped
+	 * @param recovery_us	Time from the first dropped byte to the valid frame
+	 */
+	void CountResync(uint32_t bytes, uint32_t recovery_us) { resyncs++; resync_bytes += bytes; resync_us += recovery_us; }
+
+	/**
+	 * @brief Counts a received data packet in which FEC corrected bits
+	 *
+	 * @param bits	Bits corrected
+	 */
+	void CountFecRepair(uint32_t bits) { fec_repairs++; fec_corrected_bits += bits; }
+
+	/**
+	 * @brief Counts every flag set in a NACK field
+	 *
+	 * @param field	BL_NACK_t flags received from the client
+	 */
+	void CountNack(uint8_t field);
+
+	void Reset(void);
+
+	const Phase_Stats& GetPhase(Host_Phase phase) const { return phases[(uint8_t)phase]; }
+	uint32_t GetRetries() const { return retries; }
+	uint32_t GetNackCount(uint8_t bit) const { return nacks[bit]; }
+	uint32_t GetBatches() const { return batches; }
+	uint32_t GetBatchedCommands() const { return batched_commands; }
+	uint32_t GetResyncs() const { return resyncs; }
+	uint32_t GetResyncBytes() const { return resync_bytes; }
+	uint32_t GetResyncMicros() const { return resync_us; }
+	uint32_t GetFecRepairs() const { return fec_repairs; }
+	uint32_t GetFecCorrectedBits() const { return fec_corrected_bits; }
+
+	/**
+	 * @brief Measures the cost of timing one phase
+	 *
+	 * @return uint32_t Nanoseconds per timed phase
+	 */
+	static uint32_t MeasureOverhead(void);
+
+	static const char* PhaseName(Host_Phase phase);
+
+private:
+	Phase_Stats phases[(uint8_t)Host_Phase::Count] = {};
+	uint32_t retries = 0;
+	uint32_t nacks[METRICS_NACK_BITS] = { 0 };
+	uint32_t batches = 0;
+	uint32_t batched_commands = 0;
+	uint32_t resyncs = 0;
+	uint32_t resync_bytes = 0;
+	uint32_t resync_us = 0;
+	uint32_t fec_repairs = 0;
+	uint32_t fec_corrected_bits = 0;
+};
+
+/**
+ * @brief Times a phase from construction until Stop() or destruction
+ */
+class Phase_Timer
+{
+public:
+	Phase_Timer(Host_Metrics& metrics, Host_Phase phase);
+	~Phase_Timer() { Stop(); }
+
+	void Stop(void);
+
+private:
+	Host_Metrics& metrics;
+	Host_Phase phase;
+	uint32_t start;
+	bool running = true;
+};
@@ -0,0 +1,149 @@
+#include <Arduino.h>
+#include "Image_Digest.h"
+#include "Image_Cache.h"
+#include "Utilities.h"
+
+static_assert(IMAGE_CACHE_HASH_LEN == IMAGE_DIGEST_HEX_LEN, "cache keys are hex SHA-256 digests");
+
+bool Image_Cache::Begin(uint32_t budget) {
+	budget_bytes = budget;
+	mounted = LittleFS.begin();
+	if (!mounted) {
+		DEBUG_PRINTLN(F("Error mounting image cache filesystem"));
+		return false;
+	}
+	LittleFS.mkdir(IMAGE_CACHE_DIR);
+
+	entry_count = 0;
+	used_bytes = 0;
+	use_counter = 0;
+
+	File index = LittleFS.open(IMAGE_CACHE_INDEX, "r");
+	if (index) {
+		Entry entry;
+		while (entry_count < IMAGE_CACHE_MAX_ENTRIES &&
+			index.read((uint8_t*)&entry, sizeof(Entry)) == sizeof(Entry))
+		{
+			entry.hash[IMAGE_CACHE_HASH_LEN] = '\0';
+			/* Drop entries whose file went missing, e.g. after an interrupted store */
+			if (!LittleFS.exists(PathOf(entry.hash)))
+				continue;
+			entries[entry_count++] = entry;
+			used_bytes += entry.size;
+			use_counter = max(use_counter, entry.last_used);
+		}
+		index.close();
+	}
+
+	while (used_bytes > budget_bytes && entry_count)
+		EvictOldest();
+
+	DEBUG_PRINTF("Image cache: %d images, %lu bytes", entry_count, used_bytes);
+	return true;
+}
+
+bool Image_Cache::Store(const uint8_t data[], uint32_t size, char hash_out[]) {
+	ComputeHash(data, size, hash_out);
+
+	if (!mounted || size > budget_bytes)
+		return false;
+
+	int index = Find(hash_out);
+	if (index >= 0) {
+		entries[index].last_used = ++use_counter;
+		return SaveIndex();
+	}
+
+	while (entry_count && (entry_count == IMAGE_CACHE_MAX_ENTRIES || used_bytes + size > budget_bytes))
+		EvictOldest();
+
+	File file = LittleFS.open(PathOf(hash_out), "w");
+	if (!file)
+		return false;
+
+	size_t written = file.write(data, size);
+	file.close();
+	if (written != size) {
+		LittleFS.remove(PathOf(hash_out));
+		return false;
+	}
+
+	Entry& entry = entries[entry_count++];
+	memcpy(entry.hash, hash_out, sizeof(entry.hash));
+	entry.size = size;
+	entry.last_used = ++use_counter;
+	used_bytes += size;
+
+	return SaveIndex();
+}
+
+File Image_Cache::Open(const char* hash, uint32_t* size_out) {
+	int index = Find(hash);
+	if (!mounted || index < 0)
+		return File();
+
+	entries[index].last_used = ++use_counter;
+	SaveIndex();
+
+	if (size_out)
+		*size_out = entries[index].size;
+	return LittleFS.open(PathOf(hash), "r");
+}
+
+bool Image_Cache::Remove(const char* hash) {
+	int index = Find(hash);
+	if (index < 0)
+		return false;
+
+	RemoveAt(index);
+	return SaveIndex();
+}
+
+void Image_Cache::ComputeHash(const uint8_t data[], uint32_t size, char hash_out[]) {
+	Image_Digest::Compute(data, size, hash_out);
+}
+
+int Image_Cache::Find(const char* hash) const {
+	for (uint8_t i = 0; i < entry_count; i++) {
+		if (strncmp(entries[i].hash, hash, IMAGE_CACHE_HASH_LEN) == 0)
+			return i;
+	}
+	return -1;
+}
+
+void Image_Cache::EvictOldest() {
+	uint8_t oldest = 0;
+	for (uint8_t i = 1; i < entry_count; i++) {
+		if (entries[i].last_used < entries[oldest].last_used)
+			oldest = i;
+	}
+	DEBUG_PRINTF("Evicting cached image %s", entries[oldest].hash);
+	RemoveAt(oldest);
+}
+
+void Image_Cache::RemoveAt(uint8_t index) {
+	LittleFS.remove(PathOf(entries[index].hash));
+	used_bytes -= entries[index].size;
+	entries[index] = entries[--entry_count];
+}
+
+bool Image_Cache::SaveIndex() {
+	File index = LittleFS.open(IMAGE_CACHE_INDEX, "w");
+	if (!index)
+		return false;
+
+	size_t bytes = entry_count * sizeof(Entry);
+	bool status = (index.write((uint8_t*)entries, bytes) == bytes);
+	index.close();
+	return status;
+}
+
+String Image_Cache::PathOf(const char* hash) {
+	char name[IMAGE_CACHE_FILE_NAME_LEN + 1];
+	strncpy(name, hash, IMAGE_CACHE_FILE_NAME_LEN);
+	name[IMAGE_CACHE_FILE_NAME_LEN] = '\0';
+
+	String path = IMAGE_CACHE_DIR "/";
+	path += name;
+	return path;
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <stdint.h>
+#include <LittleFS.h>
+
+#define IMAGE_CACHE_DIR "/img"				   // Directory holding cached images
+#define IMAGE_CACHE_INDEX IMAGE_CACHE_DIR "/index" // LRU index file
+#define IMAGE_CACHE_MAX_ENTRIES (16U)		   // Maximum number of cached images
+#define IMAGE_CACHE_HASH_LEN (64U)			   // SHA-256 as hex, without terminator
+#define IMAGE_CACHE_FILE_NAME_LEN (24U)		   // Hash prefix used as file name, LittleFS names are limited to 31 chars
+#define IMAGE_CACHE_BUDGET (512UL * 1024UL)	   // Default space budget in bytes
+#define IMAGE_CACHE_FILE_HEAP (512U)		   // Heap an open image file holds, its LittleFS cache and handle
+
+/**
+ * @brief Content-addressed store of firmware images on the host's flash.
+ *
+ * Images are saved under their SHA-256 so the same build can be flashed onto
+ * many targets without re-uploading it. When the space budget is exceeded the
+ * least recently used images are evicted.
+ */
+class Image_Cache
+{
+public:
+	struct Entry
+	{
+		char hash[IMAGE_CACHE_HASH_LEN + 1];
+		uint32_t size;
+		uint32_t last_used; // Value of use_counter when last stored or opened
+	};
+
+	/**
+	 * @brief Mounts the filesystem and loads the index
+	 *
+	 * @param budget	Maximum number of bytes of images to keep
+	 * @return true		If the cache is usable
+	 * @return false	If the filesystem could not be mounted
+	 */
+	bool Begin(uint32_t budget = IMAGE_CACHE_BUDGET);
+
+	/**
+	 * @brief Stores an image, evicting older images if needed
+	 *
+	 * @param data		The image
+	 * @param size		The size of the image in bytes
+	 * @param hash_out	Receives the hex SHA-256 of the image (IMAGE_CACHE_HASH_LEN + 1 bytes)
+	 * @return true		If the image is in the cache
+	 * @return false	If the image is larger than the budget or could not be written
+	 */
+	bool Store(const uint8_t data[], uint32_t size, char hash_out[]);
+
+	/**
+	 * @brief Opens a cached image for reading and marks it as recently used
+	 *
+	 * @param hash		Hex SHA-256 of the image
+	 * @param size_out	Receives the size of the image in bytes
+	 * @return File		Open file, evaluates to false if the image is not cached
+	 */
+	File Open(const char* hash, uint32_t* size_out);
+
+	/**
+	 * @brief Removes an image from the cache
+	 *
+	 * @param hash	Hex SHA-256 of the image
+	 * @return true		If the image was removed
+	 * @return false	If it was not cached
+	 */
+	bool Remove(const char* hash);
+
+	uint32_t GetUsedBytes() const { return used_bytes; }
+	uint8_t GetEntryCount() const { return entry_count; }
+
+	/**
+	 * @brief Computes the hex SHA-256 of a buffer
+	 *
+	 * @param data		The data
+	 * @param size		The size of the data in bytes
+	 * @param hash_out	Receives the hex digest (IMAGE_CACHE_HASH_LEN + 1 bytes)
+	 */
+	static void ComputeHash(const uint8_t data[], uint32_t size, char hash_out[]);
+
+private:
+	Entry entries[IMAGE_CACHE_MAX_ENTRIES];
+	uint8_t entry_count = 0;
+	uint32_t used_bytes = 0;
+	uint32_t budget_bytes = IMAGE_CACHE_BUDGET;
+	uint32_t use_counter = 0;
+	bool mounted = false;
+
+	int Find(const char* hash) const;
+	void EvictOldest(void);
+	void RemoveAt(uint8_t index);
+	bool SaveIndex(void);
+	static String PathOf(const char* hash);
+};
@@ -0,0 +1,38 @@
+#include <Arduino.h>
+#include "Image_Digest.h"
+
+void Image_Digest::Begin() {
+	br_sha256_init(&ctx);
+	bytes = 0;
+}
+
+void Image_Digest::Update(const uint8_t data[], uint32_t size) {
+	br_sha256_update(&ctx, data, size);
+	bytes += size;
+}
+
+void Image_Digest::Finish(char hex_out[]) const {
+	static const char hex[] = "0123456789abcdef";
+	uint8_t digest[br_sha256_SIZE];
+
+	/* Output does not consume the context */
+	br_sha256_out(&ctx, digest);
+
+	for (uint8_t i = 0; i < br_sha256_SIZE; i++) {
+		hex_out[2 * i] = hex[digest[i] >> 4];
+		hex_out[2 * i + 1] = hex[digest[i] & 0x0F];
+	}
+	hex_out[IMAGE_DIGEST_HEX_LEN] = '\0';
+}
+
+bool Image_Digest::Matches(const char* expected_hex) const {
+	char digest[IMAGE_DIGEST_HEX_LEN + 1];
+	Finish(digest);
+	return strlen(expected_hex) == IMAGE_DIGEST_HEX_LEN && strcasecmp(digest, expected_hex) == 0;
+}
+
+void Image_Digest::Compute(const uint8_t data[], uint32_t size, char hex_out[]) {
+	Image_Digest digest;
+	digest.Update(data, size);
+	digest.Finish(hex_out);
+}
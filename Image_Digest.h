@@ -0,0 +1,57 @@
+#pragma once
+#include <stdint.h>
+#include <bearssl/bearssl_hash.h>
+
+#define IMAGE_DIGEST_HEX_LEN (2U * br_sha256_SIZE) // SHA-256 as hex, without terminator
+
+/**
+ * @brief Running SHA-256 of data handled piece by piece.
+ *
+ * Lets the host digest an image as its blocks go out, without holding the
+ * image or making a second pass over it.
+ */
+class Image_Digest
+{
+public:
+	Image_Digest() { Begin(); }
+
+	/**
+	 * @brief Starts a new digest
+	 */
+	void Begin(void);
+
+	/**
+	 * @brief Adds the next piece of data
+	 *
+	 * @param data	The data
+	 * @param size	The size of the data in bytes
+	 */
+	void Update(const uint8_t data[], uint32_t size);
+
+	/**
+	 * @brief Gets the digest of everything added so far; more data can still be added
+	 *
+	 * @param hex_out	Receives the hex digest (IMAGE_DIGEST_HEX_LEN + 1 bytes)
+	 */
+	void Finish(char hex_out[]) const;
+
+	/**
+	 * @brief Checks the digest so far against an expected hex digest
+	 *
+	 * @param expected_hex	Expected hex digest, either case
+	 * @return true		If they are equal
+	 * @return false	Otherwise
+	 */
+	bool Matches(const char* expected_hex) const;
+
+	uint32_t GetBytes() const { return bytes; }
+
+	/**
+	 * @brief Computes the hex SHA-256 of a buffer in one go
+	 */
+	static void Compute(const uint8_t data[], uint32_t size, char hex_out[]);
+
+private:
+	br_sha256_context ctx;
+	uint32_t bytes = 0;
+};
@@ -0,0 +1,307 @@
+#include <Arduino.h>
+#include "Image_Parser.h"
+#include "Utilities.h"
+
+#define ELF_HEADER_SIZE (52U)
+#define ELF_PHDR_SIZE (32U)
+#define ELF_PT_LOAD (1U)
+
+static inline uint16_t read_le16(const uint8_t* p) {
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t read_le32(const uint8_t* p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline int8_t hex_value(uint8_t c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+void Image_Parser::Reset(Format format) {
+	this->format = format;
+	state = State::Idle;
+	record_len = 0;
+	high_nibble = true;
+	eof = false;
+	base_address = 0;
+	line = 1;
+	bytes_in = 0;
+	bytes_out = 0;
+	parse_micros = 0;
+	sink_micros = 0;
+}
+
+bool Image_Parser::Feed(const uint8_t data[], uint32_t length) {
+	uint32_t start = micros();
+	uint32_t sink_start = sink_micros;
+
+	for (uint32_t i = 0; i < length && state != State::Error; i++) {
+		uint8_t c = data[i];
+
+		switch (state) {
+		case State::Idle:
+			if (c == '\n') {
+				line++;
+			}
+			else if (c == ':' && format == Format::IntelHex) {
+				state = State::Record;
+				record_len = 0;
+				high_nibble = true;
+			}
+			else if (c == 'S' && format == Format::SRecord) {
+				state = State::SRecordType;
+			}
+			else if (c != '\r' && c != ' ' && c != '\t') {
+				state = State::Error;
+			}
+			break;
+		case State::SRecordType:
+			if (c < '0' || c > '9') {
+				state = State::Error;
+				break;
+			}
+			srec_type = c - '0';
+			state = State::Record;
+			record_len = 0;
+			high_nibble = true;
+			break;
+		case State::Record:
+			if (c == '\r' || c == '\n') {
+				state = EndRecord() ? State::Idle : State::Error;
+				if (c == '\n')
+					line++;
+				break;
+			}
+			{
+				int8_t value = hex_value(c);
+				if (value < 0 || (high_nibble && record_len == IMAGE_PARSER_RECORD_SIZE)) {
+					state = State::Error;
+					break;
+				}
+				if (high_nibble) {
+					nibble = value;
+				}
+				else {
+					record[record_len++] = (nibble << 4) | value;
+				}
+				high_nibble = !high_nibble;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	bytes_in += length;
+	parse_micros += (micros() - start) - (sink_micros - sink_start);
+
+	if (state == State::Error) {
+		DEBUG_PRINTF("Image parse error on line %lu", line);
+		return false;
+	}
+	return true;
+}
+
+bool Image_Parser::Finish() {
+	/* Accept a last record without a trailing newline */
+	if (state == State::Record)
+		state = EndRecord() ? State::Idle : State::Error;
+
+	DEBUG_PRINTF("Parsed %lu bytes into %lu data bytes at %lu B/s", bytes_in, bytes_out, GetThroughput());
+	return state == State::Idle && eof;
+}
+
+bool Image_Parser::EndRecord() {
+	if (!high_nibble)
+		return false;
+
+	if (format == Format::IntelHex)
+		return HandleHexRecord();
+	return HandleSRecord();
+}
+
+bool Image_Parser::HandleHexRecord() {
+	/* :LL AAAA TT DD.. CC */
+	if (record_len < 5 || record[0] + 5U != record_len)
+		return false;
+
+	uint8_t sum = 0;
+	for (uint16_t i = 0; i < record_len; i++)
+		sum += record[i];
+	if (sum != 0)
+		return false;
+
+	uint16_t offset = (record[1] << 8) | record[2];
+	switch (record[3]) {
+	case 0x00: // Data
+		return Emit(base_address + offset, &record[4], record[0]);
+	case 0x01: // End of file
+		eof = true;
+		return true;
+	case 0x02: // Extended segment address
+		if (record[0] != 2)
+			return false;
+		base_address = (uint32_t)((record[4] << 8) | record[5]) << 4;
+		return true;
+	case 0x04: // Extended linear address
+		if (record[0] != 2)
+			return false;
+		base_address = (uint32_t)((record[4] << 8) | record[5]) << 16;
+		return true;
+	case 0x03: // Start segment address
+	case 0x05: // Start linear address
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool Image_Parser::HandleSRecord() {
+	/* Stt CC AA.. DD.. KK */
+	if (record_len < 2 || record[0] + 1U != record_len)
+		return false;
+
+	uint8_t sum = 0;
+	for (uint16_t i = 0; i < record_len - 1; i++)
+		sum += record[i];
+	if ((uint8_t)~sum != record[record_len - 1])
+		return false;
+
+	uint8_t address_len;
+	switch (srec_type) {
+	case 1: address_len = 2; break;
+	case 2: address_len = 3; break;
+	case 3: address_len = 4; break;
+	case 7:
+	case 8:
+	case 9: // Termination
+		eof = true;
+		return true;
+	case 0: // Header
+	case 5:
+	case 6: // Record count
+		return true;
+	default:
+		return false;
+	}
+
+	if (record[0] < address_len + 1)
+		return false;
+
+	uint32_t address = 0;
+	for (uint8_t i = 0; i < address_len; i++)
+		address = (address << 8) | record[1 + i];
+
+	return Emit(address, &record[1 + address_len], record[0] - address_len - 1);
+}
+
+bool Image_Parser::Emit(uint32_t address, const uint8_t data[], uint32_t length) {
+	if (length == 0)
+		return true;
+
+	uint32_t start = micros();
+	bool status = sink(context, address, data, length);
+	sink_micros += micros() - start;
+
+	bytes_out += length;
+	return status;
+}
+
+bool Image_Parser::Parse(File& file, Format format) {
+	if (format == Format::Elf)
+		return ParseElf(file);
+
+	if (format == Format::Binary || format == Format::Unknown)
+		return false;
+
+	Reset(format);
+
+	uint8_t chunk[IMAGE_PARSER_CHUNK_SIZE];
+	size_t length;
+	while ((length = file.read(chunk, sizeof(chunk))) > 0) {
+		if (!Feed(chunk, length))
+			return false;
+		yield();
+	}
+	return Finish();
+}
+
+bool Image_Parser::ParseElf(File& file) {
+	Reset(Format::Elf);
+	uint32_t start = micros();
+
+	/* The record buffer is unused for ELF, read headers and data through it */
+	if (!file.seek(0) || file.read(record, ELF_HEADER_SIZE) != ELF_HEADER_SIZE)
+		return false;
+
+	/* 0x7F 'E' 'L' 'F', 32-bit, little endian */
+	if (record[0] != 0x7F || record[1] != 'E' || record[2] != 'L' || record[3] != 'F' ||
+		record[4] != 1 || record[5] != 1)
+	{
+		DEBUG_PRINTLN(F("Not a 32-bit little endian ELF"));
+		return false;
+	}
+
+	uint32_t phoff = read_le32(&record[28]);
+	uint16_t phentsize = read_le16(&record[42]);
+	uint16_t phnum = read_le16(&record[44]);
+	if (phentsize < ELF_PHDR_SIZE)
+		return false;
+
+	bytes_in = ELF_HEADER_SIZE;
+	for (uint16_t i = 0; i < phnum; i++) {
+		if (!file.seek(phoff + (uint32_t)i * phentsize) || file.read(record, ELF_PHDR_SIZE) != ELF_PHDR_SIZE)
+			return false;
+		bytes_in += ELF_PHDR_SIZE;
+
+		uint32_t type = read_le32(&record[0]);
+		uint32_t offset = read_le32(&record[4]);
+		uint32_t paddr = read_le32(&record[12]);
+		uint32_t filesz = read_le32(&record[16]);
+		if (type != ELF_PT_LOAD || filesz == 0)
+			continue;
+
+		DEBUG_PRINTF("ELF segment at 0x%08X, %lu bytes", paddr, filesz);
+		if (!file.seek(offset))
+			return false;
+
+		/* Segment data is streamed in record-sized chunks */
+		for (uint32_t done = 0; done < filesz;) {
+			uint32_t length = min(IMAGE_PARSER_RECORD_SIZE, filesz - done);
+			if (file.read(record, length) != length)
+				return false;
+			bytes_in += length;
+			if (!Emit(paddr + done, record, length))
+				return false;
+			done += length;
+			yield();
+		}
+	}
+
+	eof = true;
+	parse_micros = (micros() - start) - sink_micros;
+	DEBUG_PRINTF("Parsed ELF into %lu data bytes at %lu B/s", bytes_out, GetThroughput());
+	return true;
+}
+
+Image_Parser::Format Image_Parser::FormatFromName(const char* name) {
+	if (name == nullptr || strcmp(name, "bin") == 0)
+		return Format::Binary;
+	if (strcmp(name, "hex") == 0)
+		return Format::IntelHex;
+	if (strcmp(name, "srec") == 0)
+		return Format::SRecord;
+	if (strcmp(name, "elf") == 0)
+		return Format::Elf;
+	return Format::Unknown;
+}
+
+uint32_t Image_Parser::GetThroughput() const {
+	if (parse_micros == 0)
+		return 0;
+	return (uint32_t)((uint64_t)bytes_in * 1000000ULL / parse_micros);
+}
@@ -0,0 +1,130 @@
+#pragma once
+#include <stdint.h>
+#include <LittleFS.h>
+
+#define IMAGE_PARSER_RECORD_SIZE (260U) // Largest decoded HEX/S-record: 255 data bytes + header
+#define IMAGE_PARSER_CHUNK_SIZE (128U)	 // Bytes read from a file per iteration
+
+/**
+ * @brief Streaming parser for Intel HEX, Motorola S-record and ELF32 images.
+ *
+ * Input is consumed incrementally and each data record or loadable segment
+ * is handed to a sink together with its load address, so memory use does
+ * not depend on the size of the image.
+ */
+class Image_Parser
+{
+public:
+	enum class Format
+	{
+		Binary,
+		IntelHex,
+		SRecord,
+		Elf,
+		Unknown // A name FormatFromName does not know, never parsed or written
+	};
+
+	/**
+	 * @brief Receives address-tagged data as it is parsed
+	 * @return false to abort parsing
+	 */
+	typedef bool (*SegmentSink)(void* context, uint32_t address, const uint8_t data[], uint32_t length);
+
+	Image_Parser(SegmentSink sink, void* context) : sink(sink), context(context) {}
+
+	/**
+	 * @brief Prepares the parser for a new text image
+	 *
+	 * @param format	IntelHex or SRecord
+	 */
+	void Reset(Format format);
+
+	/**
+	 * @brief Feeds the next chunk of a text image
+	 *
+	 * @param data		Chunk of the image, may split records anywhere
+	 * @param length	The size of the chunk in bytes
+	 * @return true		If the chunk was parsed
+	 * @return false	On a malformed record, a checksum error or if the sink failed
+	 */
+	bool Feed(const uint8_t data[], uint32_t length);
+
+	/**
+	 * @brief Completes a text image
+	 *
+	 * @return true		If the image ended with its end-of-file record and no error
+	 * @return false	Otherwise
+	 */
+	bool Finish(void);
+
+	/**
+	 * @brief Parses a whole image from a file
+	 *
+	 * @param file		Open file holding the image
+	 * @param format	Format of the image, Binary is not handled here
+	 * @return true		If the image was parsed and fully accepted by the sink
+	 * @return false	Otherwise
+	 */
+	bool Parse(File& file, Format format);
+
+	/**
+	 * @brief Parses an ELF32 little-endian image, emitting every PT_LOAD segment at its physical address
+	 *
+	 * @param file		Open file holding the image
+	 * @return true		If all segments were parsed and accepted by the sink
+	 * @return false	Otherwise
+	 */
+	bool ParseElf(File& file);
+
+	/**
+	 * @brief Maps a request's format name to a format
+	 *
+	 * @param name	"bin", "hex", "srec" or "elf", nullptr for a raw binary
+	 * @return Format::Unknown	For any other name, so its text is never written as a raw binary
+	 */
+	static Format FormatFromName(const char* name);
+
+	uint32_t GetBytesIn() const { return bytes_in; }
+	uint32_t GetBytesOut() const { return bytes_out; }
+	uint32_t GetLine() const { return line; }
+
+	/**
+	 * @brief Gets the parse throughput, excluding time spent in the sink
+	 *
+	 * @return uint32_t Input bytes per second
+	 */
+	uint32_t GetThroughput() const;
+
+private:
+	enum class State
+	{
+		Idle,
+		SRecordType,
+		Record,
+		Error
+	};
+
+	SegmentSink sink;
+	void* context;
+
+	Format format = Format::IntelHex;
+	State state = State::Idle;
+	uint8_t record[IMAGE_PARSER_RECORD_SIZE];
+	uint16_t record_len = 0;
+	uint8_t srec_type = 0;
+	uint8_t nibble = 0;
+	bool high_nibble = true;
+	bool eof = false;
+	uint32_t base_address = 0;
+
+	uint32_t line = 1;
+	uint32_t bytes_in = 0;
+	uint32_t bytes_out = 0;
+	uint32_t parse_micros = 0;
+	uint32_t sink_micros = 0;
+
+	bool EndRecord(void);
+	bool HandleHexRecord(void);
+	bool HandleSRecord(void);
+	bool Emit(uint32_t address, const uint8_t data[], uint32_t length);
+};
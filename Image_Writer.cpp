@@ -0,0 +1,101 @@
+#include <Arduino.h>
+#include "Image_Writer.h"
+#include "Utilities.h"
+
+bool Image_Writer::Write(uint32_t address, const uint8_t data[], uint32_t length) {
+	if (length == 0)
+		return true;
+
+	if (in_segment && address != next_address && !Finish())
+		return false;
+
+	if (!in_segment) {
+		in_segment = true;
+		started = false;
+		pending = false;
+		fill = 0;
+		sent = 0;
+		segment_address = address;
+		next_address = address;
+	}
+
+	while (length) {
+		uint32_t count = min(BL_DATA_BLOCK_SIZE - fill, length);
+		memcpy(&blocks[current][fill], data, count);
+		fill += count;
+		data += count;
+		length -= count;
+		next_address += count;
+
+		if (fill < BL_DATA_BLOCK_SIZE)
+			break;
+
+		/* A full block follows the held back one, which can now be sent */
+		if (pending && !SendBlock(1 - current, BL_DATA_BLOCK_SIZE, BL_DATA_BLOCK_SIZE, false))
+			return false;
+
+		pending = true;
+		current = 1 - current;
+		fill = 0;
+	}
+
+	return true;
+}
+
+bool Image_Writer::Finish() {
+	if (!in_segment)
+		return true;
+
+	in_segment = false;
+
+	if (pending && !SendBlock(1 - current, BL_DATA_BLOCK_SIZE, fill, fill == 0))
+		return false;
+
+	if (fill && !SendBlock(current, fill, 0, true))
+		return false;
+
+	segment_count++;
+	delay(10);
+	return true;
+}
+
+bool Image_Writer::Sink(void* context, uint32_t address, const uint8_t data[], uint32_t length) {
+	return static_cast<Image_Writer*>(context)->Write(address, data, length);
+}
+
+bool Image_Writer::SendBlock(uint8_t index, uint32_t size, uint32_t next_block_len, bool end_flag) {
+	uint32_t address = segment_address + sent;
+
+	/* Each block is a write of its own, so it can be read back before the next one */
+	if (verify) {
+		next_block_len = 0;
+		end_flag = true;
+	}
+
+	if (!started) {
+		DEBUG_PRINTF("Writing segment at 0x%08X", address);
+		if (!host->BeginMemWrite(address))
+			return false;
+		started = true;
+	}
+
+	if (!host->SendDataBlock(blocks[index], size, next_block_len, end_flag))
+		return false;
+
+	sent += size;
+	bytes_written += size;
+
+	if (verify) {
+		started = false;
+
+		/* Left past the block unless a byte differs */
+		uint32_t differs_at = address + size;
+		if (!host->SendMemVerifyCommand(address, size, blocks[index], &differs_at)) {
+			mismatch = differs_at < address + size;
+			mismatch_address = differs_at;
+			return false;
+		}
+		bytes_verified += size;
+	}
+	return true;
+}
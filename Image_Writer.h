@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+#include "Bootloader_Host.h"
+#include "bl_cmd_types.h"
+
+/**
+ * @brief Turns address-tagged data into MEM_WRITE transfers.
+ *
+ * Contiguous data is packed into full data packets and every discontinuity
+ * starts a new MEM_WRITE. One block is held back until the size of the
+ * block after it is known, as each packet announces the next one's length.
+ *
+ * With verification on, every block is written by its own MEM_WRITE and read
+ * back against the block still in memory before the next one is written, so
+ * a bad block stops the image where it failed.
+ */
+class Image_Writer
+{
+public:
+	/**
+	 * @param host		Host bound to the target
+	 * @param verify	Whether to verify every block right after writing it
+	 */
+	explicit Image_Writer(Bootloader_Host* host, bool verify = false) : host(host), verify(verify) {}
+
+	/**
+	 * @brief Queues data for writing, flushing the current segment if the address is not contiguous
+	 *
+	 * @param address	Load address of the data
+	 * @param data		The data
+	 * @param length	The size of the data in bytes
+	 * @return true		If all blocks sent so far were acknowledged
+	 * @return false	If the target rejected a command or block
+	 */
+	bool Write(uint32_t address, const uint8_t data[], uint32_t length);
+
+	/**
+	 * @brief Sends whatever is left of the current segment
+	 *
+	 * @return true		If the last blocks were acknowledged
+	 * @return false	Otherwise
+	 */
+	bool Finish(void);
+
+	/**
+	 * @brief Adapter so the writer can be used as an Image_Parser sink
+	 */
+	static bool Sink(void* context, uint32_t address, const uint8_t data[], uint32_t length);
+
+	uint32_t GetSegmentCount() const { return segment_count; }
+	uint32_t GetBytesWritten() const { return bytes_written; }
+	uint32_t GetBytesVerified() const { return bytes_verified; }
+	bool HasMismatch() const { return mismatch; }
+	uint32_t GetMismatchAddress() const { return mismatch_address; }
+
+private:
+	Bootloader_Host* host;
+	bool verify;
+
+	uint8_t blocks[2][BL_DATA_BLOCK_SIZE]; // Block being filled and block held back
+	uint8_t current = 0;				   // Index of the block being filled
+	uint32_t fill = 0;					   // Bytes in the block being filled
+	bool pending = false;				   // Whether the other block is held back
+
+	bool in_segment = false;
+	bool started = false; // Whether MEM_WRITE was sent for the segment
+	uint32_t segment_address = 0;
+	uint32_t next_address = 0;
+	uint32_t sent = 0; // Bytes of the segment sent so far
+
+	uint32_t segment_count = 0;
+	uint32_t bytes_written = 0;
+	uint32_t bytes_verified = 0;
+	bool mismatch = false;
+	uint32_t mismatch_address = 0;
+
+	bool SendBlock(uint8_t index, uint32_t size, uint32_t next_block_len, bool end_flag);
+};
@@ -0,0 +1,116 @@
+#include <Arduino.h>
+#include "Memory_Accounting.h"
+#include "Utilities.h"
+#include "bl_cmd_types.h"
+#include "host_cmd_types.h"
+
+static_assert(BL_FEC_CMD_ID + (HOST_MULTI_FLASH_CMD_ID - HOST_CACHED_WRITE_CMD_ID + 1) + 1 <= MEMORY_MAX_COMMANDS,
+	"not every known command has a record");
+
+Memory_Accounting memory_accounting;
+
+void Memory_Accounting::Track(Memory_Category category, uint32_t bytes) {
+	uint8_t index = (uint8_t)category;
+	current[index] += bytes;
+	if (current[index] > peak[index])
+		peak[index] = current[index];
+
+	tracked_total += bytes;
+	Sample();
+}
+
+void Memory_Accounting::Untrack(Memory_Category category, uint32_t bytes) {
+	current[(uint8_t)category] -= bytes;
+	tracked_total -= bytes;
+}
+
+void Memory_Accounting::BeginCommand() {
+	active = nullptr;
+	in_window = true;
+	start_free = ESP.getFreeHeap();
+	min_free = start_free;
+	min_block = ESP.getMaxFreeBlockSize();
+	start_tracked = tracked_total;
+	peak_tracked = 0;
+}
+
+void Memory_Accounting::SetCommand(uint8_t command_id) {
+	active = Find(command_id);
+}
+
+void Memory_Accounting::EndCommand() {
+	Sample();
+	in_window = false;
+	if (active == nullptr)
+		return;
+
+	active->count++;
+	active->peak_tracked = max(active->peak_tracked, peak_tracked);
+	active->peak_heap_used = max(active->peak_heap_used, start_free - min_free);
+	if (active->min_largest_block == 0 || min_block < active->min_largest_block)
+		active->min_largest_block = min_block;
+
+	active = nullptr;
+}
+
+bool Memory_Accounting::Admit(uint8_t command_id, uint32_t total_bytes, uint32_t largest_bytes) {
+	uint32_t free_heap = ESP.getFreeHeap();
+	uint32_t largest_block = ESP.getMaxFreeBlockSize();
+
+	/* The largest buffer needs one contiguous block, all of them together need the total */
+	if (largest_bytes <= largest_block && total_bytes + MEMORY_ADMIT_MARGIN <= free_heap)
+		return true;
+
+	DEBUG_PRINTF("Rejecting command 0x%02X: needs %lu (block %lu), free %lu (block %lu)",
+		command_id, total_bytes, largest_bytes, free_heap, largest_block);
+
+	Memory_Command_Record* record = Find(command_id);
+	if (record)
+		record->rejected++;
+	return false;
+}
+
+const char* Memory_Accounting::CategoryName(Memory_Category category) {
+	switch (category) {
+	case Memory_Category::Json: return "json";
+	case Memory_Category::Base64: return "base64";
+	case Memory_Category::Packet: return "packet";
+	case Memory_Category::ReadBuffer: return "readBuffer";
+	case Memory_Category::Trace: return "trace";
+	default: return "unknown";
+	}
+}
+
+Memory_Command_Record* Memory_Accounting::Find(uint8_t command_id) {
+	bool known = (command_id >= BL_GOTO_ADDR_CMD_ID && command_id <= BL_FEC_CMD_ID) ||
+		(command_id >= HOST_CACHED_WRITE_CMD_ID && command_id <= HOST_MULTI_FLASH_CMD_ID);
+	if (!known)
+		command_id = MEMORY_OTHER_COMMAND;
+
+	for (uint8_t i = 0; i < record_count; i++) {
+		if (records[i].command_id == command_id)
+			return &records[i];
+	}
+
+	if (record_count == MEMORY_MAX_COMMANDS)
+		return nullptr;
+
+	Memory_Command_Record& record = records[record_count++];
+	record = {};
+	record.command_id = command_id;
+	return &record;
+}
+
+void Memory_Accounting::Sample() {
+	if (!in_window)
+		return;
+
+	uint32_t free_heap = ESP.getFreeHeap();
+	uint32_t largest_block = ESP.getMaxFreeBlockSize();
+	if (free_heap < min_free)
+		min_free = free_heap;
+	if (largest_block < min_block)
+		min_block = largest_block;
+	if (tracked_total > start_tracked && tracked_total - start_tracked > peak_tracked)
+		peak_tracked = tracked_total - start_tracked;
+}
@@ -0,0 +1,121 @@
+#pragma once
+#include <stdint.h>
+
+#define MEMORY_MAX_COMMANDS (32U)	   // Records, one per known command ID and one shared by the rest
+#define MEMORY_OTHER_COMMAND (0x00U)  // ID of the record shared by the command IDs the host does not know
+#define MEMORY_ADMIT_MARGIN (4096U)   // Heap kept free for the WiFi stack when admitting a request
+
+enum class Memory_Category : uint8_t
+{
+	Json,		// JSON documents and serialized replies
+	Base64,		// Decoded upload buffers
+	Packet,		// Packets that did not fit in the packet pools
+	ReadBuffer, // MEM_READ destination buffers
+	Trace,		// Wire traces loaded for replay
+	Count
+};
+
+/**
+ * @brief Memory figures of one command type
+ */
+struct Memory_Command_Record
+{
+	uint8_t command_id;
+	uint32_t count;				// Times the command ran
+	uint32_t rejected;			// Times admission refused it
+	uint32_t peak_tracked;		// Highest sum of tracked buffers while it ran
+	uint32_t peak_heap_used;	// Highest drop in free heap while it ran
+	uint32_t min_largest_block; // Smallest largest-free-block seen while it ran
+};
+
+/**
+ * @brief Accounts for the buffers the host allocates per command.
+ *
+ * Known allocations report themselves through Track/Untrack. While a command
+ * runs, each of those points also samples the free heap and the largest free
+ * block, so the record of the command holds its real peak including
+ * fragmentation. Each BL_CommandID_t and HOST_CommandID_t a client may send
+ * has its own record, any other ID goes to the MEMORY_OTHER_COMMAND one, so
+ * made-up IDs cannot use up the records.
+ */
+class Memory_Accounting
+{
+public:
+	void Track(Memory_Category category, uint32_t bytes);
+	void Untrack(Memory_Category category, uint32_t bytes);
+
+	/**
+	 * @brief Starts the accounting window of a request, before anything is allocated for it
+	 */
+	void BeginCommand(void);
+
+	/**
+	 * @brief Attributes the running window to a command once its ID is known
+	 *
+	 * @param command_id	ID of the command, BL_CommandID_t or HOST_CommandID_t
+	 */
+	void SetCommand(uint8_t command_id);
+
+	/**
+	 * @brief Closes the accounting window and folds it into the command's record
+	 */
+	void EndCommand(void);
+
+	/**
+	 * @brief Checks whether a request fits in memory before starting it
+	 *
+	 * @param command_id		ID of the command
+	 * @param total_bytes		Projected sum of the buffers the request needs at its peak
+	 * @param largest_bytes		Projected size of its largest single buffer
+	 * @return true		If the request fits, keeping MEMORY_ADMIT_MARGIN free
+	 * @return false	If it should be rejected
+	 */
+	bool Admit(uint8_t command_id, uint32_t total_bytes, uint32_t largest_bytes);
+
+	uint32_t GetCurrent(Memory_Category category) const { return current[(uint8_t)category]; }
+	uint32_t GetPeak(Memory_Category category) const { return peak[(uint8_t)category]; }
+	uint8_t GetRecordCount() const { return record_count; }
+	const Memory_Command_Record& GetRecord(uint8_t index) const { return records[index]; }
+
+	static const char* CategoryName(Memory_Category category);
+
+private:
+	uint32_t current[(uint8_t)Memory_Category::Count] = { 0 };
+	uint32_t peak[(uint8_t)Memory_Category::Count] = { 0 };
+	uint32_t tracked_total = 0;
+
+	Memory_Command_Record records[MEMORY_MAX_COMMANDS];
+	uint8_t record_count = 0;
+
+	/* Window of the running command */
+	Memory_Command_Record* active = nullptr;
+	bool in_window = false;
+	uint32_t start_free = 0;
+	uint32_t min_free = 0;
+	uint32_t min_block = 0;
+	uint32_t start_tracked = 0;
+	uint32_t peak_tracked = 0;
+
+	Memory_Command_Record* Find(uint8_t command_id);
+	void Sample(void);
+};
+
+extern Memory_Accounting memory_accounting;
+
+/**
+ * @brief Tracks a buffer for as long as this object lives
+ */
+class Tracked_Allocation
+{
+public:
+	Tracked_Allocation(Memory_Category category, uint32_t bytes) : category(category), bytes(bytes) {
+		memory_accounting.Track(category, bytes);
+	}
+	~Tracked_Allocation() { memory_accounting.Untrack(category, bytes); }
+
+	Tracked_Allocation(const Tracked_Allocation& obj) = delete;
+
+private:
+	Memory_Category category;
+	uint32_t bytes;
+};
@@ -0,0 +1,47 @@
+#include <stdlib.h>
+#include "Packet_Pool.h"
+#include "Memory_Accounting.h"
+
+static_assert(sizeof(BL_MEM_READ_CMD) <= BL_SMALL_PACKET_SLOT_SIZE, "small slot too small");
+static_assert(sizeof(BL_MEM_READ_STREAM_CMD) <= BL_SMALL_PACKET_SLOT_SIZE, "small slot too small");
+static_assert(sizeof(BL_FLASH_ERASE_CMD) <= BL_SMALL_PACKET_SLOT_SIZE, "small slot too small");
+
+Small_Packet_Pool small_packet_pool;
+Large_Packet_Pool large_packet_pool;
+
+void* bl_packet_alloc(size_t size) {
+	void* p = nullptr;
+
+	if (size <= BL_SMALL_PACKET_SLOT_SIZE)
+		p = small_packet_pool.Allocate();
+	else if (size <= BL_LARGE_PACKET_SLOT_SIZE)
+		p = large_packet_pool.Allocate();
+
+	/* Pool exhausted (counted by the pool), keep working from the heap.
+	   The size is stored in front of the packet to account for its release */
+	if (p == nullptr) {
+		uint32_t* block = (uint32_t*)malloc(sizeof(uint32_t) + size);
+		if (block == nullptr)
+			return nullptr;
+		block[0] = size;
+		memory_accounting.Track(Memory_Category::Packet, size);
+		p = &block[1];
+	}
+
+	return p;
+}
+
+void bl_packet_free(void* p) {
+	if (p == nullptr)
+		return;
+
+	if (small_packet_pool.Owns(p))
+		small_packet_pool.Release(p);
+	else if (large_packet_pool.Owns(p))
+		large_packet_pool.Release(p);
+	else {
+		uint32_t* block = (uint32_t*)p - 1;
+		memory_accounting.Untrack(Memory_Category::Packet, block[0]);
+		free(block);
+	}
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <new>
+#include "bl_cmd_types.h"
+
+#define BL_SMALL_PACKET_SLOT_SIZE (32U)					 // Fits every command but the data packet
+#define BL_SMALL_PACKET_SLOT_COUNT (8U)
+#define BL_LARGE_PACKET_SLOT_SIZE (sizeof(BL_DATA_PACKET_CMD))
+#define BL_LARGE_PACKET_SLOT_COUNT (2U)
+
+struct Packet_Pool_Stats
+{
+	uint32_t allocations; // Successful allocations from the pool
+	uint32_t in_use;	  // Slots currently handed out
+	uint32_t peak_in_use; // Highest value of in_use
+	uint32_t exhausted;	  // Requests that found no free slot and fell back to the heap
+};
+
+/**
+ * @brief Fixed number of fixed-size slots in static memory.
+ *
+ * Packets are short lived and always the same few sizes, so keeping them
+ * out of the heap avoids fragmenting it over long flashing sessions.
+ */
+template <size_t SlotSize, size_t SlotCount>
+class Packet_Pool
+{
+	static_assert(SlotCount <= 32, "free mask is 32 bits wide");
+
+public:
+	void* Allocate() {
+		for (size_t i = 0; i < SlotCount; i++) {
+			if (free_mask & (1UL << i)) {
+				free_mask &= ~(1UL << i);
+				stats.allocations++;
+				if (++stats.in_use > stats.peak_in_use)
+					stats.peak_in_use = stats.in_use;
+				return slots[i];
+			}
+		}
+		stats.exhausted++;
+		return nullptr;
+	}
+
+	bool Owns(const void* p) const {
+		return p >= (const void*)slots && p < (const void*)(slots + SlotCount);
+	}
+
+	void Release(void* p) {
+		size_t i = ((uint8_t*)p - &slots[0][0]) / SlotSize;
+		free_mask |= (1UL << i);
+		stats.in_use--;
+	}
+
+	const Packet_Pool_Stats& GetStats() const { return stats; }
+
+private:
+	alignas(4) uint8_t slots[SlotCount][SlotSize];
+	uint32_t free_mask = (SlotCount == 32) ? 0xFFFFFFFFUL : ((1UL << SlotCount) - 1);
+	Packet_Pool_Stats stats = {};
+};
+
+typedef Packet_Pool<BL_SMALL_PACKET_SLOT_SIZE, BL_SMALL_PACKET_SLOT_COUNT> Small_Packet_Pool;
+typedef Packet_Pool<BL_LARGE_PACKET_SLOT_SIZE, BL_LARGE_PACKET_SLOT_COUNT> Large_Packet_Pool;
+
+extern Small_Packet_Pool small_packet_pool;
+extern Large_Packet_Pool large_packet_pool;
+
+/**
+ * @brief Allocates memory for a packet, from the matching pool if a slot is free
+ *
+ * @param size	The size of the packet in bytes
+ * @return void* Memory for the packet, nullptr if even the heap is out of memory
+ */
+void* bl_packet_alloc(size_t size);
+
+/**
+ * @brief Releases memory returned by bl_packet_alloc
+ *
+ * @param p	The packet
+ */
+void bl_packet_free(void* p);
+
+struct BL_PacketDeleter
+{
+	void operator()(void* p) const { bl_packet_free(p); }
+};
+
+/* Owning packet handle, used like the std::unique_ptr it is */
+template <class T>
+using BL_PacketPtr = std::unique_ptr<T, BL_PacketDeleter>;
+
+template <class T>
+BL_PacketPtr<T> bl_make_packet(const T& value)
+{
+	static_assert(sizeof(T) <= BL_LARGE_PACKET_SLOT_SIZE, "packet larger than a pool slot");
+
+	void* memory = bl_packet_alloc(sizeof(T));
+	if (memory == nullptr)
+		return BL_PacketPtr<T>();
+
+	/* Packets are trivially destructible unions, the deleter only returns the slot */
+	return BL_PacketPtr<T>(new (memory) T(value));
+}
@@ -0,0 +1,185 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "bl_cmd_types.h"
+
+/**
+ * @brief Field of a wire layout: its type and byte offset
+ */
+template <class T, size_t Offset>
+struct BL_Field
+{
+	typedef T type;
+	static constexpr size_t offset = Offset;
+	static constexpr size_t end = Offset + sizeof(T);
+};
+
+/* Wire layouts, little endian, no padding. Each lists its fields and its
+   fixed size; a variable data block starts at data_offset */
+namespace BL_Layout
+{
+	struct Header
+	{
+		typedef BL_Field<uint32_t, 0> PayloadSize;
+		typedef BL_Field<uint8_t, 4> CmdId;
+		typedef BL_Field<uint32_t, 5> Crc;
+		static constexpr size_t size = 9;
+	};
+
+	struct KeyCommand : Header // ENTER_CMD_MODE and JUMP_TO_APP
+	{
+		typedef BL_Field<uint32_t, 9> Key;
+		static constexpr size_t size = 13;
+	};
+
+	struct GotoAddr : Header
+	{
+		typedef BL_Field<uint32_t, 9> Address;
+		static constexpr size_t size = 13;
+	};
+
+	struct MemWrite : Header
+	{
+		typedef BL_Field<uint32_t, 9> StartAddress;
+		static constexpr size_t size = 13;
+	};
+
+	struct MemRead : Header
+	{
+		typedef BL_Field<uint32_t, 9> StartAddress;
+		typedef BL_Field<uint32_t, 13> Length;
+		static constexpr size_t size = 17;
+	};
+
+	struct MemReadStream : MemRead
+	{
+		typedef BL_Field<uint8_t, 17> Window;
+		static constexpr size_t size = 18;
+	};
+
+	struct FlashErase : Header
+	{
+		typedef BL_Field<uint32_t, 9> Address;
+		typedef BL_Field<uint32_t, 13> PageCount;
+		static constexpr size_t size = 17;
+	};
+
+	struct Batch : Header
+	{
+		typedef BL_Field<uint8_t, 9> Count;
+		static constexpr size_t size = 10;
+		static constexpr size_t data_offset = 10; // Sub-commands, back to back
+	};
+
+	struct DataPacket : Header
+	{
+		typedef BL_Field<uint32_t, 9> DataLen;
+		typedef BL_Field<uint32_t, 13> NextLen;
+		typedef BL_Field<uint32_t, 13> PacketIndex; // Streaming reads
+		typedef BL_Field<uint8_t, 17> EndFlag;
+		static constexpr size_t size = 18;
+		static constexpr size_t data_offset = 18;
+	};
+
+	struct Ack
+	{
+		typedef BL_Field<uint8_t, 0> CmdId;
+		typedef BL_Field<uint8_t, 1> Value;
+		typedef BL_Field<uint8_t, 2> NackField;
+		static constexpr size_t size = 3;
+	};
+
+	struct StreamAck : Ack
+	{
+		typedef BL_Field<uint32_t, 3> PacketIndex;
+		static constexpr size_t size = 7;
+	};
+}
+
+static_assert(BL_Layout::Header::Crc::offset == offsetof(BL_CommandHeader_t, CRC32), "header layout mismatch");
+static_assert(BL_Layout::Header::size == sizeof(BL_VER_CMD), "header layout mismatch");
+static_assert(BL_Layout::KeyCommand::size == sizeof(BL_ENTER_CMD_MODE_CMD) && BL_Layout::KeyCommand::size == sizeof(BL_JUMP_TO_APP_CMD) &&
+	BL_Layout::KeyCommand::Key::offset == offsetof(BL_JUMP_TO_APP_CMD, data.key), "key command layout mismatch");
+static_assert(BL_Layout::GotoAddr::size == sizeof(BL_GOTO_ADDR_CMD), "goto layout mismatch");
+static_assert(BL_Layout::MemWrite::size == sizeof(BL_MEM_WRITE_CMD), "memory write layout mismatch");
+static_assert(BL_Layout::MemRead::Length::offset == offsetof(BL_MEM_READ_CMD, data.length) &&
+	BL_Layout::MemRead::size == sizeof(BL_MEM_READ_CMD), "memory read layout mismatch");
+static_assert(BL_Layout::MemReadStream::Window::offset == offsetof(BL_MEM_READ_STREAM_CMD, data.window) &&
+	BL_Layout::MemReadStream::size == sizeof(BL_MEM_READ_STREAM_CMD), "streaming read layout mismatch");
+static_assert(BL_Layout::FlashErase::PageCount::offset == offsetof(BL_FLASH_ERASE_CMD, data.page_count) &&
+	BL_Layout::FlashErase::size == sizeof(BL_FLASH_ERASE_CMD), "flash erase layout mismatch");
+static_assert(BL_Layout::Batch::data_offset == offsetof(BL_BATCH_CMD, data.commands), "batch layout mismatch");
+static_assert(BL_Layout::DataPacket::DataLen::offset == offsetof(BL_DATA_PACKET_CMD, data.data_len), "data packet layout mismatch");
+static_assert(BL_Layout::DataPacket::PacketIndex::offset == offsetof(BL_STREAM_PACKET_CMD, data.packet_index), "stream packet layout mismatch");
+static_assert(BL_Layout::DataPacket::data_offset == offsetof(BL_DATA_PACKET_CMD, data.data_block), "data packet layout mismatch");
+static_assert(BL_Layout::StreamAck::size == sizeof(BL_STREAM_ACK), "stream ACK layout mismatch");
+
+/* Byte-wise little endian access, safe at any alignment and on any host byte order */
+template <class T>
+inline T bl_load_le(const uint8_t* p) {
+	T value = 0;
+	for (size_t i = 0; i < sizeof(T); i++)
+		value |= (T)p[i] << (8 * i);
+	return value;
+}
+
+template <class T>
+inline void bl_store_le(uint8_t* p, T value) {
+	for (size_t i = 0; i < sizeof(T); i++)
+		p[i] = (uint8_t)(value >> (8 * i));
+}
+
+/**
+ * @brief Read-only view of a frame laid out as Layout, over bytes it does not own
+ */
+template <class Layout>
+class Packet_View
+{
+public:
+	Packet_View(const uint8_t* bytes, size_t length) : bytes(bytes), length(length) {}
+
+	template <class Field>
+	typename Field::type Get() const {
+		static_assert(Field::end <= Layout::size, "field outside layout");
+		return bl_load_le<typename Field::type>(bytes + Field::offset);
+	}
+
+	/**
+	 * @brief Gets the data block that follows the fixed fields
+	 *
+	 * @param data_length	Length of the block
+	 * @return const uint8_t*	The block, nullptr if it does not fit in the span
+	 */
+	const uint8_t* Data(size_t data_length) const {
+		return Layout::data_offset + data_length <= length ? bytes + Layout::data_offset : nullptr;
+	}
+
+protected:
+	const uint8_t* bytes;
+	size_t length;
+};
+
+/**
+ * @brief Writable view of a frame laid out as Layout
+ */
+template <class Layout>
+class Packet_Writer : public Packet_View<Layout>
+{
+public:
+	Packet_Writer(uint8_t* bytes, size_t length) : Packet_View<Layout>(bytes, length) {}
+
+	template <class Field>
+	Packet_Writer& Set(typename Field::type value) {
+		static_assert(Field::end <= Layout::size, "field outside layout");
+		bl_store_le<typename Field::type>(Bytes() + Field::offset, value);
+		return *this;
+	}
+
+	uint8_t* Data(size_t data_length) {
+		return const_cast<uint8_t*>(Packet_View<Layout>::Data(data_length));
+	}
+
+private:
+	uint8_t* Bytes() { return const_cast<uint8_t*>(this->bytes); }
+};
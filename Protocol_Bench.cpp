@@ -0,0 +1,209 @@
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "Protocol_Bench.h"
+#include "BootloaderCommand.h"
+#include "Packet_View.h"
+#include "Packet_Pool.h"
+#include "bl_fec.h"
+#include "Utilities.h"
+
+/* Results are folded in here so the compiler cannot drop the work */
+static volatile uint32_t bench_sink;
+
+static uint8_t bench_data[sizeof(BL_DATA_PACKET_CMD)];
+
+template <uint32_t Size>
+static void BenchCrc(uint32_t n) {
+	for (uint32_t i = 0; i < n; i++)
+		bench_sink += bl_calculate_command_crc(bench_data, Size);
+}
+
+static void BenchGotoAddr(uint32_t n) {
+	for (uint32_t i = 0; i < n; i++)
+		bench_sink += CreateGotoAddrCommand(i)->data.header.CRC32;
+}
+
+static void BenchMemWrite(uint32_t n) {
+	for (uint32_t i = 0; i < n; i++)
+		bench_sink += CreateMemWriteCommand(i)->data.header.CRC32;
+}
+
+static void BenchMemRead(uint32_t n) {
+	for (uint32_t i = 0; i < n; i++)
+		bench_sink += CreateMemReadCommand(i, BL_DATA_BLOCK_SIZE)->data.header.CRC32;
+}
+
+static void BenchMemReadStream(uint32_t n) {
+	for (uint32_t i = 0; i < n; i++)
+		bench_sink += CreateMemReadStreamCommand(i, BL_DATA_BLOCK_SIZE, BL_MEM_READ_MAX_WINDOW)->data.header.CRC32;
+}
+
+static void BenchVer(uint32_t n) {
+	for (uint32_t i = 0; i < n; i++)
+		bench_sink += CreateVerCommand()->data.header.CRC32;
+}
+
+static void BenchFlashErase(uint32_t n) {
+	for (uint32_t i = 0; i < n; i++)
+		bench_sink += CreateFlashEraseCommand(i, 1)->data.header.CRC32;
+}
+
+static void BenchJumpToApp(uint32_t n) {
+	for (uint32_t i = 0; i < n; i++)
+		bench_sink += CreateJumpToAppCommand(i)->data.header.CRC32;
+}
+
+static void BenchEnterCmdMode(uint32_t n) {
+	for (uint32_t i = 0; i < n; i++)
+		bench_sink += CreateEnterCmdModeCommand(i)->data.header.CRC32;
+}
+
+static void BenchDataPacket(uint32_t n) {
+	for (uint32_t i = 0; i < n; i++)
+		bench_sink += CreateDataPacketCommand(bench_data, BL_DATA_BLOCK_SIZE, BL_DATA_BLOCK_SIZE, false)->data.header.CRC32;
+}
+
+/* The same packet built on the stack, without the pool */
+static void BenchBuildDataPacket(uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {
+		BL_DATA_PACKET_CMD_Builder builder;
+		bench_sink += builder.setData(bench_data, BL_DATA_BLOCK_SIZE).setNextBlockLen(BL_DATA_BLOCK_SIZE).build().data.header.CRC32;
+	}
+}
+
+static void BenchAckView(uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {
+		Packet_View<BL_Layout::Ack> view(&bench_data[i % 16], sizeof(BL_ACK));
+		bench_sink += view.Get<BL_Layout::Ack::Value>() + view.Get<BL_Layout::Ack::NackField>();
+	}
+}
+
+static void BenchAckUnion(uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {
+		BL_ACK* ack = (BL_ACK*)&bench_data[i % 16];
+		bench_sink += ack->data.ack + (uint8_t)ack->data.field;
+	}
+}
+
+static void BenchFecEncode(uint32_t n) {
+	uint8_t trailer[BL_FEC_MAX_TRAILER_SIZE];
+	for (uint32_t i = 0; i < n; i++) {
+		bl_fec_encode(bench_data, BL_DATA_BLOCK_SIZE, trailer);
+		bench_sink += trailer[i % sizeof(trailer)];
+	}
+}
+
+struct Benchmark
+{
+	const char* name;
+	uint32_t bytes_per_op;
+	void (*run)(uint32_t iterations);
+};
+
+static const Benchmark benchmarks[] = {
+	{ "crc_header", sizeof(BL_CommandHeader_t), BenchCrc<sizeof(BL_CommandHeader_t)> },
+	{ "crc_64", 64, BenchCrc<64> },
+	{ "crc_data_packet", sizeof(BL_DATA_PACKET_CMD), BenchCrc<sizeof(BL_DATA_PACKET_CMD)> },
+	{ "create_goto_addr", sizeof(BL_GOTO_ADDR_CMD), BenchGotoAddr },
+	{ "create_mem_write", sizeof(BL_MEM_WRITE_CMD), BenchMemWrite },
+	{ "create_mem_read", sizeof(BL_MEM_READ_CMD), BenchMemRead },
+	{ "create_mem_read_stream", sizeof(BL_MEM_READ_STREAM_CMD), BenchMemReadStream },
+	{ "create_ver", sizeof(BL_VER_CMD), BenchVer },
+	{ "create_flash_erase", sizeof(BL_FLASH_ERASE_CMD), BenchFlashErase },
+	{ "create_jump_to_app", sizeof(BL_JUMP_TO_APP_CMD), BenchJumpToApp },
+	{ "create_enter_cmd_mode", sizeof(BL_ENTER_CMD_MODE_CMD), BenchEnterCmdMode },
+	{ "create_data_packet", sizeof(BL_DATA_PACKET_CMD), BenchDataPacket },
+	{ "build_data_packet", sizeof(BL_DATA_PACKET_CMD), BenchBuildDataPacket },
+	{ "ack_parse_view", sizeof(BL_ACK), BenchAckView },
+	{ "ack_parse_union", sizeof(BL_ACK), BenchAckUnion },
+	{ "fec_encode", BL_DATA_BLOCK_SIZE, BenchFecEncode },
+};
+
+#define BENCH_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static_assert(BENCH_COUNT <= BENCH_MAX_RESULTS, "too many benchmarks for the results");
+
+static uint32_t PacketAllocations() {
+	return small_packet_pool.GetStats().allocations + small_packet_pool.GetStats().exhausted +
+		large_packet_pool.GetStats().allocations + large_packet_pool.GetStats().exhausted;
+}
+
+uint8_t Protocol_Bench::Run(uint32_t iterations, uint8_t tolerance_percent) {
+	this->iterations = iterations;
+	for (uint32_t i = 0; i < sizeof(bench_data); i++)
+		bench_data[i] = (uint8_t)(i * 31 + 7);
+
+	uint32_t baseline[BENCH_COUNT];
+	bool has_baseline = LoadBaseline(baseline, BENCH_COUNT);
+	uint8_t regressions = 0;
+
+	for (uint8_t b = 0; b < BENCH_COUNT; b++) {
+		Result& result = results[b];
+		result = { benchmarks[b].name, benchmarks[b].bytes_per_op, 0, 0, 0, false };
+
+		/* One untimed pass warms the caches, then the timed run */
+		benchmarks[b].run(1);
+		yield();
+
+		uint32_t allocations = PacketAllocations();
+		uint32_t start = micros();
+		benchmarks[b].run(iterations);
+		uint32_t elapsed = micros() - start;
+
+		result.allocations = PacketAllocations() - allocations;
+		result.ns_per_op = (uint32_t)((uint64_t)elapsed * 1000 / iterations);
+
+		if (has_baseline && baseline[b]) {
+			result.baseline_ns = baseline[b];
+			result.regression = (uint64_t)result.ns_per_op * 100 > (uint64_t)baseline[b] * (100 + tolerance_percent);
+			if (result.regression)
+				regressions++;
+		}
+
+		DEBUG_PRINTF("%s: %lu ns/op, %lu allocations, baseline %lu ns%s", result.name, result.ns_per_op,
+			result.allocations, result.baseline_ns, result.regression ? " REGRESSION" : "");
+		yield();
+	}
+
+	return regressions;
+}
+
+bool Protocol_Bench::SaveBaseline() {
+	if (iterations == 0)
+		return false;
+
+	File file = LittleFS.open(BENCH_BASELINE_FILE, "w");
+	if (!file)
+		return false;
+
+	uint32_t header[2] = { BENCH_BASELINE_MAGIC, BENCH_COUNT };
+	bool status = file.write((uint8_t*)header, sizeof(header)) == sizeof(header);
+	for (uint8_t b = 0; b < BENCH_COUNT && status; b++)
+		status = file.write((uint8_t*)&results[b].ns_per_op, sizeof(uint32_t)) == sizeof(uint32_t);
+	file.close();
+	return status;
+}
+
+bool Protocol_Bench::LoadBaseline(uint32_t ns[], uint8_t count) {
+	File file = LittleFS.open(BENCH_BASELINE_FILE, "r");
+	if (!file)
+		return false;
+
+	/* A baseline of another set of benchmarks cannot be compared */
+	uint32_t header[2] = { 0 };
+	bool status = file.read((uint8_t*)header, sizeof(header)) == sizeof(header) &&
+		header[0] == BENCH_BASELINE_MAGIC && header[1] == count &&
+		file.read((uint8_t*)ns, count * sizeof(uint32_t)) == count * sizeof(uint32_t);
+	file.close();
+	return status;
+}
+
+uint8_t Protocol_Bench::GetCount() const {
+	return iterations ? BENCH_COUNT : 0;
+}
+
+uint32_t Protocol_Bench::BytesPerSecond(const Result& result) {
+	if (result.ns_per_op == 0)
+		return 0;
+	return (uint32_t)((uint64_t)result.bytes_per_op * 1000000000ULL / result.ns_per_op);
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <stdint.h>
+
+#define BENCH_BASELINE_FILE "/bench"		   // Timings a later run is compared with
+#define BENCH_BASELINE_MAGIC (0x424E4331UL) // "BNC1", marks a valid baseline
+#define BENCH_DEFAULT_ITERATIONS (200U)
+#define BENCH_DEFAULT_TOLERANCE (10U)		   // Percent slower than the baseline before a run is flagged
+#define BENCH_MAX_RESULTS (24U)
+
+/**
+ * @brief Microbenchmarks of the protocol layer, run on the host itself.
+ *
+ * Times the CRC, every command factory, data packet construction and ACK
+ * parsing without any serial traffic, and counts the packet allocations
+ * each makes. A run can be saved as the baseline; later runs are compared
+ * with it and every benchmark slower by more than the tolerance is flagged.
+ *
+ * Only the on-device run exists: the sketch has no Linux build to host the
+ * suite, and the baseline lives in LittleFS once a device saved one, so no
+ * reference baseline ships with the sources.
+ */
+class Protocol_Bench
+{
+public:
+	struct Result
+	{
+		const char* name;
+		uint32_t bytes_per_op; // Bytes processed per operation, 0 when not meaningful
+		uint32_t ns_per_op;
+		uint32_t allocations;  // Packet allocations over the whole run
+		uint32_t baseline_ns;  // 0 without a baseline
+		bool regression;
+	};
+
+	/**
+	 * @brief Runs every benchmark and compares it with the saved baseline
+	 *
+	 * @param iterations		Operations timed per benchmark
+	 * @param tolerance_percent	Slowdown against the baseline flagged as a regression
+	 * @return uint8_t Number of regressions
+	 */
+	uint8_t Run(uint32_t iterations = BENCH_DEFAULT_ITERATIONS, uint8_t tolerance_percent = BENCH_DEFAULT_TOLERANCE);
+
+	/**
+	 * @brief Saves the timings of the last run as the baseline
+	 *
+	 * @return true		If the baseline was written
+	 * @return false	If nothing ran yet or the file could not be written
+	 */
+	bool SaveBaseline(void);
+
+	uint8_t GetCount() const;
+	const Result& GetResult(uint8_t index) const { return results[index]; }
+	uint32_t GetIterations() const { return iterations; }
+
+	/**
+	 * @brief Bytes per second processed by a benchmark
+	 */
+	static uint32_t BytesPerSecond(const Result& result);
+
+private:
+	Result results[BENCH_MAX_RESULTS];
+	uint32_t iterations = 0;
+
+	bool LoadBaseline(uint32_t ns[], uint8_t count);
+};
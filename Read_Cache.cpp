@@ -0,0 +1,103 @@
+#include <Arduino.h>
+#include "Read_Cache.h"
+#include "Bootloader_Host.h"
+#include "Utilities.h"
+
+bool Read_Cache::Read(Bootloader_Host& host, uint32_t address, uint32_t length, uint8_t out[]) {
+	uint32_t end = address + length;
+	uint32_t line_address = address & ~(READ_CACHE_LINE_SIZE - 1);
+
+	while (line_address < end) {
+		Line* line = Find(line_address);
+		if (line) {
+			/* Copy the part of the line the request covers */
+			uint32_t from = max(address, line_address);
+			uint32_t to = min(end, line_address + READ_CACHE_LINE_SIZE);
+			memcpy(&out[from - address], &line->data[from - line_address], to - from);
+			line->last_used = ++use_counter;
+			bytes_cached += to - from;
+			hits++;
+			line_address += READ_CACHE_LINE_SIZE;
+			continue;
+		}
+
+		/* Fetch the whole run of missing lines in one read */
+		uint32_t run_end = line_address + READ_CACHE_LINE_SIZE;
+		while (run_end < end && !Find(run_end))
+			run_end += READ_CACHE_LINE_SIZE;
+
+		Fetch fetch = { this, line_address, address, length, out, nullptr };
+		if (!host.SendMemReadCommand(line_address, run_end - line_address, FetchSink, &fetch))
+			return false;
+
+		misses += (run_end - line_address) / READ_CACHE_LINE_SIZE;
+		line_address = run_end;
+	}
+	return true;
+}
+
+void Read_Cache::Invalidate(uint32_t address, uint32_t length) {
+	for (uint8_t i = 0; i < READ_CACHE_LINES; i++) {
+		if (lines[i].valid && lines[i].address < address + length && address < lines[i].address + READ_CACHE_LINE_SIZE)
+			lines[i].valid = false;
+	}
+}
+
+void Read_Cache::Clear() {
+	for (uint8_t i = 0; i < READ_CACHE_LINES; i++)
+		lines[i].valid = false;
+}
+
+Read_Cache::Line* Read_Cache::Find(uint32_t line_address) {
+	for (uint8_t i = 0; i < READ_CACHE_LINES; i++) {
+		if (lines[i].valid && lines[i].address == line_address)
+			return &lines[i];
+	}
+	return nullptr;
+}
+
+Read_Cache::Line* Read_Cache::Victim() {
+	Line* victim = &lines[0];
+	for (uint8_t i = 0; i < READ_CACHE_LINES; i++) {
+		if (!lines[i].valid)
+			return &lines[i];
+		if (lines[i].last_used < victim->last_used)
+			victim = &lines[i];
+	}
+	return victim;
+}
+
+bool Read_Cache::FetchSink(void* context, uint32_t offset, const uint8_t data[], uint32_t length) {
+	Fetch* fetch = static_cast<Fetch*>(context);
+	uint32_t address = fetch->address + offset;
+	uint32_t request_end = fetch->request_address + fetch->request_length;
+
+	while (length) {
+		uint32_t line_address = address & ~(READ_CACHE_LINE_SIZE - 1);
+		uint32_t line_offset = address - line_address;
+		uint32_t count = min(length, READ_CACHE_LINE_SIZE - line_offset);
+
+		/* Packets may end mid-line, keep filling the same line */
+		if (!fetch->line || fetch->line->address != line_address) {
+			fetch->line = fetch->cache->Victim();
+			fetch->line->valid = false;
+			fetch->line->address = line_address;
+		}
+		memcpy(&fetch->line->data[line_offset], data, count);
+		if (line_offset + count == READ_CACHE_LINE_SIZE) {
+			fetch->line->valid = true;
+			fetch->line->last_used = ++fetch->cache->use_counter;
+		}
+
+		/* And the part the request asked for */
+		uint32_t from = max(address, fetch->request_address);
+		uint32_t to = min(address + count, request_end);
+		if (from < to)
+			memcpy(&fetch->out[from - fetch->request_address], &data[from - address], to - from);
+
+		address += count;
+		data += count;
+		length -= count;
+	}
+	return true;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <stdint.h>
+
+#define READ_CACHE_LINE_SIZE (256U) // Bytes per cache line, lines are aligned to their size
+#define READ_CACHE_LINES (8U)		// Lines kept, least recently used is replaced first
+
+class Bootloader_Host;
+
+/**
+ * @brief Cache of the target memory read by the host, in aligned lines.
+ *
+ * Reads are served line by line from the cache, and every run of missing
+ * lines is fetched with one MEM_READ that fills the lines as its packets
+ * arrive. The host that owns the cache drops the lines a write or erase
+ * touches, and everything on a batch, a new command mode session or a jump,
+ * so a cached line always holds what the target has.
+ */
+class Read_Cache
+{
+public:
+	/**
+	 * @brief Reads target memory, from the cache where possible
+	 *
+	 * @param host		Host bound to the target, used for the missing lines
+	 * @param address	The start address to read from
+	 * @param length	The length of the data to read in bytes
+	 * @param out		Out buffer, length bytes
+	 * @return true		If all the data was read
+	 * @return false	If a read of missing lines failed
+	 */
+	bool Read(Bootloader_Host& host, uint32_t address, uint32_t length, uint8_t out[]);
+
+	/**
+	 * @brief Drops every line overlapping a range
+	 */
+	void Invalidate(uint32_t address, uint32_t length);
+
+	/**
+	 * @brief Drops every line
+	 */
+	void Clear(void);
+
+	/**
+	 * @brief Sets the flash page size, used to know what an erase of N pages covers
+	 */
+	void SetPageSize(uint32_t size) { page_size = size; }
+	uint32_t GetPageSize() const { return page_size; }
+
+	uint32_t GetHits() const { return hits; }		  // Lines served from the cache
+	uint32_t GetMisses() const { return misses; }	  // Lines fetched from the target
+	uint32_t GetBytesCached() const { return bytes_cached; } // Requested bytes served from the cache
+
+private:
+	struct Line
+	{
+		uint32_t address;
+		uint32_t last_used;
+		bool valid;
+		uint8_t data[READ_CACHE_LINE_SIZE];
+	};
+
+	/* Fetch of a run of missing lines, filled as the packets arrive */
+	struct Fetch
+	{
+		Read_Cache* cache;
+		uint32_t address; // Line-aligned start of the run
+		uint32_t request_address;
+		uint32_t request_length;
+		uint8_t* out;
+		Line* line;		  // Line being filled
+	};
+
+	Line lines[READ_CACHE_LINES] = {};
+	uint32_t use_counter = 0;
+	uint32_t page_size = 1024; // STM32F103 default
+
+	uint32_t hits = 0;
+	uint32_t misses = 0;
+	uint32_t bytes_cached = 0;
+
+	Line* Find(uint32_t line_address);
+	Line* Victim(void);
+	static bool FetchSink(void* context, uint32_t offset, const uint8_t data[], uint32_t length);
+};
@@ -0,0 +1,109 @@
+#include <Arduino.h>
+#include "Transfer_Checkpoint.h"
+#include "Bootloader_Host.h"
+#include "Utilities.h"
+
+bool Transfer_Checkpoint::Begin(const char* hash, uint32_t address, uint32_t size) {
+	record = {};
+	record.magic = CHECKPOINT_MAGIC;
+	strncpy(record.hash, hash, IMAGE_CACHE_HASH_LEN);
+	record.address = address;
+	record.size = size;
+	return Save();
+}
+
+bool Transfer_Checkpoint::Acknowledge() {
+	record.acked_blocks++;
+	return Save();
+}
+
+bool Transfer_Checkpoint::Load() {
+	File file = LittleFS.open(CHECKPOINT_FILE, "r");
+	if (!file)
+		return false;
+
+	bool status = file.read((uint8_t*)&record, sizeof(Record)) == sizeof(Record) && record.magic == CHECKPOINT_MAGIC;
+	file.close();
+
+	record.hash[IMAGE_CACHE_HASH_LEN] = '\0';
+	return status;
+}
+
+void Transfer_Checkpoint::Clear() {
+	record = {};
+	LittleFS.remove(CHECKPOINT_FILE);
+}
+
+bool Transfer_Checkpoint::Resume(Bootloader_Host* host, Image_Cache& cache, const Memory_Map& map) {
+	uint32_t size = 0;
+	File image = cache.Open(record.hash, &size);
+	if (!image || size != record.size || map.page_size == 0) {
+		DEBUG_PRINTF("Cannot resume, image %s is not cached", record.hash);
+		return false;
+	}
+
+	/* Its first page would hold data below the image, which erasing it again would lose */
+	if ((record.address - map.flash_base) % map.page_size) {
+		DEBUG_PRINTF("Cannot resume, image at 0x%08X does not start a page", record.address);
+		image.close();
+		return false;
+	}
+
+	/* Step back from the first unacknowledged block until the resume point starts
+	   a page, so erasing it again never touches acknowledged data */
+	uint32_t offset = min(record.acked_blocks, size / BL_DATA_BLOCK_SIZE) * BL_DATA_BLOCK_SIZE;
+	while (offset && (record.address + offset - map.flash_base) % map.page_size)
+		offset -= BL_DATA_BLOCK_SIZE;
+	record.acked_blocks = offset / BL_DATA_BLOCK_SIZE;
+
+	DEBUG_PRINTF("Resuming %s at offset %lu of %lu", record.hash, offset, size);
+
+	/* Cheap check of the prefix: the block right before the resume point must match */
+	if (offset && !VerifyBlock(host, image, offset - BL_DATA_BLOCK_SIZE, BL_DATA_BLOCK_SIZE)) {
+		image.close();
+		return false;
+	}
+
+	if (offset == size) {
+		image.close();
+		Clear();
+		return true;
+	}
+
+	/* Only pages wholly inside the image are erased. A last page shared with
+	   other data is written as it was the first time, without an erase */
+	uint32_t resume_address = record.address + offset;
+	uint32_t end_address = record.address + size;
+	uint32_t first_page = (resume_address - map.flash_base) / map.page_size;
+	uint32_t end_page = (end_address - map.flash_base) / map.page_size;
+
+	bool status = Save() &&
+		(end_page <= first_page ||
+			host->SendFlashEraseCommand(map.flash_base + first_page * map.page_size, end_page - first_page)) &&
+		image.seek(offset) &&
+		host->SendMemWriteCommand(resume_address, image, size - offset, this);
+	image.close();
+
+	if (status)
+		Clear();
+	return status;
+}
+
+bool Transfer_Checkpoint::Save() {
+	File file = LittleFS.open(CHECKPOINT_FILE, "w");
+	if (!file)
+		return false;
+
+	bool status = file.write((uint8_t*)&record, sizeof(Record)) == sizeof(Record);
+	file.close();
+	return status;
+}
+
+bool Transfer_Checkpoint::VerifyBlock(Bootloader_Host* host, File& image, uint32_t offset, uint32_t length) {
+	bool status = image.seek(offset) &&
+		host->SendMemVerifyCommand(record.address + offset, length, image, nullptr);
+
+	if (!status)
+		DEBUG_PRINTF("Written prefix does not match the image at offset %lu", offset);
+	return status;
+}
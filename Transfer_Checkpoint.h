@@ -0,0 +1,83 @@
+#pragma once
+#include <stdint.h>
+#include <LittleFS.h>
+#include "Image_Cache.h"
+#include "Update_Planner.h"
+
+#define CHECKPOINT_FILE "/checkpoint"	 // Progress of the last interrupted transfer
+#define CHECKPOINT_MAGIC (0x43484B31UL) // "CHK1", marks a valid record
+
+class Bootloader_Host;
+
+/**
+ * @brief Persists the progress of an image transfer so it can resume after a reset or a dropped socket.
+ *
+ * The record holds the image hash, the target range and how many data
+ * blocks the target acknowledged. It is rewritten after every block and
+ * removed once the transfer completes.
+ */
+class Transfer_Checkpoint
+{
+public:
+	struct Record
+	{
+		uint32_t magic;
+		char hash[IMAGE_CACHE_HASH_LEN + 1]; // Cached image being written
+		uint32_t address;					 // Start address of the transfer
+		uint32_t size;						 // Size of the image in bytes
+		uint32_t acked_blocks;				 // Data blocks acknowledged by the target
+	};
+
+	/**
+	 * @brief Starts tracking a new transfer
+	 *
+	 * @param hash		Hex SHA-256 of the cached image
+	 * @param address	Start address of the transfer
+	 * @param size		The size of the image in bytes
+	 * @return true		If the record was saved
+	 * @return false	If the filesystem could not be written
+	 */
+	bool Begin(const char* hash, uint32_t address, uint32_t size);
+
+	/**
+	 * @brief Records one more acknowledged data block
+	 */
+	bool Acknowledge(void);
+
+	/**
+	 * @brief Loads the record left by an interrupted transfer
+	 *
+	 * @return true		If a transfer is pending
+	 * @return false	If there is nothing to resume
+	 */
+	bool Load(void);
+
+	/**
+	 * @brief Forgets the transfer, once it completed or can no longer be resumed
+	 */
+	void Clear(void);
+
+	/**
+	 * @brief Resumes the loaded transfer on a target
+	 * @note  The block before the resume point is read back and compared with the
+	 * 		  image, then the pages from the resume point onwards that lie wholly
+	 * 		  inside the image are erased again, as the first unacknowledged block
+	 * 		  may have been partly programmed. An image that does not start a page
+	 * 		  is not resumed.
+	 *
+	 * @param host	Host bound to the target
+	 * @param cache	Cache holding the image
+	 * @param map	Flash layout of the target
+	 * @return true		If the rest of the image was written
+	 * @return false	If the prefix does not match the image, or the transfer failed again
+	 */
+	bool Resume(Bootloader_Host* host, Image_Cache& cache, const Memory_Map& map);
+
+	const Record& GetRecord() const { return record; }
+
+private:
+	Record record = {};
+
+	bool Save(void);
+	bool VerifyBlock(Bootloader_Host* host, File& image, uint32_t offset, uint32_t length);
+};
@@ -0,0 +1,60 @@
+#include <Arduino.h>
+#include "Transfer_Progress.h"
+
+void Transfer_Progress::SetSink(Sink sink, void* context) {
+	this->sink = sink;
+	this->context = context;
+}
+
+void Transfer_Progress::Begin(Transfer_Op op, uint32_t address, uint32_t total) {
+	this->op = op;
+	this->address = address;
+	this->total = total;
+	done = 0;
+	last_done = 0;
+	start_ms = last_ms = millis();
+	start_retries = metrics.GetRetries();
+	active = true;
+}
+
+void Transfer_Progress::Advance(uint32_t bytes) {
+	if (!active)
+		return;
+
+	done += bytes;
+
+	/* Only the clock is read per block, the event is built once per interval */
+	if (sink == nullptr)
+		return;
+	uint32_t now = millis();
+	if (now - last_ms >= interval_ms)
+		Publish(now, false, true);
+}
+
+bool Transfer_Progress::End(bool status) {
+	if (active && sink)
+		Publish(millis(), true, status);
+	active = false;
+	return status;
+}
+
+void Transfer_Progress::Publish(uint32_t now, bool final, bool status) {
+	Transfer_Event event;
+	event.op = op;
+	event.final = final;
+	event.status = status;
+	event.address = address + done;
+	event.done = done;
+	event.total = total;
+	event.retries = metrics.GetRetries() - start_retries;
+
+	uint32_t elapsed = now - start_ms;
+	uint32_t span = now - last_ms;
+	event.rate = span ? (uint32_t)((uint64_t)(done - last_done) * 1000 / span) : 0;
+	event.average_rate = elapsed ? (uint32_t)((uint64_t)done * 1000 / elapsed) : 0;
+	event.eta_ms = (total > done && event.average_rate) ? (uint32_t)((uint64_t)(total - done) * 1000 / event.average_rate) : 0;
+
+	last_ms = now;
+	last_done = done;
+	sink(context, event);
+}
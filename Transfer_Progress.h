@@ -0,0 +1,100 @@
+#pragma once
+#include <stdint.h>
+#include "Host_Metrics.h"
+
+#define TRANSFER_PROGRESS_INTERVAL_MS (250U) // Default least time between two events of a transfer
+
+enum class Transfer_Op : uint8_t
+{
+	Write,
+	Read
+};
+
+/**
+ * @brief Progress of a memmory write or read, as published to the sink
+ */
+struct Transfer_Event
+{
+	Transfer_Op op;
+	bool final;			  // Last event of the transfer
+	bool status;		  // Outcome of the transfer, final events only
+	uint32_t address;	  // Next address to transfer
+	uint32_t done;		  // Bytes acknowledged so far
+	uint32_t total;		  // Bytes of the transfer, 0 if unknown
+	uint32_t rate;		  // Bytes per second since the previous event
+	uint32_t average_rate; // Bytes per second since the start
+	uint32_t retries;	  // Blocks resent or re-requested so far
+	uint32_t eta_ms;	  // Estimated time left at the average rate, 0 if unknown
+};
+
+/**
+ * @brief Rate-limited progress events of the host's memmory transfers.
+ *
+ * The host reports every acknowledged block, which only adds it up. An
+ * event goes to the sink once at least the interval passed since the
+ * previous one, so however small the blocks a transfer publishes a bounded
+ * number of events. Every transfer ends with a final event, however short.
+ */
+class Transfer_Progress
+{
+public:
+	/**
+	 * @brief Consumer of the events, called from within the transfer
+	 * @note  Must not use the host, and should return quickly
+	 */
+	typedef void (*Sink)(void* context, const Transfer_Event& event);
+
+	explicit Transfer_Progress(const Host_Metrics& metrics) : metrics(metrics) {}
+
+	/**
+	 * @brief Sets where events go, nullptr stops them
+	 */
+	void SetSink(Sink sink, void* context);
+
+	void SetInterval(uint32_t ms) { interval_ms = ms; }
+	uint32_t GetInterval() const { return interval_ms; }
+
+	/**
+	 * @brief Starts a transfer, ending any that is still running without an event
+	 *
+	 * @param op		Whether it writes or reads
+	 * @param address	The start address
+	 * @param total		Bytes it will transfer, 0 if unknown
+	 */
+	void Begin(Transfer_Op op, uint32_t address, uint32_t total);
+
+	/**
+	 * @brief Counts an acknowledged block, publishing an event when one is due
+	 *
+	 * @param bytes	The size of the block
+	 */
+	void Advance(uint32_t bytes);
+
+	/**
+	 * @brief Ends the transfer
+	 *
+	 * @param status	Whether it succeeded
+	 * @return status, so a transfer can end in its return statement
+	 */
+	bool End(bool status);
+
+	bool Active() const { return active; }
+
+private:
+	const Host_Metrics& metrics;
+	Sink sink = nullptr;
+	void* context = nullptr;
+	uint32_t interval_ms = TRANSFER_PROGRESS_INTERVAL_MS;
+
+	bool active = false;
+	Transfer_Op op = Transfer_Op::Write;
+	uint32_t address = 0;
+	uint32_t total = 0;
+	uint32_t done = 0;
+	uint32_t start_ms = 0;
+	uint32_t start_retries = 0;
+	uint32_t last_ms = 0;	  // Time of the previous event, or the start
+	uint32_t last_done = 0;	  // Bytes done at that time
+
+	void Publish(uint32_t now, bool final, bool status);
+};
@@ -0,0 +1,262 @@
+#include <Arduino.h>
+#include "Update_Job.h"
+#include "Utilities.h"
+
+bool Update_Job::Run(Bootloader_Host* host, Image_Cache& cache) {
+	this->host = host;
+
+	uint32_t size = 0;
+	File image = cache.Open(spec.hash, &size);
+	if (!image) {
+		DEBUG_PRINTF("Image %s is not cached", spec.hash);
+		return Fail(Stage::Plan);
+	}
+
+	bool status = RunPlan(image, size) && RunErase() && RunWrite(image, size) && RunVerify(image, size);
+	image.close();
+	if (!status)
+		return false;
+
+	Report(Stage::Finish, 0, 1);
+	if (spec.finish == Update_Job_Spec::Finish::Jump) {
+		/* A binary image is written as is, so by default its own hash is expected */
+		const char* expected = spec.expected_digest[0] ? spec.expected_digest :
+			spec.format == Image_Parser::Format::Binary ? spec.hash : nullptr;
+		if (expected && !host->write_digest.Matches(expected)) {
+			DEBUG_PRINTLN(F("Written data does not match the expected digest, not jumping"));
+			return Fail(Stage::Finish);
+		}
+		if (!host->SendJumpToAppCommand())
+			return Fail(Stage::Finish);
+	}
+
+	Report(Stage::Done, 1, 1);
+	return true;
+}
+
+bool Update_Job::RunPlan(File& image, uint32_t size) {
+	Report(Stage::Plan, 0, 1);
+
+	if (!ForEachSegment(image, size, Update_Planner::Sink, &planner) || !planner.Build())
+		return Fail(Stage::Plan);
+
+	planner.Print();
+	return true;
+}
+
+bool Update_Job::RunErase() {
+	if (spec.erase == Update_Job_Spec::Erase::None)
+		return true;
+
+	Erase_Scheduler eraser(spec.map);
+	bool planned;
+	if (spec.erase == Update_Job_Spec::Erase::Full) {
+		if (spec.map.protected_count) {
+			DEBUG_PRINTLN(F("Refusing a full erase with protected regions"));
+			return Fail(Stage::Erase);
+		}
+		planned = eraser.Add(spec.map.flash_base, spec.map.flash_size / spec.map.page_size);
+	}
+	else {
+		planned = eraser.AddPlan(planner);
+	}
+
+	if (!planned || !eraser.Build())
+		return Fail(Stage::Erase);
+	eraser.Print();
+
+	Report(Stage::Erase, 0, eraser.GetPageCount());
+	bool status = eraser.Execute(host, EraseProgress, this);
+
+	mass_erase = eraser.IsMassErase();
+	erase_estimated_ms = eraser.EstimateMillis();
+	erase_actual_ms = eraser.GetActualMillis();
+
+	if (!status)
+		return Fail(Stage::Erase);
+	return true;
+}
+
+bool Update_Job::RunWrite(File& image, uint32_t size) {
+	total = 0;
+	for (uint8_t i = planner.GetEraseCount(); i < planner.GetStepCount(); i++)
+		total += planner.GetStep(i).count;
+
+	stage = Stage::Write;
+	done = 0;
+	next_report = 0;
+	Report(Stage::Write, 0, total);
+
+	host->write_digest.Begin();
+	writer = new Image_Writer(host, spec.verify == Update_Job_Spec::Verify::Interleaved);
+	bool status = ForEachSegment(image, size, WriteSink, this) && writer->Finish();
+	mismatch = writer->HasMismatch();
+	mismatch_address = writer->GetMismatchAddress();
+	delete writer;
+	writer = nullptr;
+
+	if (mismatch)
+		return Fail(Stage::Verify);
+	if (!status)
+		return Fail(Stage::Write);
+
+	Report(Stage::Write, total, total);
+	return true;
+}
+
+bool Update_Job::RunVerify(File& image, uint32_t size) {
+	if (spec.verify != Update_Job_Spec::Verify::Readback)
+		return true;
+
+	stage = Stage::Verify;
+	done = 0;
+	next_report = 0;
+	Report(Stage::Verify, 0, total);
+
+	/* A binary image is read back in one go and compared with the file as the packets arrive */
+	if (spec.format == Image_Parser::Format::Binary) {
+		verify_image = &image;
+		image.seek(0);
+		bool status = host->SendMemReadCommand(spec.address, size, ReadbackSink, this);
+		verify_image = nullptr;
+		if (!status)
+			return Fail(Stage::Verify);
+	}
+	else if (!VerifyExtents(image, size))
+		return Fail(Stage::Verify);
+
+	Report(Stage::Verify, total, total);
+	return true;
+}
+
+bool Update_Job::VerifyExtents(File& image, uint32_t size) {
+	/* Records of a parsed image are small and in any order. They are laid out in a
+	   file extent by extent first, so each extent of the plan is read back in one go */
+	File expected = LittleFS.open(UPDATE_JOB_VERIFY_FILE, "w+");
+	if (!expected)
+		return false;
+
+	verify_image = &expected;
+	bool status = ForEachSegment(image, size, LayoutSink, this);
+	verify_image = nullptr;
+
+	uint32_t offset = 0;
+	for (uint8_t i = planner.GetEraseCount(); status && i < planner.GetStepCount(); i++) {
+		const Update_Planner::Step& step = planner.GetStep(i);
+
+		/* Left past the extent unless a byte differs */
+		uint32_t differs_at = step.address + step.count;
+		status = expected.seek(offset) && host->SendMemVerifyCommand(step.address, step.count, expected, &differs_at);
+		if (differs_at < step.address + step.count) {
+			mismatch = true;
+			mismatch_address = differs_at;
+		}
+
+		offset += step.count;
+		Advance(step.count);
+	}
+
+	expected.close();
+	LittleFS.remove(UPDATE_JOB_VERIFY_FILE);
+	return status;
+}
+
+bool Update_Job::Fail(Stage stage) {
+	DEBUG_PRINTF("Update job failed at %s", StageName(stage));
+	failed_stage = stage;
+	Report(Stage::Failed, 0, 0);
+	return false;
+}
+
+bool Update_Job::ForEachSegment(File& image, uint32_t size, Image_Parser::SegmentSink segment_sink, void* segment_context) {
+	image.seek(0);
+
+	if (spec.format != Image_Parser::Format::Binary) {
+		Image_Parser parser(segment_sink, segment_context);
+		return parser.Parse(image, spec.format);
+	}
+
+	uint8_t chunk[UPDATE_JOB_CHUNK_SIZE];
+	for (uint32_t offset = 0; offset < size; ) {
+		uint32_t length = image.read(chunk, min(UPDATE_JOB_CHUNK_SIZE, size - offset));
+		if (length == 0)
+			return false;
+		if (!segment_sink(segment_context, spec.address + offset, chunk, length))
+			return false;
+		offset += length;
+	}
+	return true;
+}
+
+void Update_Job::Report(Stage stage, uint32_t done, uint32_t total) {
+	if (sink)
+		sink(context, { stage, done, total });
+}
+
+void Update_Job::Advance(uint32_t bytes) {
+	done += bytes;
+
+	/* One report per data block is plenty for a progress bar */
+	if (done >= next_report) {
+		Report(stage, done, total);
+		next_report = done + BL_DATA_BLOCK_SIZE;
+	}
+}
+
+void Update_Job::EraseProgress(void* context, uint32_t pages_done, uint32_t pages_total) {
+	static_cast<Update_Job*>(context)->Report(Stage::Erase, pages_done, pages_total);
+}
+
+bool Update_Job::WriteSink(void* context, uint32_t address, const uint8_t data[], uint32_t length) {
+	Update_Job* job = static_cast<Update_Job*>(context);
+	if (!job->writer->Write(address, data, length))
+		return false;
+
+	job->Advance(length);
+	return true;
+}
+
+bool Update_Job::LayoutSink(void* context, uint32_t address, const uint8_t data[], uint32_t length) {
+	Update_Job* job = static_cast<Update_Job*>(context);
+
+	/* Extents merge every record they touch, so a record lies within a single one */
+	uint32_t offset = 0;
+	for (uint8_t i = job->planner.GetEraseCount(); i < job->planner.GetStepCount(); i++) {
+		const Update_Planner::Step& step = job->planner.GetStep(i);
+		if (address >= step.address && address - step.address + length <= step.count) {
+			return job->verify_image->seek(offset + address - step.address) &&
+				job->verify_image->write(data, length) == length;
+		}
+		offset += step.count;
+	}
+	return false;
+}
+
+bool Update_Job::ReadbackSink(void* context, uint32_t offset, const uint8_t data[], uint32_t length) {
+	Update_Job* job = static_cast<Update_Job*>(context);
+	uint8_t chunk[64];
+
+	for (uint32_t done = 0; done < length; ) {
+		uint32_t count = min<uint32_t>(sizeof(chunk), length - done);
+		if (job->verify_image->read(chunk, count) != count)
+			return false;
+
+		for (uint32_t i = 0; i < count; i++) {
+			if (data[done + i] != chunk[i]) {
+				job->mismatch = true;
+				job->mismatch_address = job->spec.address + offset + done + i;
+				DEBUG_PRINTF("Verify mismatch at 0x%08X", job->mismatch_address);
+				return false;
+			}
+		}
+		done += count;
+	}
+
+	job->Advance(length);
+	return true;
+}
+
+const char* Update_Job::StageName(Stage stage) {
+	static const char* names[] = { "plan", "erase", "write", "verify", "finish", "done", "failed" };
+	return names[(uint8_t)stage];
+}
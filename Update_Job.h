@@ -0,0 +1,143 @@
+#pragma once
+#include <stdint.h>
+#include "Bootloader_Host.h"
+#include "Image_Cache.h"
+#include "Image_Parser.h"
+#include "Image_Writer.h"
+#include "Update_Planner.h"
+#include "Erase_Scheduler.h"
+
+#define UPDATE_JOB_CHUNK_SIZE (256U) // Bytes of a binary image handled per step
+#define UPDATE_JOB_VERIFY_FILE "/verify" // Written extents of a parsed image, laid out back to back for the readback
+
+/**
+ * @brief Everything needed to update a board, decided up front by the client
+ */
+struct Update_Job_Spec
+{
+	enum class Erase
+	{
+		None,	 // Pages are already blank
+		Planned, // Only the pages the image covers
+		Full	 // The whole flash, refused when the map has protected regions
+	};
+
+	enum class Verify
+	{
+		None,
+		Readback,	// Read every written byte back and compare it with the image
+		Interleaved // Read every block back right after writing it, before the next one
+	};
+
+	enum class Finish
+	{
+		Stay,
+		Jump
+	};
+
+	char hash[IMAGE_CACHE_HASH_LEN + 1] = { 0 }; // Cached image to write
+	Image_Parser::Format format = Image_Parser::Format::Binary;
+	uint32_t address = 0; // Load address of a binary image
+	Memory_Map map;
+	Erase erase = Erase::Planned;
+	Verify verify = Verify::None;
+	Finish finish = Finish::Stay;
+	char expected_digest[IMAGE_DIGEST_HEX_LEN + 1] = { 0 }; // SHA-256 the written data must have before a jump, optional
+};
+
+/**
+ * @brief Runs a whole update from a single request: plan, erase, write, verify, then jump or stay.
+ *
+ * The job runs to completion on the host without waiting for the client
+ * between stages, reporting its progress through a callback as it goes.
+ */
+class Update_Job
+{
+public:
+	enum class Stage
+	{
+		Plan,
+		Erase,
+		Write,
+		Verify,
+		Finish,
+		Done,
+		Failed
+	};
+
+	struct Progress
+	{
+		Stage stage;
+		uint32_t done;	// Pages erased or bytes written/verified so far
+		uint32_t total; // Pages or bytes in the stage
+	};
+
+	typedef void (*ProgressSink)(void* context, const Progress& progress);
+
+	Update_Job(const Update_Job_Spec& spec, ProgressSink sink, void* context)
+		: spec(spec), sink(sink), context(context), planner(spec.map) {}
+
+	/**
+	 * @brief Runs the job on a target
+	 *
+	 * @param host	Host bound to the target
+	 * @param cache	Cache holding the image
+	 * @return true		If every stage succeeded
+	 * @return false	On the first failed stage, see GetFailedStage
+	 */
+	bool Run(Bootloader_Host* host, Image_Cache& cache);
+
+	Stage GetFailedStage() const { return failed_stage; }
+	const Update_Planner& GetPlanner() const { return planner; }
+	bool HasMismatch() const { return mismatch; }
+	uint32_t GetMismatchAddress() const { return mismatch_address; }
+	bool UsedMassErase() const { return mass_erase; }
+	uint32_t GetEraseEstimatedMillis() const { return erase_estimated_ms; }
+	uint32_t GetEraseActualMillis() const { return erase_actual_ms; }
+
+	static const char* StageName(Stage stage);
+
+private:
+	Update_Job_Spec spec;
+	ProgressSink sink;
+	void* context;
+	Update_Planner planner;
+
+	Bootloader_Host* host = nullptr;
+	Stage failed_stage = Stage::Done;
+	Stage stage = Stage::Plan;
+	uint32_t done = 0;
+	uint32_t total = 0;
+	uint32_t next_report = 0;
+	Image_Writer* writer = nullptr; // Writer of the write stage
+	File* verify_image = nullptr;	// Image a binary readback is compared with, or the extents of a parsed one
+	bool mismatch = false;
+	uint32_t mismatch_address = 0;
+	bool mass_erase = false;
+	uint32_t erase_estimated_ms = 0;
+	uint32_t erase_actual_ms = 0;
+
+	bool RunPlan(File& image, uint32_t size);
+	bool RunErase(void);
+	bool RunWrite(File& image, uint32_t size);
+	bool RunVerify(File& image, uint32_t size);
+
+	/**
+	 * @brief Reads every written extent of a parsed image back with one read each
+	 */
+	bool VerifyExtents(File& image, uint32_t size);
+	bool Fail(Stage stage);
+
+	/**
+	 * @brief Feeds every segment of the image to a sink, reading binary images in chunks
+	 */
+	bool ForEachSegment(File& image, uint32_t size, Image_Parser::SegmentSink segment_sink, void* segment_context);
+
+	void Report(Stage stage, uint32_t done, uint32_t total);
+	void Advance(uint32_t bytes);
+
+	static void EraseProgress(void* context, uint32_t pages_done, uint32_t pages_total);
+	static bool WriteSink(void* context, uint32_t address, const uint8_t data[], uint32_t length);
+	static bool LayoutSink(void* context, uint32_t address, const uint8_t data[], uint32_t length);
+	static bool ReadbackSink(void* context, uint32_t offset, const uint8_t data[], uint32_t length);
+};
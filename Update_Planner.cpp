@@ -0,0 +1,180 @@
+#include <Arduino.h>
+#include "Update_Planner.h"
+#include "Image_Writer.h"
+#include "Erase_Scheduler.h"
+#include "Utilities.h"
+
+bool Memory_Map::AddProtected(uint32_t address, uint32_t length) {
+	if (protected_count >= PLANNER_MAX_PROTECTED)
+		return false;
+
+	protected_regions[protected_count].address = address;
+	protected_regions[protected_count].length = length;
+	protected_count++;
+	return true;
+}
+
+bool Update_Planner::AddSegment(uint32_t address, uint32_t length) {
+	if (length == 0)
+		return true;
+
+	/* Fast path: parsers emit data in ascending order */
+	if (extent_count && extents[extent_count - 1].address + extents[extent_count - 1].length == address) {
+		extents[extent_count - 1].length += length;
+		return true;
+	}
+
+	uint32_t start = address;
+	uint32_t end = address + length;
+	Memory_Map::Region merged[PLANNER_MAX_EXTENTS + 1];
+	uint8_t count = 0;
+	bool inserted = false;
+
+	for (uint8_t i = 0; i < extent_count; i++) {
+		uint32_t extent_end = extents[i].address + extents[i].length;
+
+		/* Absorb anything overlapping or touching the new extent */
+		if (extent_end >= start && extents[i].address <= end) {
+			start = min(start, extents[i].address);
+			end = max(end, extent_end);
+			continue;
+		}
+
+		if (!inserted && extents[i].address > end) {
+			merged[count++] = { start, end - start };
+			inserted = true;
+		}
+		merged[count++] = extents[i];
+	}
+
+	if (!inserted)
+		merged[count++] = { start, end - start };
+
+	if (count > PLANNER_MAX_EXTENTS) {
+		overflow = true;
+		return false;
+	}
+
+	memcpy(extents, merged, count * sizeof(Memory_Map::Region));
+	extent_count = count;
+	return true;
+}
+
+bool Update_Planner::Sink(void* context, uint32_t address, const uint8_t /* data */[], uint32_t length) {
+	return static_cast<Update_Planner*>(context)->AddSegment(address, length);
+}
+
+bool Update_Planner::Build() {
+	step_count = 0;
+	erase_count = 0;
+
+	if (overflow || extent_count == 0 || map.page_size == 0)
+		return false;
+
+	uint32_t flash_end = map.flash_base + map.flash_size;
+
+	/* Page ranges covering each extent, merged when they touch */
+	uint32_t first_page = 0;
+	uint32_t last_page = 0;
+	bool open_range = false;
+
+	for (uint8_t i = 0; i < extent_count; i++) {
+		const Memory_Map::Region& extent = extents[i];
+		if (extent.address < map.flash_base || extent.address + extent.length > flash_end) {
+			DEBUG_PRINTF("Extent 0x%08X is outside flash", extent.address);
+			return false;
+		}
+
+		uint32_t first = (extent.address - map.flash_base) / map.page_size;
+		uint32_t last = (extent.address + extent.length - 1 - map.flash_base) / map.page_size;
+
+		if (open_range && first <= last_page + 1) {
+			last_page = max(last_page, last);
+			continue;
+		}
+
+		if (open_range)
+			steps[step_count++] = { StepType::Erase, map.flash_base + first_page * map.page_size, last_page - first_page + 1 };
+
+		first_page = first;
+		last_page = last;
+		open_range = true;
+	}
+	steps[step_count++] = { StepType::Erase, map.flash_base + first_page * map.page_size, last_page - first_page + 1 };
+	erase_count = step_count;
+
+	/* Erasing works on whole pages, so check the pages rather than the extents */
+	for (uint8_t i = 0; i < erase_count; i++) {
+		if (OverlapsProtected(steps[i].address, steps[i].count * map.page_size)) {
+			DEBUG_PRINTF("Erase at 0x%08X overlaps a protected region", steps[i].address);
+			step_count = 0;
+			erase_count = 0;
+			return false;
+		}
+	}
+
+	for (uint8_t i = 0; i < extent_count; i++)
+		steps[step_count++] = { StepType::Write, extents[i].address, extents[i].length };
+
+	return true;
+}
+
+bool Update_Planner::Execute(Bootloader_Host* host, File& image, Image_Parser::Format format) {
+	if (step_count == 0)
+		return false;
+
+	Erase_Scheduler eraser(map);
+	if (!eraser.AddPlan(*this) || !eraser.Build() || !eraser.Execute(host))
+		return false;
+
+	image.seek(0);
+
+	if (format == Image_Parser::Format::Binary)
+		return host->SendMemWriteCommand(steps[erase_count].address, image, steps[erase_count].count);
+
+	/* The writer issues one MEM_WRITE per contiguous run, matching the planned writes */
+	Image_Writer* writer = new Image_Writer(host);
+	Image_Parser parser(Image_Writer::Sink, writer);
+	bool status = parser.Parse(image, format) && writer->Finish();
+	delete writer;
+
+	return status;
+}
+
+uint32_t Update_Planner::EstimateMillis() const {
+	const uint32_t packet_overhead = sizeof(BL_DATA_PACKET_CMD) - BL_DATA_BLOCK_SIZE + sizeof(BL_ACK);
+	uint64_t wire_bytes = 0;
+
+	/* Erases are estimated the way they will run, which may be a mass erase */
+	Erase_Scheduler eraser(map);
+	uint32_t erase_ms = (eraser.AddPlan(*this) && eraser.Build()) ? eraser.EstimateMillis() : 0;
+
+	for (uint8_t i = erase_count; i < step_count; i++) {
+		uint32_t blocks = (steps[i].count + BL_DATA_BLOCK_SIZE - 1) / BL_DATA_BLOCK_SIZE;
+		wire_bytes += sizeof(BL_MEM_WRITE_CMD) + sizeof(BL_ACK) + blocks * packet_overhead + steps[i].count;
+	}
+
+	/* 8N1 framing: 10 bits per byte */
+	return (uint32_t)(wire_bytes * 10 * 1000 / map.baud_rate) + erase_ms;
+}
+
+void Update_Planner::Print() const {
+	for (uint8_t i = 0; i < step_count; i++) {
+		if (steps[i].type == StepType::Erase) {
+			DEBUG_PRINTF("%d: ERASE 0x%08X, %lu pages", i, steps[i].address, steps[i].count);
+		}
+		else {
+			DEBUG_PRINTF("%d: WRITE 0x%08X, %lu bytes", i, steps[i].address, steps[i].count);
+		}
+	}
+	DEBUG_PRINTF("Estimated time = %lu ms at %lu baud", EstimateMillis(), map.baud_rate);
+}
+
+bool Update_Planner::OverlapsProtected(uint32_t address, uint32_t length) const {
+	for (uint8_t i = 0; i < map.protected_count; i++) {
+		const Memory_Map::Region& region = map.protected_regions[i];
+		if (address < region.address + region.length && region.address < address + length)
+			return true;
+	}
+	return false;
+}
@@ -0,0 +1,123 @@
+#pragma once
+#include <stdint.h>
+#include "Bootloader_Host.h"
+#include "Image_Parser.h"
+
+#define PLANNER_MAX_EXTENTS (16U)	// Maximum number of disjoint image extents
+#define PLANNER_MAX_PROTECTED (4U)	// Maximum number of protected regions
+#define PLANNER_MAX_STEPS (2U * PLANNER_MAX_EXTENTS)
+
+/**
+ * @brief Flash layout of a target
+ */
+struct Memory_Map
+{
+	struct Region
+	{
+		uint32_t address;
+		uint32_t length;
+	};
+
+	uint32_t flash_base = 0x08000000;	// STM32F103 defaults
+	uint32_t flash_size = 64UL * 1024UL;
+	uint32_t page_size = 1024;
+	uint32_t page_erase_ms = 20;		// Typical time to erase one page
+	uint32_t mass_erase_ms = 40;		// Typical time to mass erase the whole flash
+	uint8_t mass_erase_percent = 0;		// Share of the pages to erase from which a mass erase, which wipes every page, is used. 0 never
+	uint32_t baud_rate = 9600;
+	Region protected_regions[PLANNER_MAX_PROTECTED];
+	uint8_t protected_count = 0;
+
+	bool AddProtected(uint32_t address, uint32_t length);
+};
+
+/**
+ * @brief Plans the erases and writes needed to flash an image.
+ *
+ * The image extents are collected first, either directly or by running an
+ * Image_Parser into Sink. Build then derives the fewest page erases that
+ * cover them and one MEM_WRITE per contiguous extent, refusing any plan
+ * that would touch a protected region.
+ */
+class Update_Planner
+{
+public:
+	enum class StepType
+	{
+		Erase,
+		Write
+	};
+
+	struct Step
+	{
+		StepType type;
+		uint32_t address;
+		uint32_t count; // Pages for an erase, bytes for a write
+	};
+
+	explicit Update_Planner(const Memory_Map& map) : map(map) {}
+
+	/**
+	 * @brief Adds an image extent, merging it with adjacent or overlapping ones
+	 *
+	 * @param address	Load address of the data
+	 * @param length	The size of the data in bytes
+	 * @return true		If the extent was recorded
+	 * @return false	If too many disjoint extents were added
+	 */
+	bool AddSegment(uint32_t address, uint32_t length);
+
+	/**
+	 * @brief Adapter so the planner can collect extents as an Image_Parser sink
+	 */
+	static bool Sink(void* context, uint32_t address, const uint8_t data[], uint32_t length);
+
+	/**
+	 * @brief Computes the ordered plan: all erases first, then the writes in address order
+	 *
+	 * @return true		If a valid plan was built
+	 * @return false	If an extent is outside flash or its pages overlap a protected region
+	 */
+	bool Build(void);
+
+	/**
+	 * @brief Runs the plan on a target
+	 *
+	 * @param host		Host bound to the target
+	 * @param image		The image the extents were collected from
+	 * @param format	Format of the image
+	 * @return true		If every step succeeded
+	 * @return false	On the first failed step
+	 */
+	bool Execute(Bootloader_Host* host, File& image, Image_Parser::Format format);
+
+	/**
+	 * @brief Estimates the time spent on the serial link and erasing pages
+	 *
+	 * @return uint32_t Estimated time in milliseconds
+	 */
+	uint32_t EstimateMillis(void) const;
+
+	/**
+	 * @brief Prints the plan and its estimated time (dry run)
+	 */
+	void Print(void) const;
+
+	uint8_t GetStepCount() const { return step_count; }
+	const Step& GetStep(uint8_t index) const { return steps[index]; }
+	uint32_t GetEraseCount() const { return erase_count; }
+	uint32_t GetWriteCount() const { return step_count - erase_count; }
+
+private:
+	Memory_Map map;
+
+	Memory_Map::Region extents[PLANNER_MAX_EXTENTS]; // Sorted, disjoint, non-adjacent
+	uint8_t extent_count = 0;
+	bool overflow = false;
+
+	Step steps[PLANNER_MAX_STEPS];
+	uint8_t step_count = 0;
+	uint8_t erase_count = 0;
+
+	bool OverlapsProtected(uint32_t address, uint32_t length) const;
+};
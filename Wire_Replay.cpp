@@ -0,0 +1,372 @@
+#include <LittleFS.h>
+#include "Wire_Replay.h"
+#include "Bootloader_Host.h"
+#include "Frame_Parser.h"
+#include "Packet_View.h"
+#include "Memory_Accounting.h"
+#include "Utilities.h"
+#include "bl_utils.h"
+
+typedef BL_Layout::Header Header;
+typedef BL_Layout::DataPacket DataPacket;
+
+#define REPLAY_SYNC_BYTE (0xA5U) // Sent by a new host until the target echoes it
+#define REPLAY_MAX_FRAME (max<uint32_t>(sizeof(BL_DATA_PACKET_CMD), BL_BATCH_MAX_SIZE)) // Largest frame a host sends
+
+Wire_Replay::~Wire_Replay() {
+	Free();
+}
+
+void Wire_Replay::Free() {
+	free(tx);
+	free(rx);
+	free(bursts);
+	tx = nullptr;
+	rx = nullptr;
+	bursts = nullptr;
+	memory_accounting.Untrack(Memory_Category::Trace, allocated);
+	allocated = 0;
+}
+
+bool Wire_Replay::Load(const char* path) {
+	Free();
+
+	File file = LittleFS.open(path, "r");
+	if (!file)
+		return false;
+
+	uint32_t header[3] = { 0 };
+	if (file.read((uint8_t*)header, sizeof(header)) != sizeof(header) || header[0] != WIRE_TRACE_MAGIC ||
+		header[1] > WIRE_TRACE_CAPACITY) {
+		file.close();
+		return false;
+	}
+
+	uint32_t size = header[1];
+	dropped = header[2];
+	uint8_t* records = (uint8_t*)malloc(size);
+	if (records == nullptr) {
+		file.close();
+		return false;
+	}
+	Tracked_Allocation tracked_records(Memory_Category::Trace, size);
+	bool status = file.read(records, size) == size;
+	file.close();
+
+	/* First pass sizes the streams */
+	Wire_Trace::Record record;
+	uint32_t position = 0;
+	tx_size = rx_size = burst_count = 0;
+	while (status && Wire_Trace::ParseRecord(records, size, &position, &record)) {
+		if (record.rx) {
+			rx_size += record.length;
+			burst_count++;
+		}
+		else {
+			tx_size += record.length;
+		}
+	}
+
+	allocated = tx_size + rx_size + burst_count * sizeof(Burst);
+	tx = (uint8_t*)malloc(tx_size + 1);
+	rx = (uint8_t*)malloc(rx_size + 1);
+	bursts = (Burst*)malloc(burst_count * sizeof(Burst) + 1);
+	memory_accounting.Track(Memory_Category::Trace, allocated);
+	status = status && tx && rx && bursts;
+
+	/* Second pass splits them, the pauses are measured between records */
+	memset(&report, 0, sizeof(report));
+	position = 0;
+	uint32_t tx_fill = 0, rx_fill = 0, count = 0;
+	for (bool first = true; status && Wire_Trace::ParseRecord(records, size, &position, &record); first = false) {
+		uint32_t delta = first ? 0 : record.delta_us;
+		report.recorded_us += delta;
+		if (delta > report.recorded_stall_us) {
+			report.recorded_stall_us = delta;
+			report.recorded_stall_offset = tx_fill;
+		}
+
+		if (record.rx) {
+			memcpy(&rx[rx_fill], &records[record.data], record.length);
+			rx_fill += record.length;
+			bursts[count++] = { tx_fill, rx_fill, delta };
+		}
+		else {
+			memcpy(&tx[tx_fill], &records[record.data], record.length);
+			tx_fill += record.length;
+		}
+	}
+
+	free(records);
+	if (!status)
+		Free();
+
+	DEBUG_PRINTF("Trace of %lu host bytes, %lu target bytes in %lu bursts", tx_size, rx_size, burst_count);
+	return status;
+}
+
+bool Wire_Replay::Run(bool timed) {
+	if (tx == nullptr)
+		return false;
+
+	Report recorded = report;
+	report = {};
+	report.first_mismatch = UINT32_MAX;
+	report.recorded_us = recorded.recorded_us;
+	report.recorded_stall_us = recorded.recorded_stall_us;
+	report.recorded_stall_offset = recorded.recorded_stall_offset;
+
+	this->timed = timed;
+	tx_sent = rx_read = rx_due = next_burst = 0;
+	eligible = false;
+	syncing = true;
+	sync_echo = false;
+
+	/* The host enters command mode as it starts, which is where the replay starts too */
+	uint32_t position = 0, size = 0;
+	for (uint32_t from = 0; ; from = position + 1) {
+		if (!NextFrame(from, &position, &size)) {
+			DEBUG_PRINTLN("Trace has no ENTER_CMD_MODE to replay from");
+			return false;
+		}
+		if (Packet_View<Header>(&tx[position], size).Get<Header::CmdId>() == BL_ENTER_CMD_MODE_CMD_ID)
+			break;
+	}
+	Skip(position);
+
+	release_us = event_us = eligible_us = micros();
+	Bootloader_Host* host = new Bootloader_Host(*this);
+
+	/* A trace that never answers the sync byte fails here instead of hanging the replay */
+	if (!host->Begin(BL_SYNC_TIMEOUT_MS)) {
+		report.failed++;
+		delete host;
+		return false;
+	}
+
+	/* Synchronization and the host's start-up delays are not part of the trace */
+	uint32_t start = micros();
+	event_us = start;
+	report.replay_stall_us = 0;
+
+	while (NextFrame(tx_sent, &position, &size)) {
+		/* Host bytes the replay does not produce, such as ACKs of a read it skipped */
+		if (position > tx_sent)
+			Skip(position);
+
+		bool status = false;
+		if (Dispatch(host, &tx[position], &status)) {
+			report.commands++;
+			if (!status)
+				report.failed++;
+		}
+		else {
+			report.skipped++;
+		}
+
+		/* Never stall on a command the host did not send */
+		if (tx_sent <= position)
+			Skip(position + size);
+	}
+
+	report.replay_us = micros() - start;
+	delete host;
+
+	DEBUG_PRINTF("Replayed %lu commands in %lu us (recorded %lu us), %lu failed, %lu bytes differ",
+		report.commands, report.replay_us, report.recorded_us, report.failed, report.mismatched_bytes);
+	return report.skipped == 0 && report.failed == 0 && report.mismatched_bytes == 0 && report.unscripted_bytes == 0;
+}
+
+bool Wire_Replay::Dispatch(Bootloader_Host* host, uint8_t* frame, bool* status) {
+	Packet_View<Header> header(frame, Header::size);
+
+	/* The CRC only shows the frame is what was recorded, a corrupt or crafted trace
+	   still must not make the replay read past the frame or overflow a command */
+	uint32_t size = header.Get<Header::PayloadSize>();
+
+	switch (header.Get<Header::CmdId>()) {
+	case BL_VER_CMD_ID:
+		*status = host->SendVersionCommand() != 0;
+		return true;
+	case BL_ENTER_CMD_MODE_CMD_ID:
+		*status = host->SendEnterCmdModeCommand();
+		return true;
+	case BL_JUMP_TO_APP_CMD_ID:
+		*status = host->SendJumpToAppCommand();
+		return true;
+	case BL_FLASH_ERASE_CMD_ID:
+	{
+		if (size < sizeof(BL_FLASH_ERASE_CMD))
+			return false;
+		uint32_t address = bl_load_le<uint32_t>(frame + offsetof(BL_FLASH_ERASE_CMD, data.address));
+		uint32_t count = bl_load_le<uint32_t>(frame + offsetof(BL_FLASH_ERASE_CMD, data.page_count));
+		if (address == BL_FLASH_ERASE_MASS && count == BL_FLASH_ERASE_MASS)
+			*status = host->SendMassEraseCommand();
+		else
+			*status = host->SendFlashEraseCommand(address, count);
+		return true;
+	}
+	case BL_FEC_CMD_ID:
+		if (size < sizeof(BL_FEC_CMD))
+			return false;
+		*status = host->SendFecCommand(bl_load_le<uint32_t>(frame + offsetof(BL_FEC_CMD, data.segment_size)) != 0);
+		return true;
+	case BL_MEM_WRITE_CMD_ID:
+		if (size < sizeof(BL_MEM_WRITE_CMD))
+			return false;
+		*status = host->BeginMemWrite(bl_load_le<uint32_t>(frame + offsetof(BL_MEM_WRITE_CMD, data.start_address)));
+		return true;
+	case BL_DATA_PACKET_CMD_ID:
+	{
+		/* Resends of the block on NACK are the host's own and are matched as it makes them */
+		if (size < DataPacket::data_offset)
+			return false;
+		Packet_View<DataPacket> packet(frame, size);
+		uint32_t length = packet.Get<DataPacket::DataLen>();
+		uint32_t next = packet.Get<DataPacket::NextLen>();
+		if (length > size - DataPacket::data_offset)
+			return false;
+		*status = host->SendDataBlock(frame + DataPacket::data_offset, length,
+			next ? next - DataPacket::data_offset : 0, packet.Get<DataPacket::EndFlag>());
+		return true;
+	}
+	case BL_MEM_READ_CMD_ID:
+	{
+		/* A streaming read is recorded as MEM_READ_STREAM, which shares the command ID */
+		if (size < sizeof(BL_MEM_READ_CMD))
+			return false;
+		uint32_t address = bl_load_le<uint32_t>(frame + offsetof(BL_MEM_READ_CMD, data.start_addr));
+		uint32_t length = bl_load_le<uint32_t>(frame + offsetof(BL_MEM_READ_CMD, data.length));
+		uint8_t window = size == sizeof(BL_MEM_READ_STREAM_CMD) ?
+			frame[offsetof(BL_MEM_READ_STREAM_CMD, data.window)] : 1;
+		*status = host->SendMemReadCommand(address, length, DiscardSink, nullptr, window);
+		return true;
+	}
+	case BL_BATCH_CMD_ID:
+	{
+		if (size > sizeof(BL_BATCH_CMD))
+			return false;
+		BL_BATCH_CMD cmd;
+		BL_BATCH_RESULT results[BL_BATCH_MAX_COMMANDS];
+		uint8_t result_count = 0;
+		memcpy(cmd.serialized_data, frame, size);
+		*status = host->SendBatchCommand(cmd, results, &result_count);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+bool Wire_Replay::DiscardSink(void*, uint32_t, const uint8_t[], uint32_t) {
+	return true;
+}
+
+bool Wire_Replay::NextFrame(uint32_t from, uint32_t* position, uint32_t* size) {
+	for (uint32_t p = from; p + Header::size <= tx_size; p++) {
+		if (!Frame_Parser::ValidHeader(&tx[p], min<uint32_t>(REPLAY_MAX_FRAME, tx_size - p)))
+			continue;
+
+		Packet_View<Header> header(&tx[p], Header::size);
+		if (bl_calculate_command_crc(&tx[p], header.Get<Header::PayloadSize>()) != header.Get<Header::Crc>())
+			continue;
+
+		*position = p;
+		*size = header.Get<Header::PayloadSize>();
+		return true;
+	}
+	return false;
+}
+
+void Wire_Replay::Skip(uint32_t tx_offset) {
+	if (tx_offset > tx_sent)
+		tx_sent = min(tx_offset, tx_size);
+
+	/* Replies to the skipped bytes will never be asked for */
+	while (next_burst < burst_count && bursts[next_burst].tx_before <= tx_offset)
+		rx_due = bursts[next_burst++].rx_end;
+	rx_read = rx_due;
+	eligible = false;
+}
+
+void Wire_Replay::Release() {
+	uint32_t now = micros();
+
+	while (next_burst < burst_count && tx_sent >= bursts[next_burst].tx_before) {
+		if (!eligible) {
+			eligible = true;
+			eligible_us = now;
+		}
+
+		/* The delay runs from the later of the host's request and the previous burst */
+		uint32_t base = (int32_t)(release_us - eligible_us) > 0 ? release_us : eligible_us;
+		if (timed && now - base < bursts[next_burst].delay_us)
+			return;
+
+		rx_due = bursts[next_burst++].rx_end;
+		release_us = now;
+		eligible = false;
+		Event(now);
+	}
+}
+
+void Wire_Replay::Event(uint32_t now) {
+	if (now - event_us > report.replay_stall_us) {
+		report.replay_stall_us = now - event_us;
+		report.replay_stall_offset = tx_sent;
+	}
+	event_us = now;
+}
+
+int Wire_Replay::available() {
+	if (sync_echo)
+		return 1;
+	Release();
+	return rx_due - rx_read;
+}
+
+int Wire_Replay::read() {
+	if (sync_echo) {
+		sync_echo = false;
+		return REPLAY_SYNC_BYTE;
+	}
+	Release();
+	return rx_read < rx_due ? rx[rx_read++] : -1;
+}
+
+int Wire_Replay::peek() {
+	if (sync_echo)
+		return REPLAY_SYNC_BYTE;
+	Release();
+	return rx_read < rx_due ? rx[rx_read] : -1;
+}
+
+size_t Wire_Replay::write(uint8_t byte) {
+	return write(&byte, 1);
+}
+
+size_t Wire_Replay::write(const uint8_t* buffer, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		/* The trace starts after synchronization, the new host's is answered here */
+		if (syncing && buffer[i] == REPLAY_SYNC_BYTE) {
+			sync_echo = true;
+			continue;
+		}
+		syncing = false;
+
+		if (tx_sent == tx_size) {
+			report.unscripted_bytes++;
+			continue;
+		}
+
+		if (buffer[i] != tx[tx_sent]) {
+			if (report.mismatched_bytes++ == 0)
+				report.first_mismatch = tx_sent;
+		}
+		tx_sent++;
+	}
+
+	Event(micros());
+	Release();
+	return size;
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include <Arduino.h>
+#include <stdint.h>
+#include "Wire_Trace.h"
+
+class Bootloader_Host;
+
+/**
+ * @brief Scripted target that plays a saved Wire_Trace back to a Bootloader_Host.
+ *
+ * Run() binds a fresh host to this stream and re-issues every command it
+ * finds in the recorded host traffic. Each recorded burst from the target is
+ * released once the host has sent everything that preceded it in the trace,
+ * after the recorded delay when timed, so the host sees the same replies
+ * with the same timing. The bytes the host sends are compared with the
+ * recording, which shows where a change of the host diverges from it.
+ *
+ * A trace is replayable from its first ENTER_CMD_MODE command on, which
+ * resets the session like the host's own initialization does.
+ *
+ * The replay runs on the device, against a trace saved there. There is no
+ * off-device tool and no file-backed recorder on Linux, for want of a host
+ * build of the sketch.
+ */
+class Wire_Replay : public Stream
+{
+public:
+	struct Report
+	{
+		uint32_t commands;			   // Commands re-issued
+		uint32_t skipped;			   // Recorded commands the replay cannot issue
+		uint32_t failed;			   // Re-issued commands that failed
+		uint32_t mismatched_bytes;	   // Host bytes differing from the recording
+		uint32_t first_mismatch;	   // Offset of the first in the host traffic, UINT32_MAX if none
+		uint32_t unscripted_bytes;	   // Host bytes past the end of the recording
+		uint32_t recorded_us;		   // Span of the recording
+		uint32_t replay_us;			   // Span of the replay
+		uint32_t recorded_stall_us;	   // Longest pause of the recording
+		uint32_t recorded_stall_offset; // Host bytes sent before it ended
+		uint32_t replay_stall_us;	   // Longest pause of the replay
+		uint32_t replay_stall_offset;  // Host bytes sent before it ended
+	};
+
+	~Wire_Replay();
+
+	/**
+	 * @brief Loads a saved trace
+	 *
+	 * @param path	The trace file
+	 * @return true		If the trace was read
+	 * @return false	If it is missing, invalid or does not fit in memory
+	 */
+	bool Load(const char* path = WIRE_TRACE_FILE);
+
+	/**
+	 * @brief Replays the loaded trace against a new host
+	 *
+	 * @param timed	Whether replies wait for their recorded delay, or come as soon as they are due
+	 * @return true		If every command was re-issued, succeeded and sent the recorded bytes
+	 * @return false	Otherwise, see GetReport()
+	 */
+	bool Run(bool timed = true);
+
+	const Report& GetReport() const { return report; }
+	uint32_t GetDropped() const { return dropped; }
+
+	int available() override;
+	int read() override;
+	int peek() override;
+	void flush() override {}
+	size_t write(uint8_t byte) override;
+	size_t write(const uint8_t* buffer, size_t size) override;
+
+private:
+	/* Received bytes up to rx_end are due once tx_before host bytes were sent */
+	struct Burst
+	{
+		uint32_t tx_before;
+		uint32_t rx_end;
+		uint32_t delay_us;
+	};
+
+	uint8_t* tx = nullptr; // Recorded host bytes, back to back
+	uint8_t* rx = nullptr; // Recorded target bytes, back to back
+	Burst* bursts = nullptr;
+	uint32_t tx_size = 0;
+	uint32_t rx_size = 0;
+	uint32_t burst_count = 0;
+	uint32_t allocated = 0;
+	uint32_t dropped = 0;
+
+	bool timed = true;
+	uint32_t tx_sent = 0;	  // Host bytes sent so far
+	uint32_t rx_read = 0;
+	uint32_t rx_due = 0;	  // End of the received bytes released so far
+	uint32_t next_burst = 0;
+	bool eligible = false;	  // Whether the host sent everything the next burst waits for
+	uint32_t eligible_us = 0;
+	uint32_t release_us = 0;  // When the last burst was released
+	uint32_t event_us = 0;	  // Last byte sent or burst released
+	bool syncing = true;	  // Until the host's first command
+	bool sync_echo = false;	  // A sync byte to echo is pending
+	Report report = {};
+
+	void Release(void);
+	void Event(uint32_t now);
+	void Skip(uint32_t tx_offset);
+	void Free(void);
+	bool NextFrame(uint32_t from, uint32_t* position, uint32_t* size);
+	bool Dispatch(Bootloader_Host* host, uint8_t* frame, bool* status);
+	static bool DiscardSink(void* context, uint32_t offset, const uint8_t data[], uint32_t length);
+};
@@ -0,0 +1,142 @@
+#include <LittleFS.h>
+#include "Wire_Trace.h"
+
+#define RING_MASK (WIRE_TRACE_CAPACITY - 1)
+
+static_assert(1 + 5 + WIRE_TRACE_MAX_BURST < WIRE_TRACE_CAPACITY, "a record must fit in the ring");
+
+void Wire_Trace::Start(Stream& transport) {
+	inner = &transport;
+	head = 0;
+	tail = 0;
+	records = 0;
+	dropped = 0;
+	open_length = 0;
+	last_record_us = micros();
+}
+
+Stream* Wire_Trace::Stop() {
+	Stream* transport = inner;
+	inner = nullptr;
+	open_length = 0;
+	return transport;
+}
+
+int Wire_Trace::available() {
+	return inner->available();
+}
+
+int Wire_Trace::read() {
+	int byte = inner->read();
+	if (byte >= 0) {
+		uint8_t value = (uint8_t)byte;
+		Append(true, &value, 1);
+	}
+	return byte;
+}
+
+int Wire_Trace::peek() {
+	return inner->peek();
+}
+
+void Wire_Trace::flush() {
+	inner->flush();
+}
+
+size_t Wire_Trace::write(uint8_t byte) {
+	return write(&byte, 1);
+}
+
+size_t Wire_Trace::write(const uint8_t* buffer, size_t size) {
+	size_t written = inner->write(buffer, size);
+	Append(false, buffer, written);
+	return written;
+}
+
+void Wire_Trace::Append(bool rx, const uint8_t* data, size_t length) {
+	uint32_t now = micros();
+
+	for (size_t i = 0; i < length; i++) {
+		/* A new record on a change of direction, a pause or a full burst */
+		if (open_length == 0 || open_rx != rx || open_length == WIRE_TRACE_MAX_BURST ||
+			now - last_byte_us > WIRE_TRACE_BURST_GAP_US) {
+			uint32_t delta = now - last_record_us;
+			last_record_us = now;
+
+			open_tag = head;
+			open_rx = rx;
+			open_length = 0;
+			Put(rx ? WIRE_TRACE_RX_FLAG : 0);
+			do {
+				Put((delta & 0x7F) | (delta > 0x7F ? 0x80 : 0));
+				delta >>= 7;
+			} while (delta);
+			records++;
+		}
+
+		Put(data[i]);
+		open_length++;
+		ring[open_tag & RING_MASK] = (open_rx ? WIRE_TRACE_RX_FLAG : 0) | (open_length - 1);
+		last_byte_us = now;
+	}
+}
+
+void Wire_Trace::Put(uint8_t byte) {
+	if (head - tail == WIRE_TRACE_CAPACITY)
+		DropOldest();
+	ring[head++ & RING_MASK] = byte;
+}
+
+void Wire_Trace::DropOldest() {
+	uint32_t position = tail;
+	uint8_t tag = ring[position++ & RING_MASK];
+	while (ring[position++ & RING_MASK] & 0x80);
+
+	tail = position + (tag & ~WIRE_TRACE_RX_FLAG) + 1;
+	records--;
+	dropped++;
+}
+
+bool Wire_Trace::Save(const char* path) const {
+	File file = LittleFS.open(path, "w");
+	if (!file)
+		return false;
+
+	uint32_t header[3] = { WIRE_TRACE_MAGIC, head - tail, dropped };
+	bool status = file.write((uint8_t*)header, sizeof(header)) == sizeof(header);
+
+	/* The ring holds at most two runs: up to its end, then from its start */
+	uint32_t start = tail & RING_MASK;
+	uint32_t first = min<uint32_t>(head - tail, WIRE_TRACE_CAPACITY - start);
+	status = status && file.write(&ring[start], first) == first;
+	status = status && file.write(ring, head - tail - first) == head - tail - first;
+	file.close();
+	return status;
+}
+
+bool Wire_Trace::ParseRecord(const uint8_t bytes[], uint32_t size, uint32_t* position, Record* record) {
+	uint32_t p = *position;
+	if (p >= size)
+		return false;
+
+	uint8_t tag = bytes[p++];
+	record->rx = tag & WIRE_TRACE_RX_FLAG;
+	record->length = (tag & ~WIRE_TRACE_RX_FLAG) + 1;
+
+	record->delta_us = 0;
+	for (uint8_t shift = 0; ; shift += 7) {
+		if (p >= size || shift > 28)
+			return false;
+		uint8_t byte = bytes[p++];
+		record->delta_us |= (uint32_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			break;
+	}
+
+	if (p + record->length > size)
+		return false;
+
+	record->data = p;
+	*position = p + record->length;
+	return true;
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <Arduino.h>
+#include <stdint.h>
+
+#define WIRE_TRACE_FILE "/trace"			  // Last saved trace
+#define WIRE_TRACE_MAGIC (0x57545231UL)		  // "WTR1", marks a valid trace file
+#define WIRE_TRACE_CAPACITY (4096U)			  // Ring size in bytes, a power of two
+#define WIRE_TRACE_BURST_GAP_US (2000U)		  // Bytes closer than this in one direction share a record, about two bytes at 9600 baud
+#define WIRE_TRACE_MAX_BURST (128U)			  // Most bytes per record
+#define WIRE_TRACE_RX_FLAG (0x80U)			  // Tag bit of received bytes, the low bits hold length - 1
+
+static_assert((WIRE_TRACE_CAPACITY & (WIRE_TRACE_CAPACITY - 1)) == 0, "trace capacity must be a power of two");
+
+/**
+ * @brief Transport wrapper recording every byte the host sends or receives.
+ *
+ * Bytes are grouped into bursts, one record per burst: a tag byte with the
+ * direction and length, the microseconds since the previous record as a
+ * LEB128 varint, then the bytes themselves. Records go into a ring that
+ * drops the oldest ones when full, so the last few KB before a failure are
+ * always kept. The first record of a trace that dropped records has a delta
+ * relative to a record that is gone.
+ *
+ * Saved traces start with the magic, the size of the records and the number
+ * of records dropped (u32 each, little endian), and are replayed by Wire_Replay.
+ */
+class Wire_Trace : public Stream
+{
+public:
+	struct Record
+	{
+		bool rx;		  // Received from the target, sent by the host otherwise
+		uint8_t length;	  // Bytes in the burst
+		uint32_t delta_us; // Since the previous record
+		uint32_t data;	  // Offset of the first byte of the burst
+	};
+
+	/**
+	 * @brief Starts a new trace of everything passing through this wrapper
+	 *
+	 * @param transport	Stream to forward to. Must outlive the trace.
+	 */
+	void Start(Stream& transport);
+
+	/**
+	 * @brief Stops recording, the trace is kept until the next Start
+	 *
+	 * @return Stream* The wrapped transport, to bind the host to again
+	 */
+	Stream* Stop(void);
+
+	bool Recording() const { return inner != nullptr; }
+
+	/**
+	 * @brief Writes the trace to a file, oldest record first
+	 *
+	 * @param path	File to write
+	 * @return true		If the trace was written
+	 * @return false	If the file could not be written
+	 */
+	bool Save(const char* path = WIRE_TRACE_FILE) const;
+
+	uint32_t GetSize() const { return head - tail; }
+	uint32_t GetRecords() const { return records; }
+	uint32_t GetDropped() const { return dropped; }
+
+	/**
+	 * @brief Parses the record at a position of a saved trace
+	 *
+	 * @param bytes		The records of the trace
+	 * @param size		Size of the records in bytes
+	 * @param position	In: offset of the record, out: offset of the next one
+	 * @param record	Out: the record
+	 * @return true		If a whole record was parsed
+	 * @return false	At the end of the trace or on a truncated record
+	 */
+	static bool ParseRecord(const uint8_t bytes[], uint32_t size, uint32_t* position, Record* record);
+
+	int available() override;
+	int read() override;
+	int peek() override;
+	void flush() override;
+	size_t write(uint8_t byte) override;
+	size_t write(const uint8_t* buffer, size_t size) override;
+
+private:
+	Stream* inner = nullptr;
+	uint8_t ring[WIRE_TRACE_CAPACITY];
+	uint32_t head = 0;		  // Free-running write position
+	uint32_t tail = 0;		  // Free-running position of the oldest record
+	uint32_t records = 0;
+	uint32_t dropped = 0;	  // Records lost to the ring wrapping
+	uint32_t open_tag = 0;	  // Position of the tag of the record still growing
+	uint8_t open_length = 0;  // Its bytes so far, 0 when no record is open
+	bool open_rx = false;
+	uint32_t last_record_us = 0;
+	uint32_t last_byte_us = 0;
+
+	void Append(bool rx, const uint8_t* data, size_t length);
+	void Put(uint8_t byte);
+	void DropOldest(void);
+};
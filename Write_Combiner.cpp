@@ -0,0 +1,127 @@
+#include <Arduino.h>
+#include "Write_Combiner.h"
+#include "Bootloader_Host.h"
+#include "Utilities.h"
+
+bool Write_Combiner::Add(Bootloader_Host& host, uint32_t address, const uint8_t data[], uint32_t length) {
+	if (length == 0)
+		return true;
+
+	if (length > WRITE_COMBINE_CAPACITY) {
+		if (!Flush(host))
+			return false;
+		return host.SendMemWriteCommand(address, (uint8_t*)data, length);
+	}
+
+	/* Grow the range until no queued run is near it, a merge may bring in another */
+	uint32_t low = address;
+	uint32_t high = address + length;
+	uint8_t merged = 0;
+	uint8_t merged_count = 0;
+	for (bool grew = true; grew; ) {
+		grew = false;
+		for (uint8_t i = 0; i < run_count; i++) {
+			if ((merged & (1 << i)) || !Mergeable(runs[i], low, high - low))
+				continue;
+			merged |= 1 << i;
+			merged_count++;
+			low = min(low, runs[i].address);
+			high = max(high, runs[i].address + runs[i].length);
+			grew = true;
+		}
+	}
+
+	/* The merged range is built behind the queued data before the runs it replaces go */
+	if (used + (high - low) > WRITE_COMBINE_CAPACITY || (uint32_t)(run_count - merged_count) >= WRITE_COMBINE_MAX_RUNS) {
+		if (!Flush(host))
+			return false;
+		low = address;
+		high = address + length;
+		merged = 0;
+	}
+
+	if (run_count == 0)
+		oldest_ms = millis();
+
+	Run run = { low, high - low, used };
+	memset(&buffer[run.offset], WRITE_COMBINE_FILL, run.length);
+	for (uint8_t i = 0; i < run_count; i++) {
+		if (merged & (1 << i))
+			memcpy(&buffer[run.offset + runs[i].address - low], &buffer[runs[i].offset], runs[i].length);
+	}
+	memcpy(&buffer[run.offset + address - low], data, length);
+	used += run.length;
+
+	for (int8_t i = run_count - 1; i >= 0; i--) {
+		if (merged & (1 << i)) {
+			run.offset -= runs[i].length;
+			Remove(i);
+		}
+	}
+	runs[run_count++] = run;
+
+	queued++;
+	DEBUG_PRINTF("Queued %lu bytes at 0x%08X, %d ranges pending", length, address, run_count);
+	return true;
+}
+
+bool Write_Combiner::Flush(Bootloader_Host& host) {
+	if (run_count == 0)
+		return true;
+
+	/* Sorted by address, insertion sort as there are only a few */
+	Run pending[WRITE_COMBINE_MAX_RUNS];
+	uint8_t count = run_count;
+	for (uint8_t i = 0; i < count; i++) {
+		uint8_t j = i;
+		for (; j > 0 && pending[j - 1].address > runs[i].address; j--)
+			pending[j] = pending[j - 1];
+		pending[j] = runs[i];
+	}
+
+	/* The writes below go through the host's own flush, which must find nothing queued */
+	run_count = 0;
+	used = 0;
+
+	for (uint8_t i = 0; i < count; i++) {
+		if (!host.SendMemWriteCommand(pending[i].address, &buffer[pending[i].offset], pending[i].length)) {
+			DEBUG_PRINTF("Combined write at 0x%08X failed, %d ranges dropped", pending[i].address, count - i);
+			return false;
+		}
+		flushed_writes++;
+	}
+	return true;
+}
+
+bool Write_Combiner::Poll(Bootloader_Host& host, bool* flushed) {
+	*flushed = run_count != 0 && millis() - oldest_ms >= timeout_ms;
+	return !*flushed || Flush(host);
+}
+
+bool Write_Combiner::Mergeable(const Run& run, uint32_t address, uint32_t length) const {
+	uint32_t run_end = run.address + run.length;
+
+	/* Overlapping or touching */
+	if (address <= run_end && run.address <= address + length)
+		return true;
+
+	/* A gap is only bridged inside one page, so no other page is written */
+	uint32_t last_below = (run_end < address) ? run_end - 1 : address + length - 1;
+	uint32_t first_above = (run_end < address) ? address : run.address;
+	return first_above - last_below - 1 <= max_gap && last_below / page_size == first_above / page_size;
+}
+
+void Write_Combiner::Remove(uint8_t index) {
+	Run removed = runs[index];
+	memmove(&buffer[removed.offset], &buffer[removed.offset + removed.length], used - removed.offset - removed.length);
+	used -= removed.length;
+
+	for (uint8_t i = index; i + 1 < run_count; i++)
+		runs[i] = runs[i + 1];
+	run_count--;
+
+	for (uint8_t i = 0; i < run_count; i++) {
+		if (runs[i].offset > removed.offset)
+			runs[i].offset -= removed.length;
+	}
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <stdint.h>
+
+#define WRITE_COMBINE_CAPACITY (1024U)	 // Bytes held back, one data block
+#define WRITE_COMBINE_MAX_RUNS (8U)		 // Separate ranges held back
+#define WRITE_COMBINE_MAX_GAP (0U)		 // Default largest gap bridged between two writes, none
+#define WRITE_COMBINE_TIMEOUT_MS (200U)	 // Default age of the oldest queued write before it is flushed
+#define WRITE_COMBINE_FILL (0xFFU)		 // Value written to bridged gaps, that of erased flash
+
+class Bootloader_Host;
+
+/**
+ * @brief Write-combining buffer for small memory writes.
+ *
+ * Queued writes that overlap, touch or lie within max_gap bytes of each
+ * other in the same flash page are merged into one range, so they cost a
+ * single MEM_WRITE. A later write wins over the bytes of an earlier one.
+ * Bridged gaps are written with WRITE_COMBINE_FILL, which the STM32F1 can
+ * only program over erased half-words, so max_gap stays 0 unless the client
+ * knows the flash between its writes is erased.
+ *
+ * The owning host flushes the buffer before any other write, read, erase,
+ * batch, new session or jump, which keeps every operation ordered after
+ * the writes queued before it. Poll() flushes it once the oldest queued
+ * write is older than the timeout.
+ */
+class Write_Combiner
+{
+public:
+	/**
+	 * @brief Queues a write, merging it with the queued writes it is near
+	 * @note  A write that does not fit is sent right away, after a flush
+	 *
+	 * @param host		Host bound to the target, for the flushes
+	 * @param address	The start address of the write
+	 * @param data		The data to write, copied
+	 * @param length	The length of the data in bytes
+	 * @return true		If the write was queued, or sent and acknowledged
+	 * @return false	If a flush it caused failed
+	 */
+	bool Add(Bootloader_Host& host, uint32_t address, const uint8_t data[], uint32_t length);
+
+	/**
+	 * @brief Sends every queued range, in address order
+	 *
+	 * @return true		If every range was written, or nothing was queued
+	 * @return false	If a range failed, the ranges after it are dropped too
+	 */
+	bool Flush(Bootloader_Host& host);
+
+	/**
+	 * @brief Flushes once the oldest queued write reached the timeout
+	 *
+	 * @param flushed	Out: whether a flush ran
+	 * @return false	If the flush failed
+	 */
+	bool Poll(Bootloader_Host& host, bool* flushed);
+
+	/**
+	 * @brief Sets the largest gap bridged between two writes, only for erased flash
+	 */
+	void SetMaxGap(uint32_t bytes) { max_gap = bytes; }
+	uint32_t GetMaxGap() const { return max_gap; }
+	void SetTimeout(uint32_t ms) { timeout_ms = ms; }
+	uint32_t GetTimeout() const { return timeout_ms; }
+
+	/**
+	 * @brief Sets the flash page size, gaps are only bridged within a page
+	 * @note  0 is ignored, the previous size stays
+	 */
+	void SetPageSize(uint32_t size) {
+		if (size)
+			page_size = size;
+	}
+
+	bool Pending() const { return run_count != 0; }
+	uint32_t GetPendingBytes() const { return used; }
+	uint32_t GetQueued() const { return queued; }	// Writes queued since start-up
+	uint32_t GetFlushedWrites() const { return flushed_writes; } // MEM_WRITE commands they were sent as
+
+private:
+	struct Run
+	{
+		uint32_t address;
+		uint32_t length;
+		uint32_t offset; // Of its data in buffer
+	};
+
+	uint8_t buffer[WRITE_COMBINE_CAPACITY];
+	Run runs[WRITE_COMBINE_MAX_RUNS];
+	uint8_t run_count = 0;
+	uint32_t used = 0;			// Bytes of buffer holding run data, packed
+	uint32_t oldest_ms = 0;		// When the first of the queued writes was queued
+	uint32_t max_gap = WRITE_COMBINE_MAX_GAP;
+	uint32_t timeout_ms = WRITE_COMBINE_TIMEOUT_MS;
+	uint32_t page_size = 1024;	// STM32F103 default
+
+	uint32_t queued = 0;
+	uint32_t flushed_writes = 0;
+
+	bool Mergeable(const Run& run, uint32_t address, uint32_t length) const;
+	void Remove(uint8_t index);
+};
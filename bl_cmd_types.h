@@ -21,6 +21,10 @@
 #define BL_PACKED_ALIGNED __attribute__((packed, aligned(1)))
 
 #define BL_DATA_BLOCK_SIZE (1024U)
+#define BL_MEM_READ_MAX_WINDOW (8U) // Most data packets a streaming read may send ahead of the host's ACK
+#define BL_BATCH_MAX_SIZE (128U)	// Largest BATCH command, header included
+#define BL_BATCH_MAX_COMMANDS (8U)	// Most sub-commands in one BATCH command
+#define BL_FLASH_ERASE_MASS (0xFFFFFFFFU) // FLASH ERASE address and page count asking for a mass erase
   /*******************************************************************************
    *							Typedefs						        		   *
    *******************************************************************************/
@@ -42,9 +46,16 @@ __attribute__((packed))
 		BL_ENTER_CMD_MODE_CMD_ID,	/**< BL_ENTER_CMD_MODE_CMD_ID */
 		BL_JUMP_TO_APP_CMD_ID,		/**< BL_JUMP_TO_APP_CMD_ID */
 		BL_DATA_PACKET_CMD_ID,		/**< BL_DATA_PACKET_CMD_ID */
+		BL_STREAM_PACKET_CMD_ID,	/**< BL_STREAM_PACKET_CMD_ID */
+		BL_BATCH_CMD_ID,			/**< BL_BATCH_CMD_ID */
+		BL_FEC_CMD_ID,				/**< BL_FEC_CMD_ID */
 		BL_RESPONSE_CMD_ID = 0xFF	/**< BL_RESPONSE_CMD_ID */
 } BL_CommandID_t;
 
+/* Range of the commands that can appear in a frame header, BL_RESPONSE_CMD_ID aside */
+#define BL_CommandID_t_FIRST BL_GOTO_ADDR_CMD_ID
+#define BL_CommandID_t_LAST BL_FEC_CMD_ID
+
 typedef enum
 __attribute__((packed))
 {
@@ -133,10 +144,35 @@ typedef union BL_PACKED_ALIGNED
 	} data;
 } BL_MEM_READ_CMD;
 
+/**
+ * @union BL_MEM_READ_STREAM_CMD
+ * @brief Union representing the received "MEM READ" command asking for a streaming read.
+ *
+ * Same command ID as BL_MEM_READ_CMD, told apart by its payload size. A client
+ * that supports streaming ACKs it with the granted window (1 to window) in the
+ * ACK field, then sends BL_STREAM_PACKET_CMD packets up to that many ahead of
+ * the last BL_STREAM_ACK. A client that does not either NACKs it or ACKs it
+ * with BL_NACK_SUCCESS and reads packet by packet.
+ */
+typedef union BL_PACKED_ALIGNED
+{
+	uint8_t serialized_data[sizeof(BL_CommandHeader_t) + 9];
+	struct BL_PACKED_ALIGNED
+	{
+		BL_CommandHeader_t header;
+		uint32_t start_addr; /**< Start address */
+		uint32_t length;	 /**< Length of data to read */
+		uint8_t window;		 /**< Packets the host can take ahead of its ACKs */
+	} data;
+} BL_MEM_READ_STREAM_CMD;
+
 /**
  * @union BL_FLASH_ERASE_CMD
  * @brief Union representing the received "FLASH ERASE" command.
  *
+ * With both the address and the page count set to BL_FLASH_ERASE_MASS it asks
+ * for a mass erase of the whole flash. Clients without one NACK it as an
+ * invalid address.
  */
 typedef union BL_PACKED_ALIGNED
 {
@@ -181,6 +217,26 @@ typedef union BL_PACKED_ALIGNED
 	} data;
 } BL_DATA_PACKET_CMD;
 
+/**
+ * @union	BL_STREAM_PACKET_CMD
+ * @brief	Union representing a "DATA PACKET" of a streaming read.
+ *
+ * Laid out as BL_DATA_PACKET_CMD, with the index of the packet within the
+ * read in place of the next block length.
+ */
+typedef union BL_PACKED_ALIGNED
+{
+	uint8_t serialized_data[sizeof(BL_CommandHeader_t) + BL_DATA_BLOCK_SIZE + 9];
+	struct BL_PACKED_ALIGNED
+	{
+		BL_CommandHeader_t header;
+		uint32_t data_len;
+		uint32_t packet_index;
+		uint8_t end_flag;
+		uint8_t data_block[BL_DATA_BLOCK_SIZE];
+	} data;
+} BL_STREAM_PACKET_CMD;
+
 /**
  * @union	BL_JUMP_TO_APP_CMD
  * @brief	Union representing the received "JUMP TO APP" command.
@@ -196,6 +252,44 @@ typedef union BL_PACKED_ALIGNED
 	} data;
 } BL_JUMP_TO_APP_CMD;
 
+/**
+ * @union	BL_BATCH_CMD
+ * @brief	Union representing the received "BATCH" command.
+ *
+ * Carries count complete commands back to back, each with its own header and
+ * CRC. The client runs them in order and stops at the first failure. Only
+ * commands without a data phase can be batched (no MEM_WRITE or MEM_READ).
+ */
+typedef union BL_PACKED_ALIGNED
+{
+	uint8_t serialized_data[BL_BATCH_MAX_SIZE];
+	struct BL_PACKED_ALIGNED
+	{
+		BL_CommandHeader_t header;
+		uint8_t count; /**< Number of sub-commands */
+		uint8_t commands[BL_BATCH_MAX_SIZE - sizeof(BL_CommandHeader_t) - 1];
+	} data;
+} BL_BATCH_CMD;
+
+/**
+ * @union	BL_FEC_CMD
+ * @brief	Union representing the received "FEC" command.
+ *
+ * Turns forward error correction of data packets on or off for the session,
+ * in both directions, starting with the next data packet (see bl_fec.h).
+ * Entering command mode or jumping to the application turns it off again.
+ * Clients without FEC NACK it with BL_NACK_INVALID_CMD.
+ */
+typedef union BL_PACKED_ALIGNED
+{
+	uint8_t serialized_data[sizeof(BL_CommandHeader_t) + 4];
+	struct BL_PACKED_ALIGNED
+	{
+		BL_CommandHeader_t header;
+		uint32_t segment_size; /**< BL_FEC_SEGMENT_SIZE to enable, 0 to disable */
+	} data;
+} BL_FEC_CMD;
+
 /* Sent data */
 
 /**
@@ -214,6 +308,25 @@ typedef union BL_PACKED_ALIGNED
 	} data;
 } BL_ACK;
 
+/**
+ * @union BL_STREAM_ACK
+ * @brief Union representing the sent ACK of a streaming read.
+ *
+ * An ACK confirms every packet before packet_index. A NACK asks the client to
+ * resend starting at packet_index.
+ */
+typedef union BL_PACKED_ALIGNED
+{
+	uint8_t serialized_data[7];
+	struct BL_PACKED_ALIGNED
+	{
+		BL_CommandID_t cmd_id; /**< Command ID */
+		uint8_t ack;		   /**< ACK value */
+		BL_NACK_t field;	   /**< NACK field */
+		uint32_t packet_index; /**< Next packet expected by the host */
+	} data;
+} BL_STREAM_ACK;
+
 /**
  * @union BL_Response
  * @brief Union representing the response data.
@@ -229,6 +342,37 @@ typedef union BL_PACKED_ALIGNED
 	} data;
 } BL_Response;
 
+/**
+ * @struct BL_BATCH_RESULT
+ * @brief Outcome of one sub-command of a BATCH command.
+ *
+ */
+typedef struct BL_PACKED_ALIGNED
+{
+	BL_CommandID_t cmd_id; /**< Command ID of the sub-command */
+	uint8_t ack;		   /**< ACK value */
+	BL_NACK_t field;	   /**< NACK field */
+	uint8_t value;		   /**< Version for VER, 0 otherwise */
+} BL_BATCH_RESULT;
+
+/**
+ * @union BL_BATCH_RESPONSE
+ * @brief Union representing the response to a BATCH command.
+ *
+ * Holds one result per sub-command that ran; count is lower than the number
+ * of sub-commands when one of them failed.
+ */
+typedef union BL_PACKED_ALIGNED
+{
+	uint8_t serialized_data[sizeof(BL_CommandHeader_t) + 1 + BL_BATCH_MAX_COMMANDS * sizeof(BL_BATCH_RESULT)];
+	struct BL_PACKED_ALIGNED
+	{
+		BL_CommandHeader_t header;
+		uint8_t count; /**< Number of results */
+		BL_BATCH_RESULT results[BL_BATCH_MAX_COMMANDS];
+	} data;
+} BL_BATCH_RESPONSE;
+
 /**
  * @struct BL_Response_data
  * @brief Structure representing the response data with crc.
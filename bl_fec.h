@@ -0,0 +1,117 @@
+/**
+ * @file bl_fec.h
+ * @brief   Forward error correction of data blocks
+ *
+ * Every segment of BL_FEC_SEGMENT_SIZE data bytes gets BL_FEC_CHECK_SIZE check
+ * bytes: a Hamming code per bit plane (bit b of every byte of the segment),
+ * plus the parity of each plane. Check byte k holds bit k of the syndrome of
+ * all eight planes, the last one their parity. A single corrupted byte is at
+ * most one flipped bit per plane, so it is corrected in place. Anything worse
+ * is left to the packet CRC, which still decides whether a block is resent.
+ *
+ * When FEC is enabled for the session, the check bytes of a data packet
+ * follow it on the wire as a trailer, outside its payload size and CRC.
+ */
+#ifndef BL_FEC_H_
+#define BL_FEC_H_
+/*******************************************************************************
+ *                              Includes                                       *
+ *******************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+#include "bl_cmd_types.h"
+/*******************************************************************************
+ *                              Definitions                                    *
+ *******************************************************************************/
+
+#define BL_FEC_SEGMENT_SIZE (64U) // Data bytes per segment, positions 1 to 64 need 7 syndrome bits
+#define BL_FEC_CHECK_SIZE (8U)	  // 7 syndrome bytes and 1 parity byte per segment
+
+#define BL_FEC_TRAILER_SIZE(data_len) \
+	((((data_len) + BL_FEC_SEGMENT_SIZE - 1) / BL_FEC_SEGMENT_SIZE) * BL_FEC_CHECK_SIZE)
+
+#define BL_FEC_MAX_TRAILER_SIZE BL_FEC_TRAILER_SIZE(BL_DATA_BLOCK_SIZE)
+
+/*******************************************************************************
+ *                            Public functions                                 *
+ *******************************************************************************/
+
+/**
+ * @fn void bl_fec_segment_check(const uint8_t*, uint32_t, uint8_t*)
+ * @brief	Calculates the check bytes of one segment
+ *
+ * @param data	The segment
+ * @param size	Size of the segment, at most BL_FEC_SEGMENT_SIZE
+ * @param check	Out: BL_FEC_CHECK_SIZE check bytes
+ */
+inline void bl_fec_segment_check(const uint8_t* data, uint32_t size, uint8_t* check) {
+	memset(check, 0, BL_FEC_CHECK_SIZE);
+
+	for (uint32_t i = 0; i < size; i++) {
+		uint32_t position = i + 1;
+		for (uint32_t k = 0; k < BL_FEC_CHECK_SIZE - 1; k++) {
+			if (position & (1 << k))
+				check[k] ^= data[i];
+		}
+		check[BL_FEC_CHECK_SIZE - 1] ^= data[i];
+	}
+}
+
+/**
+ * @fn void bl_fec_encode(const uint8_t*, uint32_t, uint8_t*)
+ * @brief	Calculates the trailer of a data block
+ *
+ * @param data		The data block
+ * @param size		Size of the block in bytes
+ * @param trailer	Out: BL_FEC_TRAILER_SIZE(size) check bytes
+ */
+inline void bl_fec_encode(const uint8_t* data, uint32_t size, uint8_t* trailer) {
+	for (uint32_t offset = 0; offset < size; offset += BL_FEC_SEGMENT_SIZE) {
+		uint32_t segment = (size - offset < BL_FEC_SEGMENT_SIZE) ? size - offset : BL_FEC_SEGMENT_SIZE;
+		bl_fec_segment_check(&data[offset], segment, &trailer[offset / BL_FEC_SEGMENT_SIZE * BL_FEC_CHECK_SIZE]);
+	}
+}
+
+/**
+ * @fn uint32_t bl_fec_correct(uint8_t*, uint32_t, const uint8_t*)
+ * @brief	Corrects a received data block in place using its trailer
+ *
+ * @param data		The data block
+ * @param size		Size of the block in bytes
+ * @param trailer	The received trailer
+ * @return	Number of bits corrected
+ */
+inline uint32_t bl_fec_correct(uint8_t* data, uint32_t size, const uint8_t* trailer) {
+	uint32_t corrected = 0;
+
+	for (uint32_t offset = 0; offset < size; offset += BL_FEC_SEGMENT_SIZE) {
+		uint32_t segment = (size - offset < BL_FEC_SEGMENT_SIZE) ? size - offset : BL_FEC_SEGMENT_SIZE;
+		const uint8_t* expected = &trailer[offset / BL_FEC_SEGMENT_SIZE * BL_FEC_CHECK_SIZE];
+
+		uint8_t diff[BL_FEC_CHECK_SIZE];
+		bl_fec_segment_check(&data[offset], segment, diff);
+		for (uint32_t k = 0; k < BL_FEC_CHECK_SIZE; k++)
+			diff[k] ^= expected[k];
+
+		/* Only planes with a parity error hold a single flipped data bit. A syndrome
+		   without one is a corrupted check byte or a double error, left to the CRC */
+		uint8_t parity = diff[BL_FEC_CHECK_SIZE - 1];
+		for (uint32_t bit = 0; parity; bit++, parity >>= 1) {
+			if (!(parity & 1))
+				continue;
+
+			uint32_t position = 0;
+			for (uint32_t k = 0; k < BL_FEC_CHECK_SIZE - 1; k++)
+				position |= ((diff[k] >> bit) & 1) << k;
+
+			if (position >= 1 && position <= segment) {
+				data[offset + position - 1] ^= (1 << bit);
+				corrected++;
+			}
+		}
+	}
+
+	return corrected;
+}
+#endif
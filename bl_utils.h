@@ -15,6 +15,7 @@
  *******************************************************************************/
 
 #include <stdint.h>
+#include <stddef.h>
 #include "bl_cmd_types.h"
 /*******************************************************************************
  *                              Definitions                                    *
@@ -29,6 +30,7 @@
 #define BL_VALID_COMMAND(cmd) IS_ENUM_MEMBER(BL_CommandID_t, cmd)
 
 #define CRC32_POLY 0xEDB88320
+#define BL_CRC_INIT 0xFFFFFFFF
 
 #define VALIDATE_CMD(data, length, crc) \
 	(bl_calculate_command_crc(data, length) == crc)
@@ -38,23 +40,22 @@
  *******************************************************************************/
 
 /**
- * @fn uint32_t bl_calculate_command_crc(void*, uint32_t)
- * @brief	Calculates the CRC for a command
+ * @fn uint32_t bl_crc_update(uint32_t, const uint8_t*, uint32_t, uint32_t)
+ * @brief	Continues a command CRC over the next part of a command received in pieces
  *
- * @param command	Pointer to the command struct
- * @param size		Size of the command in bytes
- * @return
+ * @param crc		Running CRC, BL_CRC_INIT for the first part
+ * @param data		Next part of the command
+ * @param size		Size of the part in bytes
+ * @param offset	Offset of the part within the command
+ * @return	Running CRC, complement it after the last part
  */
-uint32_t bl_calculate_command_crc(void *command, uint32_t size);
-
-uint32_t bl_calculate_command_crc(void* command, uint32_t size) {
-	const uint8_t* data = (const uint8_t*)command;
-	uint32_t crc = 0xFFFFFFFF;
+inline uint32_t bl_crc_update(uint32_t crc, const uint8_t* data, uint32_t size, uint32_t offset) {
 	uint32_t crc_offset = offsetof(BL_CommandHeader_t, CRC32);
 
 	// Calculate CRC for the command (excluding the CRC field)
 	for (uint32_t i = 0; i < size; i++) {
-		if (i < crc_offset || i >= crc_offset + sizeof(uint32_t)) {
+		uint32_t position = offset + i;
+		if (position < crc_offset || position >= crc_offset + sizeof(uint32_t)) {
 			crc ^= data[i];
 
 			for (int j = 0; j < 8; j++) {
@@ -63,6 +64,18 @@ uint32_t bl_calculate_command_crc(void* command, uint32_t size) {
 		}
 	}
 
-	return ~crc;
+	return crc;
+}
+
+/**
+ * @fn uint32_t bl_calculate_command_crc(void*, uint32_t)
+ * @brief	Calculates the CRC for a command
+ *
+ * @param command	Pointer to the command struct
+ * @param size		Size of the command in bytes
+ * @return
+ */
+inline uint32_t bl_calculate_command_crc(void* command, uint32_t size) {
+	return ~bl_crc_update(BL_CRC_INIT, (const uint8_t*)command, size, 0);
 }
 #endif
@@ -0,0 +1,90 @@
+/**
+ * @file host_cmd_types.h
+ * @brief	Host-only WebSocket command types
+ * @version 0.1
+ *
+ * Commands handled entirely by the host. They share the "commandId" field
+ * with BL_CommandID_t, so their values start above the bootloader's range.
+ *
+ */
+
+#ifndef HOST_CMD_TYPES_H_
+#define HOST_CMD_TYPES_H_
+
+ /*******************************************************************************
+  *                              Includes                                       *
+  *******************************************************************************/
+
+#include <stdint.h>
+
+/*******************************************************************************
+ *                              Definitions                                    *
+ *******************************************************************************/
+
+/* Binary control frames, all fields little endian:
+ * request:	opcode (u8), request id (u16), arguments
+ * reply:	opcode (u8), request id (u16), status (u8), error (u8), payload
+ */
+#define HOST_BIN_HEADER_SIZE (3U)
+#define HOST_BIN_REPLY_HEADER_SIZE (5U)
+#define HOST_BIN_MAX_READ_LENGTH (2048U) // Largest MEM_READ served from the static reply buffer
+
+/* Transfer progress event, sent unsolicited to a subscribed client as a reply
+ * to HOST_PROGRESS_CMD_ID with request id 0, status 1 until a failed final event:
+ * op (u8, 0 write, 1 read), final (u8), address (u32), done (u32), total (u32),
+ * rate (u32, B/s), average rate (u32, B/s), retries (u32), eta (u32, ms)
+ */
+#define HOST_BIN_PROGRESS_SIZE (30U)
+
+/*******************************************************************************
+ *							Typedefs						        		   *
+ *******************************************************************************/
+
+ /**
+  * @enum	HOST_CommandID_t
+  * @brief	Available host commands
+  *
+  */
+typedef enum
+{
+	HOST_CACHED_WRITE_CMD_ID = 0x80, /**< Write a cached image to the target */
+	HOST_CACHE_STORE_CMD_ID,		 /**< Store an image in the cache without writing it */
+	HOST_PLANNED_WRITE_CMD_ID,		 /**< Erase and write a cached image following a layout-aware plan */
+	HOST_OVERHEAD_CMD_ID,			 /**< Report JSON and binary codec overhead (binary only) */
+	HOST_POOL_STATS_CMD_ID,			 /**< Report packet pool usage and heap fragmentation */
+	HOST_MEMORY_STATS_CMD_ID,		 /**< Report memory accounting per buffer category and command */
+	HOST_METRICS_CMD_ID,			 /**< Report per-phase latency histograms (binary only) */
+	HOST_UPDATE_JOB_CMD_ID,			 /**< Plan, erase, write, verify and jump in one request, streaming progress */
+	HOST_RESUME_WRITE_CMD_ID,		 /**< Continue the last interrupted cached write from its checkpoint */
+	HOST_BENCHMARK_CMD_ID,			 /**< Time the protocol layer and compare with the saved baseline */
+	HOST_TRACE_CMD_ID,				 /**< Record the wire traffic, save the trace or replay it against a scripted target */
+	HOST_WRITE_BARRIER_CMD_ID,		 /**< Send every write queued with "combine", also reported on a timeout flush */
+	HOST_PROGRESS_CMD_ID,			 /**< Subscribe to rate-limited progress events of memmory writes and reads */
+	HOST_MULTI_FLASH_CMD_ID,		 /**< Erase and write the same image on several targets concurrently */
+} HOST_CommandID_t;
+
+/*******************************************************************************
+ *                            Public functions                                 *
+ *******************************************************************************/
+
+static inline uint16_t host_read_le16(const uint8_t* p) {
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t host_read_le32(const uint8_t* p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void host_write_le16(uint8_t* p, uint16_t value) {
+	p[0] = (uint8_t)value;
+	p[1] = (uint8_t)(value >> 8);
+}
+
+static inline void host_write_le32(uint8_t* p, uint32_t value) {
+	p[0] = (uint8_t)value;
+	p[1] = (uint8_t)(value >> 8);
+	p[2] = (uint8_t)(value >> 16);
+	p[3] = (uint8_t)(value >> 24);
+}
+
+#endif /* HOST_CMD_TYPES_H_ */